@@ -1,8 +1,189 @@
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <array>
 #include <charconv>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "smctemp.h"
+#include "smctemp_adaptive.h"
+#include "smctemp_clock.h"
+#include "smctemp_daemon.h"
+#include "smctemp_format.h"
+#include "smctemp_shm.h"
+#include "smctemp_trace.h"
+
+namespace {
+enum LongOption {
+  kLongOptionDaemon = 256,
+  kLongOptionClient,
+  kLongOptionSocket,
+  kLongOptionShm,
+  kLongOptionStream,
+  kLongOptionCount,
+  kLongOptionDuration,
+  kLongOptionKeys,
+  kLongOptionIndexOnly,
+  kLongOptionSnapshot,
+  kLongOptionQuorum,
+  kLongOptionHealth,
+  kLongOptionMaxAge,
+  kLongOptionWindow,
+  kLongOptionAggregate,
+  kLongOptionClusters,
+  kLongOptionAdaptive,
+  kLongOptionThreshold,
+  kLongOptionRecord,
+  kLongOptionReplay,
+  kLongOptionReplaySpeed,
+  kLongOptionStats,
+  kLongOptionFormat,
+};
+
+const struct option kLongOptions[] = {
+  {"daemon", no_argument, nullptr, kLongOptionDaemon},
+  {"client", no_argument, nullptr, kLongOptionClient},
+  {"socket", required_argument, nullptr, kLongOptionSocket},
+  {"shm", optional_argument, nullptr, kLongOptionShm},
+  {"stream", no_argument, nullptr, kLongOptionStream},
+  {"count", required_argument, nullptr, kLongOptionCount},
+  {"duration", required_argument, nullptr, kLongOptionDuration},
+  {"keys", required_argument, nullptr, kLongOptionKeys},
+  {"index-only", no_argument, nullptr, kLongOptionIndexOnly},
+  {"snapshot", no_argument, nullptr, kLongOptionSnapshot},
+  {"quorum", required_argument, nullptr, kLongOptionQuorum},
+  {"health", no_argument, nullptr, kLongOptionHealth},
+  {"max-age", required_argument, nullptr, kLongOptionMaxAge},
+  {"window", required_argument, nullptr, kLongOptionWindow},
+  {"aggregate", required_argument, nullptr, kLongOptionAggregate},
+  {"clusters", no_argument, nullptr, kLongOptionClusters},
+  {"adaptive", optional_argument, nullptr, kLongOptionAdaptive},
+  {"threshold", required_argument, nullptr, kLongOptionThreshold},
+  {"record", required_argument, nullptr, kLongOptionRecord},
+  {"replay", required_argument, nullptr, kLongOptionReplay},
+  {"replay-speed", required_argument, nullptr, kLongOptionReplaySpeed},
+  {"stats", no_argument, nullptr, kLongOptionStats},
+  {"format", required_argument, nullptr, kLongOptionFormat},
+  {nullptr, 0, nullptr, 0},
+};
+
+volatile sig_atomic_t g_interrupted = 0;
+
+void onInterrupt(int) {
+  g_interrupted = 1;
+}
+
+// Prints one reading of op every interval_ms, or as often as adaptive says if
+// set, until count samples or duration_s seconds (0 for no limit) have passed
+// or SIGINT arrives. The deadlines are absolute, so slow reads do not push
+// later samples back. Formats other than kText name the statistics after op,
+// e.g. cpu_p95.
+int stream(smctemp::SmcTemp& smc_temp, int op, unsigned int interval_ms, unsigned int count,
+           unsigned int duration_s, bool isFailSoft, smctemp::AdaptiveRate* adaptive,
+           smctemp::OutputFormat format) {
+  static const char* const kFieldNames[2][7] = {
+    {"cpu", "cpu_min", "cpu_max", "cpu_mean", "cpu_ewma", "cpu_p95", "cpu_p99"},
+    {"gpu", "gpu_min", "gpu_max", "gpu_mean", "gpu_ewma", "gpu_p95", "gpu_p99"},
+  };
+  const char* const* names = kFieldNames[op == smctemp::kOpReadCpuTemp ? 0 : 1];
+  smctemp::SampleFormatter formatter(STDOUT_FILENO, format);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onInterrupt;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  const int64_t end_ns = smctemp::MonotonicNs() + int64_t{duration_s} * 1'000'000'000;
+  smctemp::PeriodicTimer timer(std::chrono::milliseconds{interval_ms});
+  unsigned int samples = 0;
+  std::cout << std::fixed << std::setprecision(1);
+  while (!g_interrupted) {
+    double temp = op == smctemp::kOpReadCpuTemp ? smc_temp.GetCpuTemp() : smc_temp.GetGpuTemp();
+    const bool valid = smc_temp.IsValidTemperature(temp, smctemp::kValidTemperatureLimits);
+    if (adaptive != nullptr) {
+      const int64_t now_ns = smctemp::MonotonicNs();
+      timer.SetPeriod(valid ? adaptive->Update(now_ns, temp) : adaptive->Missed(now_ns));
+    }
+    if (isFailSoft && !valid) {
+      temp = op == smctemp::kOpReadCpuTemp ? smc_temp.GetLastValidCpuTemp() : smc_temp.GetLastValidGpuTemp();
+    }
+    smctemp::StatsSnapshot_t snapshot = {};
+    smctemp::TemperatureStats* stats = smc_temp.Stats();
+    if (stats != nullptr) {
+      snapshot = (op == smctemp::kOpReadCpuTemp ? stats->Cpu() : stats->Gpu()).Snapshot(smctemp::MonotonicNs());
+    }
+    if (format == smctemp::OutputFormat::kText) {
+      std::cout << temp;
+      if (stats != nullptr) {
+        std::cout << " min " << snapshot.min << " max " << snapshot.max << " mean " << snapshot.mean
+          << " ewma " << snapshot.ewma << " p95 " << snapshot.p95 << " p99 " << snapshot.p99;
+      }
+      std::cout << std::endl;
+    } else {
+      const smctemp::OutputField_t fields[] = {
+        {names[0], temp, false}, {names[1], snapshot.min, false}, {names[2], snapshot.max, false},
+        {names[3], snapshot.mean, false}, {names[4], snapshot.ewma, false}, {names[5], snapshot.p95, false},
+        {names[6], snapshot.p99, false},
+      };
+      formatter.Write(smctemp::RealtimeNs(), fields, stats != nullptr ? 7 : 1);
+    }
+    samples++;
+    if ((count > 0 && samples >= count) ||
+        (duration_s > 0 && smctemp::MonotonicNs() + timer.PeriodNs() > end_ns)) {
+      break;
+    }
+    if (!timer.Wait()) {
+      break;
+    }
+  }
+  std::cerr << "samples: " << samples << ", overruns: " << timer.Overruns()
+    << ", jitter mean: " << timer.MeanJitterNs() / 1'000.0 << " us"
+    << ", max: " << timer.MaxJitterNs() / 1'000.0 << " us";
+  if (adaptive != nullptr) {
+    const int64_t now_ns = smctemp::MonotonicNs();
+    std::cerr << ", rate: " << adaptive->EffectiveRateHz(now_ns) << " Hz"
+      << ", saved: " << adaptive->SamplesSaved(now_ns) << " samples";
+  }
+  std::cerr << std::endl;
+  return 0;
+}
+
+// The latest sample of a running daemon: from shared memory segment shm_name
+// if set and its sample is current and has a valid value of each temperature
+// op asks for, otherwise from the daemon's socket. False if no daemon
+// answered.
+bool queryDaemon(const std::string& shm_name, const std::string& socket_path, uint32_t op,
+                 smctemp::DaemonReply_t& reply) {
+  if (!shm_name.empty()) {
+    const uint32_t needed = op == smctemp::kDaemonOpCpu ? smctemp::kSharedSampleCpuValid
+                            : op == smctemp::kDaemonOpGpu ? smctemp::kSharedSampleGpuValid
+                            : smctemp::kSharedSampleCpuValid | smctemp::kSharedSampleGpuValid;
+    smctemp::SharedSampleReader reader(shm_name);
+    smctemp::SharedSample_t sample;
+    if (reader.Read(sample) && (sample.flags & needed) == needed &&
+        smctemp::IsSharedSampleCurrent(sample, smctemp::RealtimeNs())) {
+      reply.cpu = sample.cpu;
+      reply.gpu = sample.gpu;
+      return true;
+    }
+  }
+  return smctemp::QueryDaemon(socket_path, op, reply);
+}
+
+// The call counts and latencies of the run, if --stats enabled them.
+void printMetrics(const smctemp::SmcTemp& smc_temp) {
+  if (const smctemp::SmcMetrics* metrics = smc_temp.Metrics()) {
+    metrics->Print(std::cerr);
+  }
+}
+}
 
 void usage(char* prog) {
   std::cout << "Check Temperature by using Apple System Management Control (Smc) tool " << smctemp::kVersion << std::endl;
@@ -15,28 +196,150 @@ void usage(char* prog) {
     << std::endl;
   std::cout << "    -l         : list all keys and values" << std::endl;
   std::cout << "    -f         : fail-soft mode. Shows last valid value if current sensor read fails." << std::endl;
+  std::cout << "    -k         : keep SMC key info and the live sensor keys in /tmp/smctemp/ so that later runs skip"
+    << " looking them up" << std::endl;
   std::cout << "    -v         : version" << std::endl;
   std::cout << "    -n         : tries to query the temperature sensors for n times (e.g. -n3)";
   std::cout << " (1 second interval) until a valid value is returned" << std::endl;
+  std::cout << "                 (each retry re-reads only the sensors that returned out-of-range values)" << std::endl;
+  std::cout << "    --daemon   : keep sampling every -i milliseconds and serve the latest values on a UNIX socket"
+    << std::endl;
+  std::cout << "    --client   : answer -c/-g from a running daemon, reading the SMC only if none answers" << std::endl;
+  std::cout << "    --socket   : daemon socket path (default: " << smctemp::kDefaultSocketPath << ")" << std::endl;
+  std::cout << "    --shm[=N]  : with --daemon, also publish samples to shared memory N (default: "
+    << smctemp::kDefaultSharedMemoryName << ");" << std::endl;
+  std::cout << "                 with --client, read them from there" << std::endl;
+  std::cout << "    --stream   : with -c or -g, print a reading every -i milliseconds until interrupted" << std::endl;
+  std::cout << "    --count    : with --stream, stop after this many readings" << std::endl;
+  std::cout << "    --duration : with --stream, stop after this many seconds" << std::endl;
+  std::cout << "    --keys     : with -l, list only keys matching comma separated prefixes or globs (e.g. --keys='Tp,Tg*')"
+    << std::endl;
+  std::cout << "    --index-only : with -l, list keys and types without reading values" << std::endl;
+  std::cout << "    --snapshot [KEY...] : print CPU and GPU temperatures, then the values of KEYs, on one line"
+    << std::endl;
+  std::cout << "                 (-c -g is the same as --snapshot)" << std::endl;
+  std::cout << "    --quorum   : with -n, retry until this percentage of the sensors is valid (default: one sensor)"
+    << std::endl;
+  std::cout << "    --health   : with --stream, print per-sensor read counts and quarantined keys when done" << std::endl;
+  std::cout << "    --max-age  : with -f, ignore last valid values stored more than this many seconds ago" << std::endl;
+  std::cout << "    --window   : with --stream, also print min, max, mean, p95 and p99 over this many seconds and an"
+    << std::endl;
+  std::cout << "                 EWMA with a tenth of that time constant; with --daemon, the"
+    << std::endl;
+  std::cout << "                 window of the cpu-stats and gpu-stats requests (default: 60)" << std::endl;
+  std::cout << "    --aggregate : combine the valid sensors by mean, median, trimmed (mean without the highest and"
+    << std::endl;
+  std::cout << "                 lowest quarter), max or cluster-max (hottest core cluster mean) (default: mean)"
+    << std::endl;
+  std::cout << "    --clusters : with -c, also print the mean of each CPU core cluster, one per line" << std::endl;
+  std::cout << "    --adaptive[=MS] : with --stream or --daemon, sample every -i milliseconds only while the"
+    << std::endl;
+  std::cout << "                 temperature moves or nears --threshold, and every MS milliseconds while it is flat"
+    << std::endl;
+  std::cout << "                 (default: 1000)" << std::endl;
+  std::cout << "    --threshold : with --adaptive, degrees Celsius never to cross without sampling at the -i rate"
+    << std::endl;
+  std::cout << "    --record   : write every SMC call and its reply to a trace file" << std::endl;
+  std::cout << "    --replay   : answer SMC calls from a trace file written by --record instead of the SMC" << std::endl;
+  std::cout << "    --replay-speed : with --replay, fast (default) or recorded to keep the recorded timing"
+    << std::endl;
+  std::cout << "    --stats    : print SMC call counts, latency percentiles and per-key failures to stderr when"
+    << " done; with --daemon, answer the metrics request" << std::endl;
+  std::cout << "    --format   : with -c, -g, --snapshot, --stream or -l, print text (default), json (one object per"
+    << std::endl;
+  std::cout << "                 line), csv, influx (line protocol) or prometheus (text exposition, not with --stream)"
+    << std::endl;
+}
+
+// Prints the CPU and GPU temperature followed by the extra keys, in that
+// order, on one line.
+int snapshot(smctemp::SmcTemp& smc_temp, const std::vector<uint32_t>& keys, bool isFailSoft,
+             smctemp::OutputFormat format) {
+  double cpu = smc_temp.GetCpuTemp();
+  double gpu = smc_temp.GetGpuTemp();
+  if (isFailSoft && !smc_temp.IsValidTemperature(cpu, smctemp::kValidTemperatureLimits)) {
+    cpu = smc_temp.GetLastValidCpuTemp();
+  }
+  if (isFailSoft && !smc_temp.IsValidTemperature(gpu, smctemp::kValidTemperatureLimits)) {
+    gpu = smc_temp.GetLastValidGpuTemp();
+  }
+  std::vector<double> values(keys.size());
+  smc_temp.ReadValues(keys.data(), keys.size(), values.data(), nullptr);
+
+  if (format == smctemp::OutputFormat::kText) {
+    std::cout << std::fixed << std::setprecision(1) << cpu << " " << gpu;
+    for (double value : values) {
+      std::cout << " " << value;
+    }
+    std::cout << std::endl;
+  } else {
+    std::vector<std::array<char, 5>> key_names(keys.size());
+    std::vector<smctemp::OutputField_t> fields = {{"cpu", cpu, false}, {"gpu", gpu, false}};
+    for (size_t i = 0; i < keys.size(); i++) {
+      smctemp::string_util::ultostr(key_names[i].data(), key_names[i].size(), keys[i]);
+      fields.push_back({key_names[i].data(), values[i], true});
+    }
+    smctemp::SampleFormatter(STDOUT_FILENO, format).Write(smctemp::RealtimeNs(), fields.data(), fields.size());
+  }
+  if (cpu == 0.0 || gpu == 0.0) {
+    std::cerr << "Could not get valid sensor value. Please use `-n` option and `-i` option." << std::endl;
+    return 1;
+  }
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
   int c;
   unsigned int attempts = 1;
+  unsigned int quorum_percent = 0;
   unsigned int interval_ms = 1'000;
 
   kern_return_t result;
   int op = smctemp::kOpNone;
   bool isFailSoft = false;
+  bool useKeyInfoCache = false;
+  bool isClient = false;
+  std::string socket_path = smctemp::kDefaultSocketPath;
+  std::string shm_name;
+  bool isStream = false;
+  unsigned int stream_count = 0;
+  unsigned int stream_duration_s = 0;
+  smctemp::SmcKeyFilter key_filter;
+  bool isIndexOnly = false;
+  bool isHealth = false;
+  bool isStats = false;
+  unsigned int max_age_s = 0;
+  unsigned int window_s = 0;
+  smctemp::Aggregation aggregation = smctemp::Aggregation::kMean;
+  bool isClusters = false;
+  unsigned int adaptive_ms = 0;
+  unsigned int threshold = 0;
+  std::string record_path;
+  std::string replay_path;
+  smctemp::OutputFormat format = smctemp::OutputFormat::kText;
+  smctemp::ReplaySmcTransport::Speed replay_speed = smctemp::ReplaySmcTransport::kAsFastAsPossible;
 
-  while ((c = getopt(argc, argv, "clvfhn:gi:")) != -1) {
+  while ((c = getopt_long(argc, argv, "clvfkhn:gi:", kLongOptions, nullptr)) != -1) {
     switch(c) {
       case 'c':
-        op = smctemp::kOpReadCpuTemp;
+        op = op == smctemp::kOpReadGpuTemp || op == smctemp::kOpSnapshot ? smctemp::kOpSnapshot
+                                                                          : smctemp::kOpReadCpuTemp;
         break;
       case 'g':
-        op = smctemp::kOpReadGpuTemp;
+        op = op == smctemp::kOpReadCpuTemp || op == smctemp::kOpSnapshot ? smctemp::kOpSnapshot
+                                                                          : smctemp::kOpReadGpuTemp;
         break;
+      case kLongOptionSnapshot:
+        op = smctemp::kOpSnapshot;
+        break;
+      case kLongOptionQuorum: {
+        auto [ptr, ec] = std::from_chars(optarg, optarg + strlen(optarg), quorum_percent);
+        if (ec != std::errc() || quorum_percent > 100) {
+          std::cerr << "Invalid argument provided for --quorum (integer between 0 and 100 is required)" << std::endl;
+          return 1;
+        }
+        break;
+      }
       case 'i':
         if (optarg) {
           unsigned int temp_interval;
@@ -63,10 +366,112 @@ int main(int argc, char *argv[]) {
       case 'f':
         isFailSoft = true;
         break;
+      case 'k':
+        useKeyInfoCache = true;
+        break;
       case 'v':
         std::cout << smctemp::kVersion << std::endl;
         return 0;
         break;
+      case kLongOptionDaemon:
+        op = smctemp::kOpDaemon;
+        break;
+      case kLongOptionClient:
+        isClient = true;
+        break;
+      case kLongOptionSocket:
+        socket_path = optarg;
+        break;
+      case kLongOptionShm:
+        shm_name = optarg ? optarg : smctemp::kDefaultSharedMemoryName;
+        break;
+      case kLongOptionStream:
+        isStream = true;
+        break;
+      case kLongOptionKeys:
+        key_filter = smctemp::SmcKeyFilter(optarg);
+        break;
+      case kLongOptionIndexOnly:
+        isIndexOnly = true;
+        break;
+      case kLongOptionHealth:
+        isHealth = true;
+        break;
+      case kLongOptionStats:
+        isStats = true;
+        break;
+      case kLongOptionAggregate:
+        if (!smctemp::ParseAggregation(optarg, aggregation)) {
+          std::cerr << "Invalid argument provided for --aggregate (mean, median, trimmed, max or cluster-max is"
+            << " required)" << std::endl;
+          return 1;
+        }
+        break;
+      case kLongOptionClusters:
+        isClusters = true;
+        break;
+      case kLongOptionFormat:
+        if (!smctemp::ParseOutputFormat(optarg, format)) {
+          std::cerr << "Invalid argument provided for --format (text, json, csv, influx or prometheus is required)"
+            << std::endl;
+          return 1;
+        }
+        break;
+      case kLongOptionAdaptive: {
+        adaptive_ms = 1'000;
+        if (optarg == nullptr) {
+          break;
+        }
+        auto [ptr, ec] = std::from_chars(optarg, optarg + strlen(optarg), adaptive_ms);
+        if (ec != std::errc() || adaptive_ms < 20 || adaptive_ms > 60'000) {
+          std::cerr << "Invalid argument provided for --adaptive (integer between 20 and 60000 is required)"
+            << std::endl;
+          return 1;
+        }
+        break;
+      }
+      case kLongOptionRecord:
+        record_path = optarg;
+        break;
+      case kLongOptionReplay:
+        replay_path = optarg;
+        break;
+      case kLongOptionReplaySpeed:
+        if (strcmp(optarg, "fast") == 0) {
+          replay_speed = smctemp::ReplaySmcTransport::kAsFastAsPossible;
+        } else if (strcmp(optarg, "recorded") == 0) {
+          replay_speed = smctemp::ReplaySmcTransport::kRecorded;
+        } else {
+          std::cerr << "Invalid argument provided for --replay-speed (fast or recorded is required)" << std::endl;
+          return 1;
+        }
+        break;
+      case kLongOptionThreshold: {
+        auto [ptr, ec] = std::from_chars(optarg, optarg + strlen(optarg), threshold);
+        if (ec != std::errc() || threshold > 120) {
+          std::cerr << "Invalid argument provided for --threshold (integer between 0 and 120 is required)"
+            << std::endl;
+          return 1;
+        }
+        break;
+      }
+      case kLongOptionCount:
+      case kLongOptionDuration:
+      case kLongOptionMaxAge:
+      case kLongOptionWindow: {
+        unsigned int value;
+        auto [ptr, ec] = std::from_chars(optarg, optarg + strlen(optarg), value);
+        if (ec != std::errc()) {
+          std::cerr << "Invalid argument provided for --"
+            << (c == kLongOptionCount ? "count" : c == kLongOptionDuration ? "duration"
+                : c == kLongOptionMaxAge ? "max-age" : "window")
+            << " (integer is required)" << std::endl;
+          return 1;
+        }
+        (c == kLongOptionCount ? stream_count : c == kLongOptionDuration ? stream_duration_s
+         : c == kLongOptionMaxAge ? max_age_s : window_s) = value;
+        break;
+      }
       case 'h':
       case '?':
         op = smctemp::kOpNone;
@@ -74,43 +479,153 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  if (op == smctemp::kOpNone) {
+  // Extra keys to read, only with --snapshot.
+  std::vector<uint32_t> snapshot_keys;
+  for (int i = optind; i < argc; i++) {
+    if (op != smctemp::kOpSnapshot || strlen(argv[i]) != 4) {
+      op = smctemp::kOpNone;
+      break;
+    }
+    snapshot_keys.push_back(smctemp::string_util::strtoul(argv[i], 4, 16));
+  }
+
+  if (op == smctemp::kOpNone ||
+      (isStream && op != smctemp::kOpReadCpuTemp && op != smctemp::kOpReadGpuTemp)) {
     usage(argv[0]);
     return 1;
   }
+  // An exposition holds each series once, so a stream of samples is not one.
+  if (isStream && format == smctemp::OutputFormat::kPrometheus) {
+    std::cerr << "--format=prometheus prints a single sample and cannot be used with --stream" << std::endl;
+    return 1;
+  }
 
-  smctemp::SmcAccessor smc_accessor = smctemp::SmcAccessor();
-  smctemp::SmcTemp smc_temp = smctemp::SmcTemp(isFailSoft);
+  if (isClient && !isStream && (op == smctemp::kOpReadCpuTemp || op == smctemp::kOpReadGpuTemp)) {
+    smctemp::DaemonReply_t reply;
+    const uint32_t daemon_op = op == smctemp::kOpReadCpuTemp ? smctemp::kDaemonOpCpu : smctemp::kDaemonOpGpu;
+    if (queryDaemon(shm_name, socket_path, daemon_op, reply)) {
+      const double temp = op == smctemp::kOpReadCpuTemp ? reply.cpu : reply.gpu;
+      if (format == smctemp::OutputFormat::kText) {
+        std::cout << std::fixed << std::setprecision(1) << temp << std::endl;
+      } else {
+        const smctemp::OutputField_t field = {op == smctemp::kOpReadCpuTemp ? "cpu" : "gpu", temp, false};
+        smctemp::SampleFormatter(STDOUT_FILENO, format).Write(smctemp::RealtimeNs(), &field, 1);
+      }
+      return temp == 0.0 ? 1 : 0;
+    }
+  }
+  if (isClient && op == smctemp::kOpSnapshot && snapshot_keys.empty()) {
+    smctemp::DaemonReply_t reply;
+    if (queryDaemon(shm_name, socket_path, smctemp::kDaemonOpAll, reply)) {
+      if (format == smctemp::OutputFormat::kText) {
+        std::cout << std::fixed << std::setprecision(1) << reply.cpu << " " << reply.gpu << std::endl;
+      } else {
+        const smctemp::OutputField_t fields[] = {{"cpu", reply.cpu, false}, {"gpu", reply.gpu, false}};
+        smctemp::SampleFormatter(STDOUT_FILENO, format).Write(smctemp::RealtimeNs(), fields, 2);
+      }
+      return reply.cpu == 0.0 || reply.gpu == 0.0 ? 1 : 0;
+    }
+  }
+
+  std::unique_ptr<smctemp::SmcTransport> transport;
+  if (!replay_path.empty()) {
+    auto replay = std::make_unique<smctemp::ReplaySmcTransport>(replay_path, replay_speed);
+    if (!replay->IsLoaded()) {
+      std::cerr << "Failed to load trace: " << replay_path << std::endl;
+      return 1;
+    }
+    transport = std::move(replay);
+  } else {
+    transport = smctemp::MakeDefaultSmcTransport();
+  }
+  if (!record_path.empty()) {
+    auto recording = std::make_unique<smctemp::RecordingSmcTransport>(std::move(transport), record_path);
+    if (!recording->IsOpen()) {
+      std::cerr << "Failed to open trace: " << record_path << std::endl;
+      return 1;
+    }
+    transport = std::move(recording);
+  }
+
+  if (op == smctemp::kOpList) {
+    smctemp::SmcAccessor smc_accessor(std::move(transport));
+    result = smc_accessor.PrintAll(STDOUT_FILENO, key_filter, isIndexOnly, format);
+    if (result != kIOReturnSuccess) {
+      std::ios_base::fmtflags ef(std::cerr.flags());
+      std::cerr << "Error: SmcPrintAll() = "
+        << std::hex << result << std::endl;
+      std::cerr.flags(ef);
+    }
+    return 0;
+  }
+
+  smctemp::SmcTemp smc_temp(isFailSoft, std::move(transport));
+  if (isStats) {
+    smc_temp.EnableMetrics();
+  }
+  smc_temp.SetFailSoftMaxAge(std::chrono::seconds(max_age_s));
+  smc_temp.SetAggregation(aggregation);
+  if (useKeyInfoCache) {
+    smc_temp.UsePersistentKeyInfoCache();
+    smc_temp.UseSensorManifest();
+  }
+
+  if (op == smctemp::kOpReadCpuTemp || op == smctemp::kOpReadGpuTemp || op == smctemp::kOpSnapshot) {
+    smc_temp.SetRetry(attempts, std::chrono::milliseconds{interval_ms}, quorum_percent);
+  }
+
+  // The daemon always keeps statistics, over a minute unless --window says
+  // otherwise.
+  if (op == smctemp::kOpDaemon && window_s == 0) {
+    window_s = 60;
+  }
+  if (window_s > 0) {
+    const std::chrono::seconds window(window_s);
+    smc_temp.EnableStats({window, window_s * 1'000 / interval_ms + 1, window / 10});
+  }
+
+  // Slopes under half a degree per second are sensor noise; from 5 degrees
+  // per second, or within 5 degrees of the threshold, -i is used.
+  const smctemp::AdaptiveConfig_t adaptive_config = {
+    std::chrono::milliseconds(interval_ms), std::chrono::milliseconds(adaptive_ms), 0.5, 5.0,
+    static_cast<double>(threshold), 5.0,
+  };
+  std::unique_ptr<smctemp::AdaptiveRate> adaptive;
+  if (adaptive_ms > 0) {
+    adaptive = std::make_unique<smctemp::AdaptiveRate>(adaptive_config);
+  }
+
+  if (isStream) {
+    const int status = stream(smc_temp, op, interval_ms, stream_count, stream_duration_s, isFailSoft,
+                              adaptive.get(), format);
+    if (isHealth) {
+      smc_temp.PrintSensorHealth(std::cerr);
+    }
+    printMetrics(smc_temp);
+    return status;
+  }
 
   switch(op) {
-    case smctemp::kOpList:
-      result = smc_accessor.PrintAll();
-      if (result != kIOReturnSuccess) {
-        std::ios_base::fmtflags ef(std::cerr.flags());
-        std::cerr << "Error: SmcPrintAll() = "
-          << std::hex << result << std::endl;
-        std::cerr.flags(ef);
+    case smctemp::kOpDaemon: {
+      smctemp::SmcDaemon daemon(smc_temp, socket_path, std::chrono::milliseconds(interval_ms));
+      if (!shm_name.empty() && !daemon.PublishToSharedMemory(shm_name)) {
+        return 1;
       }
-      break;
+      if (adaptive_ms > 0) {
+        daemon.SetAdaptive(adaptive_config);
+      }
+      return daemon.Run();
+    }
+    case smctemp::kOpSnapshot: {
+      const int status = snapshot(smc_temp, snapshot_keys, isFailSoft, format);
+      printMetrics(smc_temp);
+      return status;
+    }
     case smctemp::kOpReadGpuTemp:
     case smctemp::kOpReadCpuTemp:
-      double temp = 0.0;
-      const std::pair<unsigned int, unsigned int> valid_temperature_limits{10, 120};
-      while (attempts > 0) {
-        if (op == smctemp::kOpReadCpuTemp) {
-          temp = smc_temp.GetCpuTemp();
-        } else if (op == smctemp::kOpReadGpuTemp) {
-          temp = smc_temp.GetGpuTemp();
-        }
-        if (smc_temp.IsValidTemperature(temp, valid_temperature_limits)) {
-          break;
-        } else {
-          usleep(interval_ms * 1'000);
-          attempts--;
-        }
-      }
+      double temp = op == smctemp::kOpReadCpuTemp ? smc_temp.GetCpuTemp() : smc_temp.GetGpuTemp();
       if (isFailSoft) {
-        if (!smc_temp.IsValidTemperature(temp, valid_temperature_limits)) {
+        if (!smc_temp.IsValidTemperature(temp, smctemp::kValidTemperatureLimits)) {
           if (op == smctemp::kOpReadCpuTemp) {
             temp = smc_temp.GetLastValidCpuTemp();
           } else if (op == smctemp::kOpReadGpuTemp) {
@@ -118,7 +633,28 @@ int main(int argc, char *argv[]) {
           }
         }
       }
-      std::cout << std::fixed << std::setprecision(1) << temp << std::endl;
+      if (format == smctemp::OutputFormat::kText) {
+        std::cout << std::fixed << std::setprecision(1) << temp << std::endl;
+        if (isClusters && op == smctemp::kOpReadCpuTemp) {
+          for (const smctemp::ClusterTemp_t& cluster : smc_temp.LastClusterTemps()) {
+            std::cout << cluster.name << " " << cluster.temperature << std::endl;
+          }
+        }
+      } else {
+        // Clusters become fields of the same sample, e.g. cluster_performance.
+        std::vector<std::string> cluster_names;
+        std::vector<smctemp::OutputField_t> fields = {{op == smctemp::kOpReadCpuTemp ? "cpu" : "gpu", temp, false}};
+        if (isClusters && op == smctemp::kOpReadCpuTemp) {
+          const std::vector<smctemp::ClusterTemp_t>& clusters = smc_temp.LastClusterTemps();
+          cluster_names.reserve(clusters.size());
+          for (const smctemp::ClusterTemp_t& cluster : clusters) {
+            cluster_names.push_back(std::string("cluster_") + cluster.name);
+            fields.push_back({cluster_names.back().c_str(), cluster.temperature, false});
+          }
+        }
+        smctemp::SampleFormatter(STDOUT_FILENO, format).Write(smctemp::RealtimeNs(), fields.data(), fields.size());
+      }
+      printMetrics(smc_temp);
       if (temp == 0.0) {
         std::cerr << "Could not get valid sensor value. Please use `-n` option and `-i` option." << std::endl;
         std::cerr << "In M2 Mac, it would be work fine with `-i25 -n180 -f` options.`" << std::endl;
@@ -22,302 +22,294 @@
 
 #include "smctemp.h"
 
-#include <IOKit/IOKitLib.h>
-#include <libkern/OSAtomic.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
 
+#include <algorithm>
+#include <array>
 #include <cerrno>
-#include <cmath>
-#include <fstream>
-#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <limits>
 #include <string>
 
+#include "smctemp_clock.h"
+#include "smctemp_decode.h"
+#include "smctemp_manifest.h"
 #include "smctemp_string.h"
+#include "smctemp_writer.h"
 
 #if defined(ARCH_TYPE_ARM64)
-#include <sys/sysctl.h>
-#include <algorithm>
-#include <array>
-
 namespace {
 std::string getCPUModel() {
+#if defined(__APPLE__)
   std::array<char, 512> buffer;
   size_t bufferLength = buffer.size();
   sysctlbyname("machdep.cpu.brand_string", buffer.data(), &bufferLength, nullptr, 0);
   std::string cpuModel = buffer.data();
+#else
+  // Off macOS the simulated SMC stands in for the hardware; the chip is picked
+  // with SMCTEMP_CPU_MODEL (e.g. "Apple M5").
+  const char* env = getenv("SMCTEMP_CPU_MODEL");
+  std::string cpuModel = env ? env : "";
+#endif
   std::transform(cpuModel.begin(), cpuModel.end(), cpuModel.begin(), ::tolower);
   return cpuModel;
 }
 }
 #endif
 
-// Cache the keyInfo to lower the energy impact of SmcReadKey() / SmcReadKey2()
-#define KEY_INFO_CACHE_SIZE 100
-namespace smctemp {
-struct {
-    uint32_t key;
-    SmcKeyData_keyInfo_t keyInfo;
-} g_keyInfoCache[KEY_INFO_CACHE_SIZE];
-
-int g_keyInfoCacheCount = 0;
-OSSpinLock g_keyInfoSpinLock = 0;
-
-void printFLT(SmcVal_t val) {
-  std::ios_base::fmtflags f(std::cout.flags());
-  std::cout << std::fixed << std::setprecision(0)
-    << *reinterpret_cast<float*>(val.bytes);
-  std::cout.flags(f);
-}
-
-void printFP(SmcVal_t val, int n, float m) {
-  std::ios_base::fmtflags f(std::cout.flags());
-  std::cout << std::fixed << std::setprecision(n)
-    << ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / m;
-  std::cout.flags(f);
-}
-
-void printUInt(SmcVal_t val) {
-  char* bytes = (char *)val.bytes;
-  uint64_t data = 0;
-  for (uint32_t i = 0; i < val.dataSize; i++) {
-    data += uint8_t(bytes[i]) * std::pow(256, val.dataSize - 1 -i);
+namespace {
+// The range of a single sensor reading, which on x86 differs from
+// kValidTemperatureLimits.
+#if defined(ARCH_TYPE_X86_64)
+const std::pair<unsigned int, unsigned int> kSensorTemperatureLimits{0, 110};
+// The x86 sensors are read in order until one is valid.
+constexpr bool kSensorsAreAlternatives = true;
+#else
+const std::pair<unsigned int, unsigned int> kSensorTemperatureLimits = smctemp::kValidTemperatureLimits;
+constexpr bool kSensorsAreAlternatives = false;
+#endif
+// A key is quarantined after this many failed reads in a row, for
+// kQuarantineMinSamples samples at first and twice as long after every failed
+// re-probe.
+constexpr uint32_t kQuarantineFailures = 8;
+constexpr uint32_t kQuarantineMinSamples = 4;
+constexpr uint32_t kQuarantineMaxSamples = 1024;
+constexpr uint32_t kProbeReads = 16;
+
+std::string getMachineModel() {
+#if defined(__APPLE__)
+  std::array<char, 256> buffer;
+  size_t bufferLength = buffer.size();
+  if (sysctlbyname("hw.model", buffer.data(), &bufferLength, nullptr, 0) != 0) {
+    return "";
   }
-  std::cout << data;
-}
-
-void printSP(SmcVal_t val, int n, float m) {
-  std::ios_base::fmtflags f(std::cout.flags());
-  std::cout << std::fixed << std::setprecision(n)
-    << (int16_t)ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / m;
-  std::cout.flags(f);
-}
-
-void printSI8(SmcVal_t val) {
-  signed char* bytes = (signed char *)val.bytes;
-  int16_t data = 0;
-  data += int8_t(bytes[0]);
-  std::cout << data;
+  return buffer.data();
+#else
+  const char* env = getenv("SMCTEMP_CPU_MODEL");
+  return std::string("simulated ") + (env ? env : "");
+#endif
 }
-
-void printSI16(SmcVal_t val) {
-  std::ios_base::fmtflags f(std::cout.flags());
-  std::cout << ntohs(*reinterpret_cast<int16_t*>(val.bytes));
-  std::cout.flags(f);
 }
 
-void printPWM(SmcVal_t val) {
-  std::ios_base::fmtflags f(std::cout.flags());
-  std::cout << std::fixed << std::setprecision(1)
-    << (float)ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) * 100 / 65536.0;
-  std::cout.flags(f);
+namespace smctemp {
+namespace {
+void formatKeyIndex(uint32_t key, BufferedWriter& out) {
+  char name[5];
+  string_util::ultostr(name, sizeof(name), key);
+  out.AppendPadded(name, strlen(name), 6);
 }
 
-void printBytesHex(SmcVal_t val) {
-  std::cout << " (bytes:";
-  for (uint32_t i = 0; i < val.dataSize; i++) {
-    std::ios_base::fmtflags f(std::cout.flags());
-    std::cout << " " << std::setw(2)
-      << std::uppercase<< std::hex << std::setfill('0')
-      << static_cast<unsigned int>(val.bytes[i]);
-    std::cout.flags(f);
+// One line of the -l listing, decoded from the bytes already in val.
+void formatSmcVal(const SmcVal_t& val, BufferedWriter& out) {
+  out.AppendPadded(val.key, strnlen(val.key, sizeof(val.key)), 6);
+  char data_type[8] = {'['};
+  size_t type_length = strnlen(val.dataType, sizeof(val.dataType));
+  memcpy(data_type + 1, val.dataType, type_length);
+  memcpy(data_type + 1 + type_length, "]  ", 3);
+  out.AppendPadded(data_type, type_length + 4, 10);
+  if (val.dataSize == 0) {
+    out.Append("no data\n");
+    return;
   }
-  std::cout << ")" << std::endl;
+  out.AppendFixed(DecodeSmcVal(val), 1);
+  out.Append(" (bytes:");
+  for (uint32_t i = 0; i < val.dataSize && i < sizeof(val.bytes); i++) {
+    out.Append(' ');
+    out.AppendHexByte(static_cast<uint8_t>(val.bytes[i]));
+  }
+  out.Append(")\n");
 }
-
-void SmcAccessor::PrintByteReadable(SmcVal_t val) {
-  double value = ReadValue(val.key);
-  std::cout << std::fixed << std::setprecision(1) << value;
 }
 
-void SmcAccessor::PrintSmcVal(SmcVal_t val) {
-  std::ios_base::fmtflags f(std::cout.flags());
-  std::cout << std::setw(6) << std::setfill(' ') << val.key;
-  std::cout << std::setw(10) << std::setfill(' ') << "[" + std::string(val.dataType) + "]  ";
-  if (val.dataSize > 0) {
-    PrintByteReadable(val);
-    printBytesHex(val);
-  } else {
-    std::cout << "no data" << std::endl;
-  }
-  std::cout.flags(f);
+SmcAccessor::SmcAccessor()
+    : SmcAccessor(MakeDefaultSmcTransport()) {
 }
 
-SmcAccessor::SmcAccessor() {
-  Open();
+SmcAccessor::SmcAccessor(std::unique_ptr<SmcTransport> transport)
+    : transport_(std::move(transport)) {
+  memset(&read_request_, 0, sizeof(read_request_));
+  memset(&read_response_, 0, sizeof(read_response_));
+  read_request_.data8 = kSmcCmdReadBytes;
+  const int64_t start_ns = MonotonicNs();
+  open_result_ = Open();
+  open_ns_ = MonotonicNs() - start_ns;
 }
 
 SmcAccessor::~SmcAccessor() {
+  if (key_info_cache_file_ && key_info_cache_dirty_.load()) {
+    key_info_cache_file_->Save(key_info_cache_);
+  }
   Close();
 }
 
 kern_return_t SmcAccessor::Open() {
-  mach_port_t masterPort;
-  IOMasterPort(MACH_PORT_NULL, &masterPort);
-  CFMutableDictionaryRef matchingDictionary = IOServiceMatching(kIOAppleSmcHiddenClassName);
-
-  io_iterator_t iterator;
-  kern_return_t result = IOServiceGetMatchingServices(masterPort, matchingDictionary, &iterator);
-  if (result != kIOReturnSuccess) {
-    std::ios_base::fmtflags ef(std::cerr.flags());
-    std::cerr << "Error: IOServiceGetMatchingServices() = "
-      << std::hex << result << std::endl;
-    std::cerr.flags(ef);
-    return result;
-  }
-
-  io_object_t device = IOIteratorNext(iterator);
-  IOObjectRelease(iterator);
-  if (device == 0) {
-    std::ios_base::fmtflags ef(std::cerr.flags());
-    std::cerr << "Error: no Smc found" << std::endl;
-    std::cerr.flags(ef);
-    return result;
-  }
-
-  result = IOServiceOpen(device, mach_task_self(), 0, &conn_);
-  IOObjectRelease(device);
-  if (result != kIOReturnSuccess) {
-    std::ios_base::fmtflags ef(std::cerr.flags());
-    std::cerr << "Error: IOServiceGetMatchingServices() = "
-      << std::hex << result << std::endl;
-    std::cerr.flags(ef);
-    return result;
-  }
-  return kIOReturnSuccess;
+  return transport_->Open();
 }
 
 kern_return_t SmcAccessor::Close() {
-  return IOServiceClose(conn_);
+  return transport_->Close();
 }
 
 kern_return_t SmcAccessor::Call(int index, SmcKeyData_t *inputStructure, SmcKeyData_t *outputStructure) {
-  size_t   structureInputSize;
-  size_t   structureOutputSize;
-  structureInputSize = sizeof(SmcKeyData_t);
-  structureOutputSize = sizeof(SmcKeyData_t);
+  if (metrics_ == nullptr) {
+    return transport_->Call(index, inputStructure, outputStructure);
+  }
+  SmcCallMetrics* call_metrics = CallMetrics(inputStructure);
+  const bool timed = call_metrics != nullptr && call_metrics->Count();
+  const int64_t start_ns = timed ? MonotonicNs() : 0;
+  const kern_return_t result = transport_->Call(index, inputStructure, outputStructure);
+  if (timed) {
+    call_metrics->latency.Record(MonotonicNs() - start_ns);
+  }
+  if (result != kIOReturnSuccess) {
+    metrics_->callFailures.fetch_add(1, std::memory_order_relaxed);
+    metrics_->keyFailures.Add(inputStructure->key);
+  } else if (outputStructure->result == static_cast<char>(kSmcKeyNotFound)) {
+    metrics_->keysNotFound.fetch_add(1, std::memory_order_relaxed);
+    metrics_->keyFailures.Add(inputStructure->key);
+  }
+  return result;
+}
 
-  return IOConnectCallStructMethod(conn_, index, inputStructure, structureInputSize, outputStructure, &structureOutputSize);
+SmcCallMetrics* SmcAccessor::CallMetrics(const SmcKeyData_t* inputStructure) const {
+  switch (inputStructure->data8) {
+    case kSmcCmdReadKeyInfo:
+      return &metrics_->keyInfoCalls;
+    case kSmcCmdReadBytes:
+      return &metrics_->readCalls;
+    case kSmcCmdReadIndex:
+      return &metrics_->indexCalls;
+  }
+  return nullptr;
 }
-kern_return_t SmcCall2(int index, SmcKeyData_t *inputStructure, SmcKeyData_t *outputStructure,io_connect_t conn) {
-  size_t   structureInputSize;
-  size_t   structureOutputSize;
-  structureInputSize = sizeof(SmcKeyData_t);
-  structureOutputSize = sizeof(SmcKeyData_t);
 
-  return IOConnectCallStructMethod(conn, index, inputStructure, structureInputSize, outputStructure, &structureOutputSize);
+void SmcAccessor::EnableMetrics(SmcMetrics* metrics) {
+  metrics_ = metrics;
+  if (metrics_ != nullptr) {
+    metrics_->open.Record(open_ns_);
+  }
 }
 
 // Provides key info, using a cache to dramatically improve the energy impact of smcFanControl
 kern_return_t SmcAccessor::GetKeyInfo(const uint32_t key, SmcKeyData_keyInfo_t& key_info) {
+  if (key_info_cache_.Find(key, key_info)) {
+    if (metrics_ != nullptr) {
+      metrics_->keyInfoHits.fetch_add(1, std::memory_order_relaxed);
+    }
+    return kIOReturnSuccess;
+  }
+  if (key_info_cache_file_ && key_info_cache_file_->Find(key, key_info)) {
+    key_info_cache_.Insert(key, key_info);
+    if (metrics_ != nullptr) {
+      metrics_->keyInfoHits.fetch_add(1, std::memory_order_relaxed);
+    }
+    return kIOReturnSuccess;
+  }
+  if (metrics_ != nullptr) {
+    metrics_->keyInfoMisses.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Not in cache, must look it up.
   SmcKeyData_t inputStructure;
   SmcKeyData_t outputStructure;
-  kern_return_t result = kIOReturnSuccess;
-
-  OSSpinLockLock(&g_keyInfoSpinLock);
-  int i = 0;
-  for (i = 0; i < g_keyInfoCacheCount; ++i) {
-    if (key == g_keyInfoCache[i].key) {
-      key_info = g_keyInfoCache[i].keyInfo;
-      break;
+  memset(&inputStructure, 0, sizeof(inputStructure));
+  memset(&outputStructure, 0, sizeof(outputStructure));
+
+  inputStructure.key = key;
+  inputStructure.data8 = kSmcCmdReadKeyInfo;
+
+  kern_return_t result = Call(kKernelIndexSmc, &inputStructure, &outputStructure);
+  if (result == kIOReturnSuccess) {
+    key_info = outputStructure.keyInfo;
+    // Absent keys are not cached, so that probing one again asks the SMC.
+    if (key_info.dataSize == 0) {
+      return result;
     }
+    key_info_cache_.Insert(key, key_info);
+    key_info_cache_dirty_.store(true, std::memory_order_relaxed);
   }
+  return result;
+}
 
-  if (i == g_keyInfoCacheCount) {
-    // Not in cache, must look it up.
-    memset(&inputStructure, 0, sizeof(inputStructure));
-    memset(&outputStructure, 0, sizeof(outputStructure));
-
-    inputStructure.key = key;
-    inputStructure.data8 = kSmcCmdReadKeyInfo;
+double SmcAccessor::ReadValue(const UInt32Char_t key) {
+  const uint32_t smc_key = string_util::strtoul(key, 4, 16);
+  double value = 0.0;
+  ReadValues(&smc_key, 1, &value, nullptr);
+  return value;
+}
 
-    result = Call(kKernelIndexSmc, &inputStructure, &outputStructure);
+void SmcAccessor::ReadValues(const uint32_t* keys, size_t count, double* values, kern_return_t* results) {
+  for (size_t i = 0; i < count; i++) {
+    SmcKeyData_keyInfo_t key_info;
+    kern_return_t result = GetKeyInfo(keys[i], key_info);
+    if (result == kIOReturnSuccess && key_info.dataSize == 0) {
+      // Absent keys come back with empty key info; there is nothing to read.
+      result = kIOReturnNotFound;
+    }
     if (result == kIOReturnSuccess) {
-      key_info = outputStructure.keyInfo;
-      if (g_keyInfoCacheCount < KEY_INFO_CACHE_SIZE) {
-        g_keyInfoCache[g_keyInfoCacheCount].key = key;
-        g_keyInfoCache[g_keyInfoCacheCount].keyInfo = outputStructure.keyInfo;
-        ++g_keyInfoCacheCount;
-      }
+      read_request_.key = keys[i];
+      read_request_.keyInfo.dataSize = key_info.dataSize;
+      result = Call(kKernelIndexSmc, &read_request_, &read_response_);
+    }
+    values[i] = result == kIOReturnSuccess
+      ? DecodeSmcBytes(key_info.dataType, key_info.dataSize, read_response_.bytes)
+      : 0.0;
+    if (results != nullptr) {
+      results[i] = result;
     }
   }
+}
 
-  OSSpinLockUnlock(&g_keyInfoSpinLock);
+kern_return_t SmcAccessor::Resolve(const uint32_t key, SmcSensorHandle_t& handle) {
+  SmcKeyData_keyInfo_t key_info;
+  kern_return_t result = GetKeyInfo(key, key_info);
+  if (result != kIOReturnSuccess) {
+    return result;
+  }
+  if (key_info.dataSize == 0) {
+    return kIOReturnNotFound;
+  }
+  const SmcResolvedDecoder_t decoder = ResolveSmcDecoder(key_info.dataType, key_info.dataSize);
+  handle.key = key;
+  handle.dataSize = key_info.dataSize;
+  handle.decode = decoder.decode;
+  handle.scale = decoder.scale;
+  return kIOReturnSuccess;
+}
+
+kern_return_t SmcAccessor::Resolve(const UInt32Char_t key, SmcSensorHandle_t& handle) {
+  return Resolve(string_util::strtoul(key, 4, 16), handle);
+}
 
+kern_return_t SmcAccessor::Read(const SmcSensorHandle_t& handle, double& value) {
+  read_request_.key = handle.key;
+  read_request_.keyInfo.dataSize = handle.dataSize;
+  kern_return_t result = Call(kKernelIndexSmc, &read_request_, &read_response_);
+  value = result == kIOReturnSuccess ? handle.decode(read_response_.bytes, handle.dataSize, handle.scale) : 0.0;
   return result;
 }
 
-double SmcAccessor::ReadValue(const UInt32Char_t key) {
-  SmcVal_t val;
-  ReadSmcVal(key, val);
-  double v = 0.0;
-
-  if (std::string(val.dataType) == kDataTypeUi8 ||
-      std::string(val.dataType) == kDataTypeUi16 ||
-      std::string(val.dataType) == kDataTypeUi32 ||
-      std::string(val.dataType) == kDataTypeUi64) {
-    char* bytes = (char *)val.bytes;
-    uint64_t tmp = 0;
-    for (uint32_t i = 0; i < val.dataSize; i++) {
-      tmp += uint8_t(bytes[i]) * std::pow(256, val.dataSize - 1 -i);
-    }
-    v = tmp;
-  } else if (std::string(val.dataType) == kDataTypeFlt) {
-    v = *reinterpret_cast<float*>(val.bytes);
-  } else if (std::string(val.dataType) == kDataTypeFp1f && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 32768.0;
-  } else if (std::string(val.dataType) == kDataTypeFp4c && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 4096.0;
-  } else if (std::string(val.dataType) == kDataTypeFp5b && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 2048.0;
-  } else if (std::string(val.dataType) == kDataTypeFp6a && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 1024.0;
-  } else if (std::string(val.dataType) == kDataTypeFp79 && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 512.0;
-  } else if (std::string(val.dataType) == kDataTypeFp88 && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 256.0;
-  } else if (std::string(val.dataType) == kDataTypeFpa6 && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 64.0;
-  } else if (std::string(val.dataType) == kDataTypeFpc4 && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 16.0;
-  } else if (std::string(val.dataType) == kDataTypeFpe2 && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 4.0;
-  } else if (std::string(val.dataType) == kDataTypeSp1e && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 16384.0;
-  } else if (std::string(val.dataType) == kDataTypeSp3c && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 4096.0;
-  } else if (std::string(val.dataType) == kDataTypeSp4b && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 2048.0;
-  } else if (std::string(val.dataType) == kDataTypeSp5a && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 1024.0;
-  } else if (std::string(val.dataType) == kDataTypeSp69 && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 512.0;
-  } else if (std::string(val.dataType) == kDataTypeSp78 && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 256.0;
-  } else if (std::string(val.dataType) == kDataTypeSp87 && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 128.0;
-  } else if (std::string(val.dataType) == kDataTypeSp96 && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 64.0;
-  } else if (std::string(val.dataType) == kDataTypeSpb4 && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 16.0;
-  } else if (std::string(val.dataType) == kDataTypeSpf0 && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) / 1.0;
-  } else if (std::string(val.dataType) == kDataTypeSi8 && val.dataSize == 1) {
-    signed char* bytes = (signed char *)val.bytes;
-    int16_t temp = 0;
-    temp += int8_t(bytes[0]);
-    v = temp;
-  } else if (std::string(val.dataType) == kDataTypeSi16 && val.dataSize == 2) {
-    v = ntohs(*reinterpret_cast<int16_t*>(val.bytes));
-  } else if (std::string(val.dataType) == kDataTypePwm && val.dataSize == 2) {
-    v = (float)ntohs(*reinterpret_cast<uint16_t*>(val.bytes)) * 100 / 65536.0;
-  }
-
-  return static_cast<double>(v);
+void SmcAccessor::ReadMany(const SmcSensorHandle_t* handles, size_t count, double* values, kern_return_t* results) {
+  for (size_t i = 0; i < count; i++) {
+    kern_return_t result = Read(handles[i], values[i]);
+    if (results != nullptr) {
+      results[i] = result;
+    }
+  }
 }
 
 kern_return_t SmcAccessor::ReadSmcVal(const UInt32Char_t key, SmcVal_t& val) {
+  return ReadSmcVal(string_util::strtoul(key, 4, 16), val);
+}
+
+kern_return_t SmcAccessor::ReadSmcVal(const uint32_t key, SmcVal_t& val) {
   kern_return_t result;
   SmcKeyData_t  inputStructure;
   SmcKeyData_t  outputStructure;
@@ -326,8 +318,8 @@ kern_return_t SmcAccessor::ReadSmcVal(const UInt32Char_t key, SmcVal_t& val) {
   memset(&outputStructure, 0, sizeof(SmcKeyData_t));
   memset(&val, 0, sizeof(SmcVal_t));
 
-  inputStructure.key = string_util::strtoul(key, 4, 16);
-  snprintf(val.key, sizeof(val.key), key);
+  inputStructure.key = key;
+  string_util::ultostr(val.key, sizeof(val.key), key);
 
   result = GetKeyInfo(inputStructure.key, outputStructure.keyInfo);
   if (result != kIOReturnSuccess) {
@@ -335,11 +327,12 @@ kern_return_t SmcAccessor::ReadSmcVal(const UInt32Char_t key, SmcVal_t& val) {
   }
 
   val.dataSize = outputStructure.keyInfo.dataSize;
+  val.dataTypeCode = outputStructure.keyInfo.dataType;
   string_util::ultostr(val.dataType, 5, outputStructure.keyInfo.dataType);
   inputStructure.keyInfo.dataSize = val.dataSize;
   inputStructure.data8 = kSmcCmdReadBytes;
 
-  result = SmcCall2(kKernelIndexSmc, &inputStructure, &outputStructure, conn_);
+  result = Call(kKernelIndexSmc, &inputStructure, &outputStructure);
   if (result != kIOReturnSuccess) {
     return result;
   }
@@ -356,328 +349,656 @@ uint32_t SmcAccessor::ReadIndexCount() {
   return string_util::strtoul((const char *)val.bytes, val.dataSize, 10);
 }
 
-kern_return_t SmcAccessor::PrintAll() {
-  kern_return_t result;
-  SmcKeyData_t  inputStructure;
-  SmcKeyData_t  outputStructure;
+kern_return_t SmcAccessor::ReadKeyAtIndex(uint32_t index, uint32_t& key) {
+  SmcKeyData_t request;
+  SmcKeyData_t response;
+  memset(&request, 0, sizeof(request));
+  memset(&response, 0, sizeof(response));
+  request.data8 = kSmcCmdReadIndex;
+  request.data32 = index;
+  kern_return_t result = Call(kKernelIndexSmc, &request, &response);
+  key = response.key;
+  return result;
+}
 
-  int           totalKeys, i;
-  UInt32Char_t  key;
-  SmcVal_t      val;
+bool SmcAccessor::UsePersistentKeyInfoCache(const std::string& path) {
+  // The key count read here is the fingerprint telling whether the file still
+  // describes this SMC.
+  key_info_cache_file_ = std::make_unique<KeyInfoCacheFile>(path, getMachineModel(), ReadIndexCount());
+  return key_info_cache_file_->Load();
+}
 
-  totalKeys = ReadIndexCount();
-  for (i = 0; i < totalKeys; i++) {
-    memset(&inputStructure, 0, sizeof(SmcKeyData_t));
-    memset(&outputStructure, 0, sizeof(SmcKeyData_t));
-    memset(&val, 0, sizeof(SmcVal_t));
+// Each key is enumerated, read once and formatted from the bytes of that
+// read; the listing goes out through one buffered writer. The filter is
+// applied to the enumerated key, before any key info or byte read.
+kern_return_t SmcAccessor::PrintAll(int fd, const SmcKeyFilter& filter, bool index_only, OutputFormat format) {
+  SmcVal_t val;
+  std::cout.flush();
+  BufferedWriter out(fd);
+  const bool text = format == OutputFormat::kText;
+  if (!text) {
+    FormatListingHeader(format, out);
+  }
 
-    inputStructure.data8 = kSmcCmdReadIndex;
-    inputStructure.data32 = i;
+  const uint32_t totalKeys = ReadIndexCount();
+  for (uint32_t i = 0; i < totalKeys; i++) {
+    uint32_t key;
+    if (ReadKeyAtIndex(i, key) != kIOReturnSuccess || !filter.Matches(key)) {
+      continue;
+    }
+    if (index_only && !text) {
+      SmcKeyData_keyInfo_t key_info;
+      memset(&val, 0, sizeof(val));
+      string_util::ultostr(val.key, sizeof(val.key), key);
+      if (GetKeyInfo(key, key_info) == kIOReturnSuccess) {
+        string_util::ultostr(val.dataType, sizeof(val.dataType), key_info.dataType);
+        val.dataSize = key_info.dataSize;
+      }
+      FormatListingEntry(format, val, false, out);
+      continue;
+    }
+    if (index_only) {
+      formatKeyIndex(key, out);
+      SmcKeyData_keyInfo_t key_info;
+      if (GetKeyInfo(key, key_info) == kIOReturnSuccess) {
+        char data_type[5];
+        string_util::ultostr(data_type, sizeof(data_type), key_info.dataType);
+        out.Append("  [");
+        out.Append(data_type);
+        out.Append(']');
+      }
+      out.Append('\n');
+      continue;
+    }
+    if (ReadSmcVal(key, val) != kIOReturnSuccess) {
+      val.dataSize = 0;
+    }
+    if (text) {
+      formatSmcVal(val, out);
+    } else {
+      FormatListingEntry(format, val, true, out);
+    }
+  }
 
-    result = Call(kKernelIndexSmc, &inputStructure, &outputStructure);
-    if (result != kIOReturnSuccess)
-        continue;
+  return out.Flush() ? kIOReturnSuccess : kIOReturnError;
+}
 
-    string_util::ultostr(key, 5, outputStructure.key);
-    ReadSmcVal(key, val);
-    PrintSmcVal(val);
+const ChipSensors_t* DetectChipSensors() {
+#if defined(ARCH_TYPE_ARM64)
+  const std::string cpumodel = getCPUModel();
+  for (const ChipSensors_t& chip : kChipSensors) {
+    if (cpumodel.find(chip.model) != std::string::npos) {
+      return &chip;
+    }
   }
-
-  return kIOReturnSuccess;
+  return nullptr;
+#else
+  return &kChipSensors[0];
+#endif
 }
 
 SmcTemp::SmcTemp(bool isFailSoft)
-    : is_fail_soft_(isFailSoft) {
-  if (is_fail_soft_) {
-    if (mkdir(storage_path_.c_str(), 0777) && errno != EEXIST) {
-      std::cerr << "Failed to create directory: " << storage_path_ << std::endl;
+    : SmcTemp(isFailSoft, MakeDefaultSmcTransport()) {
+}
+
+SmcTemp::SmcTemp(bool isFailSoft, std::unique_ptr<SmcTransport> transport)
+    : smc_accessor_(std::move(transport)),
+      chip_(DetectChipSensors()),
+      is_fail_soft_(isFailSoft) {
+  if (is_fail_soft_ && CreateStorageDirectory()) {
+    cpu_store_ = std::make_unique<LastValidStore>(storage_path_ + cpu_file_);
+    gpu_store_ = std::make_unique<LastValidStore>(storage_path_ + gpu_file_);
+  }
+  BindSensors();
+}
+
+// Sizes the per-sensor state for chip_ once, so that sampling does not
+// allocate.
+void SmcTemp::BindSensors() {
+  health_.clear();
+  if (chip_ != nullptr) {
+    const size_t sensor_count = std::max(chip_->cpu.count + chip_->auxCpu.count, chip_->gpu.count);
+    sensor_values_.resize(sensor_count);
+    sensor_valid_.resize(sensor_count);
+    sensor_read_.resize(sensor_count);
+    pending_keys_.resize(sensor_count);
+    pending_index_.resize(sensor_count);
+    pending_values_.resize(sensor_count);
+    pending_results_.resize(sensor_count);
+    sensor_skipped_.resize(sensor_count);
+    settle_values_.resize(sensor_count);
+    readings_.reserve(sensor_count);
+    for (const SensorSet_t* sensors : {&chip_->cpu, &chip_->auxCpu, &chip_->gpu}) {
+      for (size_t i = 0; i < sensors->count; i++) {
+        health_.push_back({sensors->keys[i], 0, 0, kQuarantineMinSamples, 0, 0, 0, 0});
+      }
     }
   }
+  BindClusters();
 }
 
-bool SmcTemp::IsValidTemperature(double temperature, const std::pair<unsigned int, unsigned int>& limits) {
-  return temperature > limits.first && temperature < limits.second;
+// Looks up the cluster of every primary CPU sensor in kCpuClusters.
+void SmcTemp::BindClusters() {
+  cluster_temps_.clear();
+  cpu_cluster_.clear();
+  if (chip_ == nullptr) {
+    return;
+  }
+  cpu_cluster_.resize(chip_->cpu.count);
+  for (size_t i = 0; i < chip_->cpu.count; i++) {
+    const char* name = "cpu";
+#if defined(ARCH_TYPE_ARM64)
+    for (const CpuCluster_t& cluster : kCpuClusters) {
+      if (strcmp(cluster.model, chip_->model) == 0 &&
+          std::find(cluster.sensors.keys, cluster.sensors.keys + cluster.sensors.count, chip_->cpu.keys[i]) !=
+          cluster.sensors.keys + cluster.sensors.count) {
+        name = cluster.name;
+        break;
+      }
+    }
+#endif
+    size_t index = 0;
+    while (index < cluster_temps_.size() && strcmp(cluster_temps_[index].name, name) != 0) {
+      index++;
+    }
+    if (index == cluster_temps_.size()) {
+      cluster_temps_.push_back({name, 0.0, 0});
+    }
+    cpu_cluster_[i] = static_cast<uint8_t>(index);
+  }
 }
 
-bool SmcTemp::StoreValidTemperature(double temperature, std::string file_name) {
-  if (!is_fail_soft_) {
-    return false;
+void SmcTemp::ApplySensorKeys(SensorKeys_t keys) {
+  live_keys_ = std::move(keys);
+  if (live_keys_.cpu.empty() && live_keys_.auxCpu.empty() && live_keys_.gpu.empty()) {
+    chip_ = nullptr;
+  } else {
+    live_chip_ = {chip_ != nullptr ? chip_->model : "",
+                  SensorSet_t{live_keys_.cpu.data(), live_keys_.cpu.size()},
+                  SensorSet_t{live_keys_.auxCpu.data(), live_keys_.auxCpu.size()},
+                  SensorSet_t{live_keys_.gpu.data(), live_keys_.gpu.size()}};
+    chip_ = &live_chip_;
   }
-  std::ofstream out_file(storage_path_ + file_name);
+  BindSensors();
+}
 
-  if (!out_file) {
-    std::cerr << "Failed to open the file: " << storage_path_ + file_name << std::endl;
+// M2 sensors read 0 about half the time, so a key is live if any of
+// kProbeReads reads is a plausible temperature.
+bool SmcTemp::IsLiveSensor(uint32_t key) {
+  SmcSensorHandle_t handle;
+  if (smc_accessor_.Resolve(key, handle) != kIOReturnSuccess) {
     return false;
   }
+  for (uint32_t i = 0; i < kProbeReads; i++) {
+    double value;
+    if (smc_accessor_.Read(handle, value) == kIOReturnSuccess &&
+        IsValidTemperature(value, kSensorTemperatureLimits)) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  out_file << temperature;
-  out_file.close();
-
-  return true;
+// Enumerates the SMC for live T* keys named like CPU (Tp, Te, Tc, TC) or
+// GPU (Tg, TG) die sensors.
+void SmcTemp::FindDieSensors(SensorKeys_t& keys) {
+  const uint32_t key_count = smc_accessor_.ReadIndexCount();
+  for (uint32_t i = 0; i < key_count; i++) {
+    uint32_t key;
+    if (smc_accessor_.ReadKeyAtIndex(i, key) != kIOReturnSuccess || static_cast<char>(key >> 24) != 'T') {
+      continue;
+    }
+    std::vector<uint32_t>* group = nullptr;
+    switch (static_cast<char>(key >> 16)) {
+      case 'p':
+      case 'e':
+      case 'c':
+      case 'C':
+        group = &keys.cpu;
+        break;
+      case 'g':
+      case 'G':
+        group = &keys.gpu;
+        break;
+    }
+    if (group != nullptr && IsLiveSensor(key)) {
+      group->push_back(key);
+    }
+  }
 }
 
-double SmcTemp::CalculateAverageTemperature(const std::vector<std::string>& sensors,
-                                     const std::pair<unsigned int, unsigned int>& limits) {
-  double temp = 0.0;
-  size_t valid_sensor_count = 0;
-  for (auto sensor : sensors) {
-    auto sensor_value = smc_accessor_.ReadValue(sensor.c_str());
-    if (IsValidTemperature(sensor_value, limits)) {
-      temp += sensor_value;
-      valid_sensor_count++;
+// Keeps the listed keys that are live. A set with no live key, and every set
+// of a chip without a list, takes the die sensors found by enumeration
+// instead; a listed set still empty after that is kept whole.
+SensorKeys_t SmcTemp::ProbeSensors() {
+  SensorKeys_t keys;
+  const SensorSet_t none{nullptr, 0};
+  const SensorSet_t& cpu = chip_ != nullptr ? chip_->cpu : none;
+  const SensorSet_t& aux_cpu = chip_ != nullptr ? chip_->auxCpu : none;
+  const SensorSet_t& gpu = chip_ != nullptr ? chip_->gpu : none;
+  auto keep_live = [this](const SensorSet_t& sensors, std::vector<uint32_t>& live) {
+    for (size_t i = 0; i < sensors.count; i++) {
+      if (IsLiveSensor(sensors.keys[i])) {
+        live.push_back(sensors.keys[i]);
+      }
+    }
+  };
+  keep_live(cpu, keys.cpu);
+  keep_live(aux_cpu, keys.auxCpu);
+  keep_live(gpu, keys.gpu);
+
+  const bool need_cpu = keys.cpu.empty() && keys.auxCpu.empty();
+  if (need_cpu || keys.gpu.empty()) {
+    SensorKeys_t dies;
+    FindDieSensors(dies);
+    if (need_cpu) {
+      keys.cpu = std::move(dies.cpu);
+    }
+    if (keys.gpu.empty()) {
+      keys.gpu = std::move(dies.gpu);
     }
   }
-  if (valid_sensor_count > 0) {
-    temp /= valid_sensor_count;
+  if (keys.cpu.empty() && keys.auxCpu.empty()) {
+    keys.cpu.assign(cpu.keys, cpu.keys + cpu.count);
+    keys.auxCpu.assign(aux_cpu.keys, aux_cpu.keys + aux_cpu.count);
   }
-  return temp;
+  if (keys.gpu.empty()) {
+    keys.gpu.assign(gpu.keys, gpu.keys + gpu.count);
+  }
+  return keys;
 }
 
-double SmcTemp::GetCpuTemp() {
-  double temp = 0.0;
-#if defined(ARCH_TYPE_X86_64)
-  const std::pair<unsigned int, unsigned int> valid_temperature_limits{0, 110};
-  // The reason why I prefer CPU die temperature to CPU proximity temperature:
-  // https://github.com/narugit/smctemp/issues/2
-  temp = smc_accessor_.ReadValue(kSensorTC0D);
-  if (IsValidTemperature(temp, valid_temperature_limits)) {
-    StoreValidTemperature(temp, cpu_file_);
-    return temp;
+// Chips without a list are probed on first use, unless a manifest already
+// supplied their keys.
+bool SmcTemp::HaveSensors() {
+  if (chip_ == nullptr && !probed_) {
+    probed_ = true;
+    ApplySensorKeys(ProbeSensors());
   }
-  temp = smc_accessor_.ReadValue(kSensorTC0E);
-  if (IsValidTemperature(temp, valid_temperature_limits)) {
-    StoreValidTemperature(temp, cpu_file_);
-    return temp;
+  return chip_ != nullptr;
+}
+
+bool SmcTemp::UseSensorManifest() {
+  if (!CreateStorageDirectory()) {
+    return false;
   }
-  temp = smc_accessor_.ReadValue(kSensorTC0F);
-  if (IsValidTemperature(temp, valid_temperature_limits)) {
-    StoreValidTemperature(temp, cpu_file_);
-    return temp;
+  return UseSensorManifest(storage_path_ + manifest_file_);
+}
+
+bool SmcTemp::UseSensorManifest(const std::string& path) {
+#if defined(ARCH_TYPE_ARM64)
+  const std::string model = getMachineModel() + "/" + getCPUModel();
+#else
+  const std::string model = getMachineModel();
+#endif
+  SensorManifestFile file(path, model, smc_accessor_.ReadIndexCount());
+  SensorKeys_t keys;
+  probed_ = true;
+  if (file.Load(keys)) {
+    ApplySensorKeys(std::move(keys));
+    return true;
+  }
+  keys = ProbeSensors();
+  // Nothing found is not worth remembering; a later run probes again.
+  const bool saved = (keys.cpu.empty() && keys.auxCpu.empty() && keys.gpu.empty()) || file.Save(keys);
+  ApplySensorKeys(std::move(keys));
+  return saved;
+}
+
+bool SmcTemp::CreateStorageDirectory() {
+  if (mkdir(storage_path_.c_str(), 0777) && errno != EEXIST) {
+    std::cerr << "Failed to create directory: " << storage_path_ << std::endl;
+    return false;
   }
-  temp = smc_accessor_.ReadValue(kSensorTC0P);
-  if (IsValidTemperature(temp, valid_temperature_limits)) {
-    StoreValidTemperature(temp, cpu_file_);
-    return temp;
+  return true;
+}
+
+bool SmcTemp::UsePersistentKeyInfoCache() {
+  if (!CreateStorageDirectory()) {
+    return false;
   }
-#elif defined(ARCH_TYPE_ARM64)
-  std::vector<std::string> sensors;
-  std::vector<std::string> aux_sensors;
-  const std::pair<unsigned int, unsigned int> valid_temperature_limits{10, 120};
+  return smc_accessor_.UsePersistentKeyInfoCache(storage_path_ + key_info_file_);
+}
 
-  const std::string cpumodel = getCPUModel();
-  if (cpumodel.find("m5") != std::string::npos) {  // Apple M5
-    // ref: https://github.com/exelban/stats/blob/ab28d72/Modules/Sensors/values.swift#L469-L487
-    // CPU super cores
-    sensors.emplace_back(static_cast<std::string>(kSensorTp00));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp04));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp08));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0C));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0G));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0K));
-    // CPU performance cores
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0O));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0R));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0U));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0X));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0a));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0d));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0g));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0j));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0m));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0p));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0u));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0y));
-  } else if (cpumodel.find("m4") != std::string::npos) {  // Apple M4
-    sensors.emplace_back(static_cast<std::string>(kSensorTp01));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp09));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0f));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp05));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0D));
-  } else if (cpumodel.find("m3") != std::string::npos) {  // Apple M3
-    // CPU core 1
-    sensors.emplace_back(static_cast<std::string>(kSensorTp01));
-    // CPU core 2
-    sensors.emplace_back(static_cast<std::string>(kSensorTp09));
-    // CPU core 3
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0f));
-    // CPU core 4
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0n));
-    // CPU core 5
-    sensors.emplace_back(static_cast<std::string>(kSensorTp05));
-    // CPU core 6
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0D));
-    // CPU core 7
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0j));
-    // CPU core 8
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0r));
-  } else if (cpumodel.find("m2") != std::string::npos) {  // Apple M2
-    // CPU efficient cores 1 through 4 on M2 Max 12 Core Chip
-    sensors.emplace_back(static_cast<std::string>(kSensorTp1h));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp1t));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp1p));
-    sensors.emplace_back(static_cast<std::string>(kSensorTp1l));
-
-    // CPU core 1
-    sensors.emplace_back(static_cast<std::string>(kSensorTp01));
-    // CPU core 2
-    sensors.emplace_back(static_cast<std::string>(kSensorTp09));
-    // CPU core 3
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0f));
-    // CPU core 4
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0n));
-    // CPU core 5
-    sensors.emplace_back(static_cast<std::string>(kSensorTp05));
-    // CPU core 6
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0D));
-    // CPU core 7
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0j));
-    // CPU core 8
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0r));
-  } else if (cpumodel.find("m1") != std::string::npos) {  // Apple M1
-    // CPU performance core 1 temperature
-    sensors.emplace_back(static_cast<std::string>(kSensorTp01));
-    // CPU performance core 2 temperature
-    sensors.emplace_back(static_cast<std::string>(kSensorTp05));
-    // CPU performance core 3 temperature
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0D));
-    // CPU performance core 4 temperature
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0H));
-    // CPU performance core 5 temperature
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0L));
-    // CPU performance core 6 temperature
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0P));
-    // CPU performance core 7 temperature
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0X));
-    // CPU performance core 8 temperature
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0b));
-    // CPU efficient core 1 temperature
-    sensors.emplace_back(static_cast<std::string>(kSensorTp09));
-    // CPU efficient core 2 temperature
-    sensors.emplace_back(static_cast<std::string>(kSensorTp0T));
-
-    aux_sensors.emplace_back(static_cast<std::string>(kSensorTc0a));
-    aux_sensors.emplace_back(static_cast<std::string>(kSensorTc0b));
-    aux_sensors.emplace_back(static_cast<std::string>(kSensorTc0x));
-    aux_sensors.emplace_back(static_cast<std::string>(kSensorTc0z));
-  } else {
-    // not supported
-    return temp;
+bool SmcTemp::IsValidTemperature(double temperature, const std::pair<unsigned int, unsigned int>& limits) {
+  return temperature > limits.first && temperature < limits.second;
+}
+
+void SmcTemp::EnableStats(const StatsConfig_t& config) {
+  HaveSensors();
+  std::vector<uint32_t> keys;
+  for (const SensorHealth_t& health : health_) {
+    keys.push_back(health.key);
   }
+  stats_ = std::make_unique<TemperatureStats>(config, std::move(keys));
+}
 
-  temp = CalculateAverageTemperature(sensors, valid_temperature_limits);
-  if (temp > std::numeric_limits<double>::epsilon()) {
-    if (IsValidTemperature(temp, valid_temperature_limits)) {
-      StoreValidTemperature(temp, cpu_file_);
+void SmcTemp::EnableMetrics() {
+  if (!metrics_) {
+    metrics_ = std::make_unique<SmcMetrics>();
+  }
+  smc_accessor_.EnableMetrics(metrics_.get());
+}
+
+// Adds the settled temperature and the valid readings of the last sample.
+void SmcTemp::AddToStats(SeriesStats& series, double temperature) {
+  const int64_t now_ns = MonotonicNs();
+  if (IsValidTemperature(temperature, kSensorTemperatureLimits)) {
+    series.Add(now_ns, temperature);
+  }
+  for (const SensorReading_t& reading : readings_) {
+    SeriesStats* sensor = stats_->Sensor(reading.key);
+    if (sensor != nullptr && IsValidTemperature(reading.value, kSensorTemperatureLimits)) {
+      sensor->Add(now_ns, reading.value);
     }
-    return temp;
   }
+}
 
-  temp = CalculateAverageTemperature(aux_sensors, valid_temperature_limits);
-  if (IsValidTemperature(temp, valid_temperature_limits)) {
-    StoreValidTemperature(temp, cpu_file_);
+void SmcTemp::StoreValidTemperature(double temperature, LastValidStore* store) {
+  if (store == nullptr) {
+    return;
   }
-#endif
+  const int64_t start_ns = metrics_ ? MonotonicNs() : 0;
+  store->Store(temperature, sample_stats_.validSensors);
+  if (metrics_) {
+    metrics_->failSoftStores.Record(MonotonicNs() - start_ns);
+  }
+}
 
-  return temp;
+double SmcTemp::LoadValidTemperature(const LastValidStore* store) const {
+  LastValid_t record;
+  if (store == nullptr || !store->Load(record)) {
+    return 0.0;
+  }
+  if (fail_soft_max_age_.count() > 0 && LastValidStore::AgeNs(record) > fail_soft_max_age_.count()) {
+    return 0.0;
+  }
+  return record.value;
 }
 
-double SmcTemp::GetGpuTemp() {
-  double temp = 0.0;
-#if defined(ARCH_TYPE_X86_64)
-  const std::pair<unsigned int, unsigned int> valid_temperature_limits{0, 110};
-  temp = smc_accessor_.ReadValue(kSensorTG0D);
-  if (IsValidTemperature(temp, valid_temperature_limits)) {
-    StoreValidTemperature(temp, gpu_file_);
-    return temp;
+void SmcTemp::SetRetry(unsigned int attempts, std::chrono::nanoseconds retry_interval,
+                       unsigned int quorum_percent) {
+  attempts_ = attempts > 0 ? attempts : 1;
+  retry_interval_ = retry_interval;
+  quorum_percent_ = quorum_percent < 100 ? quorum_percent : 100;
+}
+
+// Reads the sensors of the set that have no valid value yet. Returns the
+// number of valid sensors in the set.
+size_t SmcTemp::PollSensors(const SensorSet_t& sensors, size_t base) {
+  if (kSensorsAreAlternatives) {
+    for (size_t i = 0; i < sensors.count; i++) {
+      if (sensor_valid_[base + i]) {
+        return 1;
+      }
+      if (sensor_skipped_[base + i]) {
+        continue;
+      }
+      kern_return_t result;
+      smc_accessor_.ReadValues(&sensors.keys[i], 1, &sensor_values_[base + i], &result);
+      sensor_read_[base + i] = 1;
+      sample_stats_.sensorReads++;
+      RecordHealth(base + i, sensor_values_[base + i], result);
+      if (IsValidTemperature(sensor_values_[base + i], kSensorTemperatureLimits)) {
+        sensor_valid_[base + i] = 1;
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  size_t pending = 0;
+  for (size_t i = 0; i < sensors.count; i++) {
+    if (!sensor_valid_[base + i] && !sensor_skipped_[base + i]) {
+      pending_keys_[pending] = sensors.keys[i];
+      pending_index_[pending] = base + i;
+      pending++;
+    }
   }
-  temp = smc_accessor_.ReadValue(kSensorTPCD);
-  if (IsValidTemperature(temp, valid_temperature_limits)) {
-    StoreValidTemperature(temp, gpu_file_);
+  smc_accessor_.ReadValues(pending_keys_.data(), pending, pending_values_.data(), pending_results_.data());
+  sample_stats_.sensorReads += pending;
+  for (size_t i = 0; i < pending; i++) {
+    const size_t index = pending_index_[i];
+    sensor_values_[index] = pending_values_[i];
+    sensor_read_[index] = 1;
+    sensor_valid_[index] = IsValidTemperature(pending_values_[i], kSensorTemperatureLimits);
+    RecordHealth(index, pending_values_[i], pending_results_[i]);
+  }
+  return ValidCount(sensors, base);
+}
+
+size_t SmcTemp::ValidCount(const SensorSet_t& sensors, size_t base) const {
+  size_t valid_sensor_count = 0;
+  for (size_t i = 0; i < sensors.count; i++) {
+    valid_sensor_count += sensor_valid_[base + i];
+  }
+  return valid_sensor_count;
+}
+
+// The first valid alternative on x86, otherwise the valid sensors combined
+// as aggregation_ says. With no valid sensor, the last alternative read or 0.
+double SmcTemp::SettleTemperature(const SensorSet_t& sensors, size_t base, bool by_cluster) {
+  if (kSensorsAreAlternatives) {
+    double temp = 0.0;
+    for (size_t i = 0; i < sensors.count; i++) {
+      if (sensor_read_[base + i]) {
+        temp = sensor_values_[base + i];
+      }
+      if (sensor_valid_[base + i]) {
+        return temp;
+      }
+    }
     return temp;
   }
-#elif defined(ARCH_TYPE_ARM64)
-  std::vector<std::string> sensors;
-  const std::pair<unsigned int, unsigned int> valid_temperature_limits{10, 120};
-  const std::string cpumodel = getCPUModel();
-  if (cpumodel.find("m5") != std::string::npos) {  // Apple M5
-    // ref: https://github.com/exelban/stats/blob/ab28d72/Modules/Sensors/values.swift#L489-L496
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0U));  // GPU 1
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0X));  // GPU 2
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0d));  // GPU 3
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0g));  // GPU 4
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0j));  // GPU 5
-    sensors.emplace_back(static_cast<std::string>(kSensorTg1Y));  // GPU 6
-    sensors.emplace_back(static_cast<std::string>(kSensorTg1c));  // GPU 7
-    sensors.emplace_back(static_cast<std::string>(kSensorTg1g));  // GPU 8
-  } else if (cpumodel.find("m4") != std::string::npos) {  // Apple M4
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0D));  // GPU 1
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0P));  // GPU 2
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0X));  // GPU 3
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0j));  // GPU 4
-  } else if (cpumodel.find("m3") != std::string::npos) {  // Apple M3
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0D));  // GPU 1
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0P));  // GPU 2
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0X));  // GPU 3
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0b));  // GPU 4
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0j));  // GPU 5
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0v));  // GPU 6
-  } else if (cpumodel.find("m2") != std::string::npos) {  // Apple M2
-    // ref: https://github.com/exelban/stats/blob/6b88eb1f60a0eb5b1a7b51b54f044bf637fd785b/Modules/Sensors/values.swift#L369-L370
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0f));  // GPU 1
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0j));  // GPU 2
-  } else if (cpumodel.find("m1") != std::string::npos) {  // Apple M1
-    // ref: https://github.com/exelban/stats/blob/6b88eb1f60a0eb5b1a7b51b54f044bf637fd785b/Modules/Sensors/values.swift#L354-L357
-    sensors.emplace_back(static_cast<std::string>(kSensorTg05));  // GPU 1
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0D));  // GPU 2
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0L));  // GPU 3
-    sensors.emplace_back(static_cast<std::string>(kSensorTg0T));  // GPU 4
-    // ref: runtime detected on a M1 mac mini
-    sensors.emplace_back(static_cast<std::string>(kSensorTg1b));  // GPU 5
-    sensors.emplace_back(static_cast<std::string>(kSensorTg4b));  // GPU 6
-  } else {
-    // not supported
+  if (by_cluster && aggregation_ == Aggregation::kHottestCluster) {
+    double temp = 0.0;
+    for (const ClusterTemp_t& cluster : cluster_temps_) {
+      if (cluster.validSensors > 0 && cluster.temperature > temp) {
+        temp = cluster.temperature;
+      }
+    }
     return temp;
   }
-  temp = CalculateAverageTemperature(sensors, valid_temperature_limits);
-  if (IsValidTemperature(temp, valid_temperature_limits)) {
-    StoreValidTemperature(temp, gpu_file_);
+  size_t valid_sensor_count = 0;
+  for (size_t i = 0; i < sensors.count; i++) {
+    if (sensor_valid_[base + i]) {
+      settle_values_[valid_sensor_count++] = sensor_values_[base + i];
+    }
   }
-#endif
-  return temp;
+  return Aggregate(aggregation_, settle_values_.data(), valid_sensor_count);
 }
 
-double SmcTemp::GetLastValidCpuTemp() {
-  std::string file_path = storage_path_ + cpu_file_;
-  std::ifstream file(file_path);
-  if (!file.is_open()) {
-    std::cerr << "Failed to open the file: " << file_path << std::endl;
+void SmcTemp::UpdateClusterTemps(const SensorSet_t& sensors, bool use_aux) {
+  for (ClusterTemp_t& cluster : cluster_temps_) {
+    cluster.temperature = 0.0;
+    cluster.validSensors = 0;
   }
+  if (use_aux) {
+    return;
+  }
+  for (size_t i = 0; i < sensors.count; i++) {
+    if (sensor_valid_[i]) {
+      ClusterTemp_t& cluster = cluster_temps_[cpu_cluster_[i]];
+      cluster.temperature += sensor_values_[i];
+      cluster.validSensors++;
+    }
+  }
+  for (ClusterTemp_t& cluster : cluster_temps_) {
+    if (cluster.validSensors > 0) {
+      cluster.temperature /= cluster.validSensors;
+    }
+  }
+}
 
-  double value;
-  file >> value;
-
-  if (file.fail()) {
-    std::cerr << "Failed to read sensor value from file: " + file_path << std::endl;
+void SmcTemp::RecordReadings(const SensorSet_t& sensors, size_t base) {
+  for (size_t i = 0; i < sensors.count; i++) {
+    if (sensor_read_[base + i]) {
+      readings_.push_back({sensors.keys[i], sensor_values_[base + i]});
+    }
   }
+}
 
-  return value;
+// Marks the quarantined sensors as skipped for this sample and counts their
+// quarantine down. If every sensor is quarantined they are all probed
+// instead, as a sample with nothing to read could not settle anything.
+void SmcTemp::SkipQuarantined(size_t count) {
+  size_t skipped = 0;
+  for (size_t i = 0; i < count; i++) {
+    SensorHealth_t& health = sample_health_[i];
+    sensor_skipped_[i] = quarantine_ && health.quarantineLeft > 0;
+    if (health.quarantineLeft > 0) {
+      health.quarantineLeft--;
+    }
+    skipped += sensor_skipped_[i];
+  }
+  if (skipped == count) {
+    std::fill_n(sensor_skipped_.begin(), count, 0);
+  }
 }
 
-double SmcTemp::GetLastValidGpuTemp() {
-  std::string file_path = storage_path_ + gpu_file_;
-  std::ifstream file(file_path);
-  if (!file.is_open()) {
-    std::cerr << "Failed to open the file: " << file_path << std::endl;
+void SmcTemp::RecordHealth(size_t index, double value, kern_return_t result) {
+  SensorHealth_t& health = sample_health_[index];
+  health.reads++;
+  if (result == kIOReturnSuccess && IsValidTemperature(value, kSensorTemperatureLimits)) {
+    health.consecutiveFailures = 0;
+    health.backoff = kQuarantineMinSamples;
+    return;
+  }
+  if (metrics_) {
+    metrics_->invalidReadings.fetch_add(1, std::memory_order_relaxed);
   }
+  if (result == kIOReturnNotFound) {
+    health.keyInfoErrors++;
+  } else if (result != kIOReturnSuccess) {
+    health.callErrors++;
+  } else {
+    health.outOfRange++;
+  }
+  health.consecutiveFailures++;
+  if (quarantine_ && health.consecutiveFailures >= kQuarantineFailures) {
+    health.quarantineLeft = health.backoff;
+    health.backoff = std::min(health.backoff * 2, kQuarantineMaxSamples);
+    sensor_skipped_[index] = 1;
+  }
+}
+
+// Polls the sensors until enough of them are valid or the attempts run out.
+// The aux sensors are only read while none of the primary ones is valid.
+// Quarantined sensors are left out, also of the quorum. by_cluster is set for
+// the CPU, whose primary sensors are grouped in cluster_temps_.
+double SmcTemp::Sample(const SensorSet_t& sensors, const SensorSet_t& aux_sensors, SensorHealth_t* health,
+                       bool by_cluster) {
+  const int64_t start_ns = MonotonicNs();
+  const size_t sensor_count = sensors.count + aux_sensors.count;
+  std::fill_n(sensor_valid_.begin(), sensor_count, 0);
+  std::fill_n(sensor_read_.begin(), sensor_count, 0);
+  std::fill_n(sensor_values_.begin(), sensor_count, 0.0);
+  sample_health_ = health;
+  SkipQuarantined(sensor_count);
+  sample_stats_ = {0, 0, 0, 0};
+  readings_.clear();
+
+  int64_t deadline_ns = start_ns;
+  bool use_aux = false;
+  while (sample_stats_.attempts < attempts_) {
+    sample_stats_.attempts++;
+    const size_t valid_sensor_count = PollSensors(sensors, 0);
+    // Counted after the pass, which may have quarantined more sensors.
+    size_t live_sensor_count = 0;
+    for (size_t i = 0; i < sensors.count; i++) {
+      live_sensor_count += !sensor_skipped_[i];
+    }
+    // As in SkipQuarantined(), a set with nothing left to read is probed
+    // whole, so the remaining attempts are not spent reading nothing.
+    if (live_sensor_count == 0) {
+      std::fill_n(sensor_skipped_.begin(), sensors.count, 0);
+      live_sensor_count = sensors.count;
+    }
+    const size_t quorum = kSensorsAreAlternatives
+      ? 1 : std::max<size_t>(1, (live_sensor_count * quorum_percent_ + 99) / 100);
+    if (valid_sensor_count >= quorum) {
+      break;
+    }
+    if (valid_sensor_count == 0 && aux_sensors.count > 0 && PollSensors(aux_sensors, sensors.count) > 0) {
+      use_aux = true;
+      break;
+    }
+    if (sample_stats_.attempts < attempts_) {
+      deadline_ns += retry_interval_.count();
+      SleepUntil(deadline_ns);
+    }
+  }
+  RecordReadings(sensors, 0);
+  RecordReadings(aux_sensors, sensors.count);
+  sample_stats_.elapsedNs = MonotonicNs() - start_ns;
+  if (metrics_) {
+    metrics_->samples.Record(sample_stats_.elapsedNs);
+    metrics_->retries.fetch_add(sample_stats_.attempts - 1, std::memory_order_relaxed);
+  }
+  if (!use_aux && ValidCount(sensors, 0) == 0 && ValidCount(aux_sensors, sensors.count) > 0) {
+    use_aux = true;
+  }
+  sample_stats_.validSensors =
+    static_cast<uint32_t>(use_aux ? ValidCount(aux_sensors, sensors.count) : ValidCount(sensors, 0));
+  if (by_cluster) {
+    UpdateClusterTemps(sensors, use_aux);
+  }
+  return use_aux ? SettleTemperature(aux_sensors, sensors.count, false)
+                 : SettleTemperature(sensors, 0, by_cluster);
+}
 
-  double value;
-  file >> value;
+double SmcTemp::GetCpuTemp() {
+  if (!HaveSensors()) {
+    // not supported
+    readings_.clear();
+    return 0.0;
+  }
+  const double temp = Sample(chip_->cpu, chip_->auxCpu, health_.data(), true);
+  if (stats_) {
+    AddToStats(stats_->Cpu(), temp);
+  }
+  if (IsValidTemperature(temp, kSensorTemperatureLimits)) {
+    StoreValidTemperature(temp, cpu_store_.get());
+  }
+  return temp;
+}
 
-  if (file.fail()) {
-    std::cerr << "Failed to read sensor value from file: " + file_path << std::endl;
+double SmcTemp::GetGpuTemp() {
+  if (!HaveSensors()) {
+    // not supported
+    readings_.clear();
+    return 0.0;
   }
+  const double temp = Sample(chip_->gpu, SensorSet_t{nullptr, 0},
+                             health_.data() + chip_->cpu.count + chip_->auxCpu.count, false);
+  if (stats_) {
+    AddToStats(stats_->Gpu(), temp);
+  }
+  if (IsValidTemperature(temp, kSensorTemperatureLimits)) {
+    StoreValidTemperature(temp, gpu_store_.get());
+  }
+  return temp;
+}
 
-  return value;
+void SmcTemp::PrintSensorHealth(std::ostream& out) const {
+  for (const SensorHealth_t& health : health_) {
+    char name[5];
+    string_util::ultostr(name, sizeof(name), health.key);
+    out << name << "  reads " << health.reads << ", absent " << health.keyInfoErrors
+      << ", errors " << health.callErrors << ", out of range " << health.outOfRange
+      << ", failing " << health.consecutiveFailures;
+    if (health.quarantineLeft > 0) {
+      out << ", quarantined for " << health.quarantineLeft << " samples";
+    }
+    out << std::endl;
+  }
 }
+
+double SmcTemp::GetLastValidCpuTemp() {
+  return LoadValidTemperature(cpu_store_.get());
 }
 
+double SmcTemp::GetLastValidGpuTemp() {
+  return LoadValidTemperature(gpu_store_.get());
+}
+}
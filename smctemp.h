@@ -23,11 +23,26 @@
 #ifndef SMCTEMP_H_
 #define SMCTEMP_H_
 
-#include <IOKit/IOKitLib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <iosfwd>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "smctemp_aggregate.h"
+#include "smctemp_cache.h"
+#include "smctemp_decode.h"
+#include "smctemp_format.h"
+#include "smctemp_manifest.h"
+#include "smctemp_metrics.h"
+#include "smctemp_stats.h"
+#include "smctemp_store.h"
+#include "smctemp_string.h"
+#include "smctemp_transport.h"
 #include "smctemp_types.h"
 
 #define COUNT_OF(x) ((sizeof(x)/sizeof(0[x])) / ((size_t)(!(sizeof(x) % sizeof(0[x])))))
@@ -43,6 +58,11 @@ constexpr int kOpNone = 0;
 constexpr int kOpList = 1;
 constexpr int kOpReadCpuTemp = 2;
 constexpr int kOpReadGpuTemp = 3;
+constexpr int kOpDaemon = 4;
+constexpr int kOpSnapshot = 5;
+// Degrees Celsius. A CPU or GPU temperature outside them is a failed read to
+// the command line, the daemon and AsyncSmcReader alike.
+constexpr std::pair<unsigned int, unsigned int> kValidTemperatureLimits{10, 120};
 
 // List of key and name: 
 // - https://github.com/exelban/stats/blob/6b88eb1f60a0eb5b1a7b51b54f044bf637fd785b/Modules/Sensors/values.swift
@@ -56,6 +76,16 @@ constexpr UInt32Char_t kSensorTC0P = "TC0P";  // CPU proximity temperature
 // GPU
 constexpr UInt32Char_t kSensorTG0D = "TG0D";  // PCH Die Temp
 constexpr UInt32Char_t kSensorTPCD = "TPCD";  // PCH Die Temp (digital)
+
+// Read in order until one gives a valid temperature.
+// The reason why I prefer CPU die temperature to CPU proximity temperature:
+// https://github.com/narugit/smctemp/issues/2
+constexpr uint32_t kCpuSensors[] = {
+  FourCC(kSensorTC0D), FourCC(kSensorTC0E), FourCC(kSensorTC0F), FourCC(kSensorTC0P),
+};
+constexpr uint32_t kGpuSensors[] = {
+  FourCC(kSensorTG0D), FourCC(kSensorTPCD),
+};
 #elif defined(ARCH_TYPE_ARM64)
 // CPU
 constexpr UInt32Char_t kSensorTc0a = "Tc0a";
@@ -115,46 +145,345 @@ constexpr UInt32Char_t kSensorTg1b = "Tg1b";
 constexpr UInt32Char_t kSensorTg1c = "Tg1c";
 constexpr UInt32Char_t kSensorTg1g = "Tg1g";
 constexpr UInt32Char_t kSensorTg4b = "Tg4b";
+
+// Sensors averaged per chip.
+// ref: https://github.com/exelban/stats/blob/ab28d72/Modules/Sensors/values.swift#L469-L496
+constexpr uint32_t kM5CpuSensors[] = {
+  // CPU super cores
+  FourCC(kSensorTp00), FourCC(kSensorTp04), FourCC(kSensorTp08), FourCC(kSensorTp0C),
+  FourCC(kSensorTp0G), FourCC(kSensorTp0K),
+  // CPU performance cores
+  FourCC(kSensorTp0O), FourCC(kSensorTp0R), FourCC(kSensorTp0U), FourCC(kSensorTp0X),
+  FourCC(kSensorTp0a), FourCC(kSensorTp0d), FourCC(kSensorTp0g), FourCC(kSensorTp0j),
+  FourCC(kSensorTp0m), FourCC(kSensorTp0p), FourCC(kSensorTp0u), FourCC(kSensorTp0y),
+};
+constexpr uint32_t kM5GpuSensors[] = {
+  FourCC(kSensorTg0U), FourCC(kSensorTg0X), FourCC(kSensorTg0d), FourCC(kSensorTg0g),
+  FourCC(kSensorTg0j), FourCC(kSensorTg1Y), FourCC(kSensorTg1c), FourCC(kSensorTg1g),
+};
+constexpr uint32_t kM4CpuSensors[] = {
+  FourCC(kSensorTp01), FourCC(kSensorTp09), FourCC(kSensorTp0f), FourCC(kSensorTp05),
+  FourCC(kSensorTp0D),
+};
+constexpr uint32_t kM4GpuSensors[] = {
+  FourCC(kSensorTg0D), FourCC(kSensorTg0P), FourCC(kSensorTg0X), FourCC(kSensorTg0j),
+};
+// CPU cores 1 through 8
+constexpr uint32_t kM3CpuSensors[] = {
+  FourCC(kSensorTp01), FourCC(kSensorTp09), FourCC(kSensorTp0f), FourCC(kSensorTp0n),
+  FourCC(kSensorTp05), FourCC(kSensorTp0D), FourCC(kSensorTp0j), FourCC(kSensorTp0r),
+};
+constexpr uint32_t kM3GpuSensors[] = {
+  FourCC(kSensorTg0D), FourCC(kSensorTg0P), FourCC(kSensorTg0X), FourCC(kSensorTg0b),
+  FourCC(kSensorTg0j), FourCC(kSensorTg0v),
+};
+constexpr uint32_t kM2CpuSensors[] = {
+  // CPU efficient cores 1 through 4 on M2 Max 12 Core Chip
+  FourCC(kSensorTp1h), FourCC(kSensorTp1t), FourCC(kSensorTp1p), FourCC(kSensorTp1l),
+  // CPU cores 1 through 8
+  FourCC(kSensorTp01), FourCC(kSensorTp09), FourCC(kSensorTp0f), FourCC(kSensorTp0n),
+  FourCC(kSensorTp05), FourCC(kSensorTp0D), FourCC(kSensorTp0j), FourCC(kSensorTp0r),
+};
+// ref: https://github.com/exelban/stats/blob/6b88eb1f60a0eb5b1a7b51b54f044bf637fd785b/Modules/Sensors/values.swift#L369-L370
+constexpr uint32_t kM2GpuSensors[] = {
+  FourCC(kSensorTg0f), FourCC(kSensorTg0j),
+};
+constexpr uint32_t kM1CpuSensors[] = {
+  // CPU performance cores 1 through 8
+  FourCC(kSensorTp01), FourCC(kSensorTp05), FourCC(kSensorTp0D), FourCC(kSensorTp0H),
+  FourCC(kSensorTp0L), FourCC(kSensorTp0P), FourCC(kSensorTp0X), FourCC(kSensorTp0b),
+  // CPU efficient cores 1 and 2
+  FourCC(kSensorTp09), FourCC(kSensorTp0T),
+};
+// Read when none of kM1CpuSensors gives a value.
+constexpr uint32_t kM1AuxCpuSensors[] = {
+  FourCC(kSensorTc0a), FourCC(kSensorTc0b), FourCC(kSensorTc0x), FourCC(kSensorTc0z),
+};
+// ref: https://github.com/exelban/stats/blob/6b88eb1f60a0eb5b1a7b51b54f044bf637fd785b/Modules/Sensors/values.swift#L354-L357
+// Tg1b and Tg4b: runtime detected on a M1 mac mini
+constexpr uint32_t kM1GpuSensors[] = {
+  FourCC(kSensorTg05), FourCC(kSensorTg0D), FourCC(kSensorTg0L), FourCC(kSensorTg0T),
+  FourCC(kSensorTg1b), FourCC(kSensorTg4b),
+};
+#endif
+
+typedef struct {
+  const uint32_t* keys;
+  size_t          count;
+} SensorSet_t;
+
+typedef struct {
+  const char* model;  // matched against the lower-cased CPU brand string
+  SensorSet_t cpu;
+  SensorSet_t auxCpu;
+  SensorSet_t gpu;
+} ChipSensors_t;
+
+#define SENSOR_SET(x) SensorSet_t{x, COUNT_OF(x)}
+#if defined(ARCH_TYPE_X86_64)
+constexpr ChipSensors_t kChipSensors[] = {
+  {"", SENSOR_SET(kCpuSensors), SensorSet_t{nullptr, 0}, SENSOR_SET(kGpuSensors)},
+};
+#elif defined(ARCH_TYPE_ARM64)
+// Checked in order; the first model found in the brand string wins.
+constexpr ChipSensors_t kChipSensors[] = {
+  {"m5", SENSOR_SET(kM5CpuSensors), SensorSet_t{nullptr, 0}, SENSOR_SET(kM5GpuSensors)},
+  {"m4", SENSOR_SET(kM4CpuSensors), SensorSet_t{nullptr, 0}, SENSOR_SET(kM4GpuSensors)},
+  {"m3", SENSOR_SET(kM3CpuSensors), SensorSet_t{nullptr, 0}, SENSOR_SET(kM3GpuSensors)},
+  {"m2", SENSOR_SET(kM2CpuSensors), SensorSet_t{nullptr, 0}, SENSOR_SET(kM2GpuSensors)},
+  {"m1", SENSOR_SET(kM1CpuSensors), SENSOR_SET(kM1AuxCpuSensors), SENSOR_SET(kM1GpuSensors)},
+};
 #endif
+#undef SENSOR_SET
+
+// CPU sensors that belong to one core cluster, for the chips whose lists say
+// which cores they sit on. Keys of other chips, and keys not listed here,
+// form one "cpu" cluster.
+typedef struct {
+  const char* model;  // as in kChipSensors
+  const char* name;
+  SensorSet_t sensors;
+} CpuCluster_t;
+
+#if defined(ARCH_TYPE_ARM64)
+constexpr CpuCluster_t kCpuClusters[] = {
+  {"m5", "super", SensorSet_t{kM5CpuSensors, 6}},
+  {"m5", "performance", SensorSet_t{kM5CpuSensors + 6, 12}},
+  {"m2", "efficiency", SensorSet_t{kM2CpuSensors, 4}},
+  {"m2", "performance", SensorSet_t{kM2CpuSensors + 4, 8}},
+  {"m1", "performance", SensorSet_t{kM1CpuSensors, 8}},
+  {"m1", "efficiency", SensorSet_t{kM1CpuSensors + 8, 2}},
+};
+#endif
+
+// The sensor sets of the chip this process runs on, or null if the chip is
+// not supported.
+const ChipSensors_t* DetectChipSensors();
+
+// A key resolved once with SmcAccessor::Resolve. Reading it costs only the
+// kSmcCmdReadBytes call and a decoder chosen for its type and size.
+typedef struct {
+  uint32_t    key;
+  uint32_t    dataSize;
+  SmcDecodeFn decode;
+  double      scale;
+} SmcSensorHandle_t;
 
 class SmcAccessor {
  private:
   kern_return_t Open();
   kern_return_t Close();
   kern_return_t ReadSmcVal(const UInt32Char_t key, SmcVal_t& val);
+  kern_return_t ReadSmcVal(const uint32_t key, SmcVal_t& val);
+  SmcCallMetrics* CallMetrics(const SmcKeyData_t* inputStructure) const;
 
-  io_connect_t conn_ = 0;
+  std::unique_ptr<SmcTransport> transport_;
+  // Cache the keyInfo to lower the energy impact of GetKeyInfo()
+  KeyInfoCache key_info_cache_;
+  std::unique_ptr<KeyInfoCacheFile> key_info_cache_file_;
+  std::atomic<bool> key_info_cache_dirty_{false};
+  // kSmcCmdReadBytes request reused by ReadValues; only key and dataSize
+  // change between reads.
+  SmcKeyData_t read_request_;
+  SmcKeyData_t read_response_;
+  kern_return_t open_result_;
+  int64_t open_ns_ = 0;
+  SmcMetrics* metrics_ = nullptr;
 
  public:
   SmcAccessor();
+  explicit SmcAccessor(std::unique_ptr<SmcTransport> transport);
   ~SmcAccessor();
+  bool IsOpen() const { return open_result_ == kIOReturnSuccess; }
   kern_return_t Call(int index, SmcKeyData_t *inputStructure, SmcKeyData_t *outputStructure);
+  // Safe to call from several threads once the key is cached.
   kern_return_t GetKeyInfo(const uint32_t key, SmcKeyData_keyInfo_t& key_info);
   double ReadValue(const UInt32Char_t key);
+  // Reads and decodes count keys into the caller-owned values array. results
+  // may be null; otherwise it receives the status of each read. Values of
+  // failed reads are 0.
+  void ReadValues(const uint32_t* keys, size_t count, double* values, kern_return_t* results);
+  // Looks up the key info of key once. kIOReturnNotFound if the SMC has no
+  // such key.
+  kern_return_t Resolve(const uint32_t key, SmcSensorHandle_t& handle);
+  kern_return_t Resolve(const UInt32Char_t key, SmcSensorHandle_t& handle);
+  kern_return_t Read(const SmcSensorHandle_t& handle, double& value);
+  // Like ReadValues, for resolved handles.
+  void ReadMany(const SmcSensorHandle_t* handles, size_t count, double* values, kern_return_t* results);
   uint32_t ReadIndexCount();
-  kern_return_t PrintAll();
-  void PrintSmcVal(SmcVal_t val);
-  void PrintByteReadable(SmcVal_t val);
+  // The key at position index of the SMC's key enumeration.
+  kern_return_t ReadKeyAtIndex(uint32_t index, uint32_t& key);
+  // Backs the key info cache with a file shared by later processes. Key info
+  // learned from the SMC is written back when the accessor is destroyed.
+  bool UsePersistentKeyInfoCache(const std::string& path);
+  // Records every call and key info lookup into metrics from now on, and the
+  // time the transport took to open. metrics must outlive the accessor; null
+  // turns recording off.
+  void EnableMetrics(SmcMetrics* metrics);
+  // Lists every key matching filter with its type, value and raw bytes,
+  // reading each key once. With index_only only the key and type are listed
+  // and no value is read. Formats other than kText print one record per key
+  // (see FormatListingEntry).
+  kern_return_t PrintAll(int fd = STDOUT_FILENO, const SmcKeyFilter& filter = SmcKeyFilter(),
+                         bool index_only = false, OutputFormat format = OutputFormat::kText);
 };
 
+typedef struct {
+  uint32_t key;
+  double   value;
+} SensorReading_t;
+
+typedef struct {
+  uint32_t attempts;     // passes over the sensors
+  uint32_t sensorReads;  // keys read over all passes
+  int64_t  elapsedNs;    // until the temperature was settled
+  uint32_t validSensors; // combined into the temperature
+} SampleStats_t;
+
+// How one sensor key has behaved across samples. A key that fails too many
+// reads in a row is skipped for a number of samples that doubles with every
+// failed re-probe, so absent and dead keys drop out of the hot loop but are
+// still noticed if they come back.
+typedef struct {
+  uint32_t key;
+  uint32_t consecutiveFailures;
+  uint32_t quarantineLeft;  // samples still to skip
+  uint32_t backoff;         // samples to skip after the next failed read
+  uint64_t reads;
+  uint64_t keyInfoErrors;   // key absent from this SMC
+  uint64_t callErrors;      // SMC call failed
+  uint64_t outOfRange;      // read, but outside the valid limits
+} SensorHealth_t;
+
+typedef struct {
+  const char* name;
+  double      temperature;   // mean of the valid sensors of the cluster
+  uint32_t    validSensors;
+} ClusterTemp_t;
+
 class SmcTemp {
  private:
-  double CalculateAverageTemperature(const std::vector<std::string>& sensors,
-                                     const std::pair<unsigned int, unsigned int>& limits);
-  bool StoreValidTemperature(double temperature, std::string file_name);
+  double Sample(const SensorSet_t& sensors, const SensorSet_t& aux_sensors, SensorHealth_t* health,
+                bool by_cluster);
+  size_t PollSensors(const SensorSet_t& sensors, size_t base);
+  size_t ValidCount(const SensorSet_t& sensors, size_t base) const;
+  double SettleTemperature(const SensorSet_t& sensors, size_t base, bool by_cluster);
+  void UpdateClusterTemps(const SensorSet_t& sensors, bool use_aux);
+  void RecordReadings(const SensorSet_t& sensors, size_t base);
+  void SkipQuarantined(size_t count);
+  void RecordHealth(size_t index, double value, kern_return_t result);
+  void BindSensors();
+  void BindClusters();
+  void ApplySensorKeys(SensorKeys_t keys);
+  bool IsLiveSensor(uint32_t key);
+  void FindDieSensors(SensorKeys_t& keys);
+  SensorKeys_t ProbeSensors();
+  bool HaveSensors();
+  void AddToStats(SeriesStats& series, double temperature);
+  void StoreValidTemperature(double temperature, LastValidStore* store);
+  double LoadValidTemperature(const LastValidStore* store) const;
+  bool CreateStorageDirectory();
   SmcAccessor smc_accessor_;
+  // Detected once at construction and narrowed to the live keys by
+  // UseSensorManifest(); null on chips without a list until they are probed.
+  const ChipSensors_t* chip_;
+  // Backs chip_ once the keys come from a probe or manifest.
+  SensorKeys_t live_keys_;
+  ChipSensors_t live_chip_;
+  bool probed_ = false;
+  // Per-sensor state of the sample being taken; the aux sensors follow the
+  // primary ones. Sized at construction.
+  std::vector<double> sensor_values_;
+  std::vector<uint8_t> sensor_valid_;
+  std::vector<uint8_t> sensor_read_;
+  std::vector<uint32_t> pending_keys_;
+  std::vector<size_t> pending_index_;
+  std::vector<double> pending_values_;
+  std::vector<kern_return_t> pending_results_;
+  std::vector<uint8_t> sensor_skipped_;
+  std::vector<SensorReading_t> readings_;
+  // The valid values of the set, reordered by Aggregate().
+  std::vector<double> settle_values_;
+  Aggregation aggregation_ = Aggregation::kMean;
+  // Cluster of each primary CPU sensor, an index into cluster_temps_.
+  std::vector<uint8_t> cpu_cluster_;
+  std::vector<ClusterTemp_t> cluster_temps_;
+  // One entry per sensor of the chip: CPU, aux CPU, then GPU. Sample() works
+  // on the slice of the set being sampled.
+  std::vector<SensorHealth_t> health_;
+  SensorHealth_t* sample_health_ = nullptr;
+  bool quarantine_ = true;
+  unsigned int attempts_ = 1;
+  std::chrono::nanoseconds retry_interval_{std::chrono::seconds(1)};
+  unsigned int quorum_percent_ = 0;
+  SampleStats_t sample_stats_ = {0, 0, 0, 0};
   bool is_fail_soft_;
+  std::unique_ptr<LastValidStore> cpu_store_;
+  std::unique_ptr<LastValidStore> gpu_store_;
+  std::chrono::nanoseconds fail_soft_max_age_{0};
+  std::unique_ptr<TemperatureStats> stats_;
+  std::unique_ptr<SmcMetrics> metrics_;
   const std::string storage_path_ = "/tmp/smctemp/";
-  const std::string cpu_file_ = "cpu_temperature.txt";
-  const std::string gpu_file_ = "gpu_temperature.txt";
+  const std::string cpu_file_ = "cpu_temperature.bin";
+  const std::string gpu_file_ = "gpu_temperature.bin";
+  const std::string key_info_file_ = "key_info.cache";
+  const std::string manifest_file_ = "sensors.manifest";
 
  public:
   explicit SmcTemp(bool isFailSoft);
+  SmcTemp(bool isFailSoft, std::unique_ptr<SmcTransport> transport);
   ~SmcTemp() = default;
   double GetCpuTemp();
   double GetGpuTemp();
+  // The last valid temperature stored in fail-soft mode, by this or an
+  // earlier process; 0 if there is none or it is too old.
   double GetLastValidCpuTemp();
   double GetLastValidGpuTemp();
+  // Fail-soft values stored longer ago than max_age are ignored; 0 accepts
+  // any age.
+  void SetFailSoftMaxAge(std::chrono::nanoseconds max_age) { fail_soft_max_age_ = max_age; }
+  bool UsePersistentKeyInfoCache();
+  // Reads only the sensor keys found live on this machine. The first run
+  // probes the chip's list, or the SMC's T* keys on chips without one, and
+  // keeps the result in the storage directory for later runs.
+  bool UseSensorManifest();
+  bool UseSensorManifest(const std::string& path);
+  // Reads arbitrary keys over the same SMC connection, see
+  // SmcAccessor::ReadValues.
+  void ReadValues(const uint32_t* keys, size_t count, double* values, kern_return_t* results) {
+    smc_accessor_.ReadValues(keys, count, values, results);
+  }
+  // Lets GetCpuTemp() and GetGpuTemp() make up to attempts passes,
+  // retry_interval apart. A pass re-reads only the sensors whose value is
+  // still out of range, and the sample is settled once quorum_percent of the
+  // sensors (at least one) are valid. On x86 the sensors are alternatives
+  // tried in order, so the first valid one settles it.
+  void SetRetry(unsigned int attempts, std::chrono::nanoseconds retry_interval, unsigned int quorum_percent = 0);
+  // Every sensor read by the last GetCpuTemp() or GetGpuTemp() call, with
+  // its last value.
+  const std::vector<SensorReading_t>& LastReadings() const { return readings_; }
+  const SampleStats_t& LastSampleStats() const { return sample_stats_; }
+  // How the valid sensors are combined; the mean by default. Not used on
+  // x86, where the first valid sensor is the temperature.
+  void SetAggregation(Aggregation aggregation) { aggregation_ = aggregation; }
+  // The CPU clusters with the mean of their valid sensors as of the last
+  // GetCpuTemp() call; none is valid if the aux sensors had to be read.
+  const std::vector<ClusterTemp_t>& LastClusterTemps() const { return cluster_temps_; }
+  // Quarantine of failing keys, on by default. Health is tracked either way.
+  void SetQuarantine(bool enabled) { quarantine_ = enabled; }
+  const std::vector<SensorHealth_t>& SensorHealth() const { return health_; }
+  // Keeps rolling statistics of the valid CPU and GPU temperatures and of
+  // every sensor reading from the next sample on. Only this call allocates.
+  void EnableStats(const StatsConfig_t& config);
+  // Null until EnableStats().
+  TemperatureStats* Stats() { return stats_.get(); }
+  // Counts and times the SMC calls, key info lookups, samples and fail-soft
+  // stores from now on. Safe to read from other threads while sampling.
+  void EnableMetrics();
+  // Null until EnableMetrics().
+  const SmcMetrics* Metrics() const { return metrics_.get(); }
+  // One line per sensor key with its counters and quarantine state.
+  void PrintSensorHealth(std::ostream& out) const;
   bool IsValidTemperature(double temperature, const std::pair<unsigned int, unsigned int>& limits);
 };
 
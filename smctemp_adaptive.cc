@@ -0,0 +1,74 @@
+#include "smctemp_adaptive.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace smctemp {
+namespace {
+// Share of the slope kept per second once the temperature stops moving.
+constexpr double kSlopeDecayPerSecond = 0.5;
+}
+
+AdaptiveRate::AdaptiveRate(const AdaptiveConfig_t& config) : config_(config) {
+  config_.maxPeriod = std::max(config_.maxPeriod, config_.minPeriod);
+  config_.fullSlope = std::max(config_.fullSlope, config_.flatSlope + 1e-9);
+}
+
+std::chrono::nanoseconds AdaptiveRate::Update(int64_t now_ns, double temperature) {
+  if (samples_++ == 0) {
+    first_ns_ = now_ns;
+  }
+  const double min_ns = config_.minPeriod.count();
+  const double max_ns = config_.maxPeriod.count();
+  double rising = 0.0;
+  if (have_last_ && now_ns > last_ns_) {
+    const double seconds = (now_ns - last_ns_) / 1e9;
+    const double slope = (temperature - last_temperature_) / seconds;
+    rising = std::max(slope, 0.0);
+    slope_ = std::max(std::fabs(slope), slope_ * std::pow(kSlopeDecayPerSecond, seconds));
+  }
+  have_last_ = true;
+  last_ns_ = now_ns;
+  last_temperature_ = temperature;
+
+  // 0 while flat and far from the threshold, 1 for the ceiling rate.
+  double urgency = std::clamp((slope_ - config_.flatSlope) / (config_.fullSlope - config_.flatSlope), 0.0, 1.0);
+  double period_ns = max_ns;
+  if (config_.threshold > 0.0) {
+    const double distance = config_.threshold - temperature;
+    if (distance <= config_.margin) {
+      urgency = 1.0;
+    } else {
+      urgency = std::max(urgency, config_.margin / distance);
+      if (rising > 0.0) {
+        // Half the time the current slope needs to reach the margin.
+        period_ns = (distance - config_.margin) / rising * 0.5e9;
+      }
+    }
+  }
+  period_ns = std::min(period_ns, max_ns * std::pow(min_ns / max_ns, urgency));
+  return std::chrono::nanoseconds(static_cast<int64_t>(std::clamp(period_ns, min_ns, max_ns)));
+}
+
+std::chrono::nanoseconds AdaptiveRate::Missed(int64_t now_ns) {
+  if (samples_++ == 0) {
+    first_ns_ = now_ns;
+  }
+  return config_.minPeriod;
+}
+
+double AdaptiveRate::EffectiveRateHz(int64_t now_ns) const {
+  if (samples_ < 2 || now_ns <= first_ns_) {
+    return 0.0;
+  }
+  return (samples_ - 1) * 1e9 / (now_ns - first_ns_);
+}
+
+uint64_t AdaptiveRate::SamplesSaved(int64_t now_ns) const {
+  if (samples_ == 0) {
+    return 0;
+  }
+  const uint64_t fixed = (now_ns - first_ns_) / config_.minPeriod.count() + 1;
+  return fixed > samples_ ? fixed - samples_ : 0;
+}
+}
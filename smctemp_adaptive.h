@@ -0,0 +1,49 @@
+#ifndef SMCTEMP_SMCTEMP_ADAPTIVE_H_
+#define SMCTEMP_SMCTEMP_ADAPTIVE_H_
+#include <chrono>
+#include <cstdint>
+
+namespace smctemp {
+typedef struct {
+  std::chrono::nanoseconds minPeriod;  // while the temperature moves or nears the threshold
+  std::chrono::nanoseconds maxPeriod;  // while it is flat
+  double flatSlope;   // degrees per second still taken as flat (sensor noise)
+  double fullSlope;   // degrees per second from which minPeriod is used
+  double threshold;   // degrees to never cross unseen; 0 for none
+  double margin;      // degrees below the threshold from which minPeriod is used
+} AdaptiveConfig_t;
+
+// Picks the interval to the next sample of one sensor group (CPU or GPU)
+// from how fast its temperature moves and how close it is to the threshold.
+// A steeper slope is taken at once and then decays over a few seconds, so a
+// burst of load is sampled faster from its first reading on. While
+// rising, the next sample also comes before the threshold could be reached
+// at the current slope.
+class AdaptiveRate {
+ private:
+  AdaptiveConfig_t config_;
+  bool have_last_ = false;
+  int64_t last_ns_ = 0;
+  double last_temperature_ = 0.0;
+  double slope_ = 0.0;  // absolute, decaying
+  int64_t first_ns_ = 0;
+  uint64_t samples_ = 0;
+
+ public:
+  explicit AdaptiveRate(const AdaptiveConfig_t& config);
+  // Takes the valid temperature read at now_ns and returns the wait until
+  // the next sample.
+  std::chrono::nanoseconds Update(int64_t now_ns, double temperature);
+  // For a sample without a valid temperature; asks for the next one at
+  // minPeriod.
+  std::chrono::nanoseconds Missed(int64_t now_ns);
+  const AdaptiveConfig_t& Config() const { return config_; }
+  uint64_t Samples() const { return samples_; }
+  // Samples per second since the first one.
+  double EffectiveRateHz(int64_t now_ns) const;
+  // How many fewer samples were taken than a fixed minPeriod schedule would
+  // have taken since the first one.
+  uint64_t SamplesSaved(int64_t now_ns) const;
+};
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_ADAPTIVE_H_
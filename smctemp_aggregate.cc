@@ -0,0 +1,154 @@
+#include "smctemp_aggregate.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <utility>
+
+namespace smctemp {
+namespace {
+struct Comparator {
+  unsigned char low;
+  unsigned char high;
+};
+
+// Visits the comparators of Batcher's odd-even merge sort for the next power
+// of two at or above count, in network order. Values past count would be
+// +infinity and never move, so the comparators that touch them are left out.
+template <typename Visit>
+constexpr void ForEachComparator(size_t count, Visit visit) {
+  size_t n = 1;
+  while (n < count) {
+    n <<= 1;
+  }
+  for (size_t p = 1; p < n; p <<= 1) {
+    for (size_t k = p; k >= 1; k >>= 1) {
+      for (size_t j = k % p; j + k < n; j += 2 * k) {
+        for (size_t i = 0; i < std::min(k, n - j - k); i++) {
+          if ((i + j) / (2 * p) == (i + j + k) / (2 * p) && i + j + k < count) {
+            visit(i + j, i + j + k);
+          }
+        }
+      }
+    }
+  }
+}
+
+constexpr size_t CountComparators(size_t count) {
+  size_t comparators = 0;
+  ForEachComparator(count, [&comparators](size_t, size_t) { comparators++; });
+  return comparators;
+}
+
+// One spare entry, so that the sizes without comparators still compile.
+template <size_t Count>
+struct Network {
+  Comparator comparators[CountComparators(Count) + 1];
+};
+
+template <size_t Count>
+constexpr Network<Count> MakeNetwork() {
+  Network<Count> network{};
+  size_t size = 0;
+  ForEachComparator(Count, [&network, &size](size_t low, size_t high) {
+    network.comparators[size++] = {static_cast<unsigned char>(low), static_cast<unsigned char>(high)};
+  });
+  return network;
+}
+
+template <size_t Count>
+constexpr Network<Count> kNetwork = MakeNetwork<Count>();
+
+// The network is a constant of the instantiation, so the loop unrolls into
+// straight-line min/max pairs.
+template <size_t Count>
+void SortFixed(double* values) {
+  for (size_t i = 0; i < CountComparators(Count); i++) {
+    const Comparator& comparator = kNetwork<Count>.comparators[i];
+    const double a = values[comparator.low];
+    const double b = values[comparator.high];
+    values[comparator.low] = std::min(a, b);
+    values[comparator.high] = std::max(a, b);
+  }
+}
+
+template <size_t... Counts>
+constexpr std::array<void (*)(double*), sizeof...(Counts)> MakeSorts(std::index_sequence<Counts...>) {
+  return {&SortFixed<Counts>...};
+}
+
+constexpr std::array<void (*)(double*), kSortNetworkMaxSize + 1> kSorts =
+  MakeSorts(std::make_index_sequence<kSortNetworkMaxSize + 1>());
+
+struct AggregationName_t {
+  const char* name;
+  Aggregation aggregation;
+};
+
+constexpr AggregationName_t kAggregationNames[] = {
+  {"mean", Aggregation::kMean},
+  {"median", Aggregation::kMedian},
+  {"trimmed", Aggregation::kTrimmedMean},
+  {"max", Aggregation::kMax},
+  {"cluster-max", Aggregation::kHottestCluster},
+};
+}
+
+void NetworkSort(double* values, size_t count) {
+  if (count <= kSortNetworkMaxSize) {
+    kSorts[count](values);
+  } else {
+    std::sort(values, values + count);
+  }
+}
+
+double Aggregate(Aggregation aggregation, double* values, size_t count) {
+  if (count == 0) {
+    return 0.0;
+  }
+  switch (aggregation) {
+    case Aggregation::kMax:
+      return *std::max_element(values, values + count);
+    case Aggregation::kMedian:
+      NetworkSort(values, count);
+      return count % 2 == 1 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+    case Aggregation::kTrimmedMean: {
+      // A quarter off each end, and at least one value once there are three.
+      NetworkSort(values, count);
+      const size_t trim = count >= 3 ? std::max<size_t>(1, count / 4) : 0;
+      double sum = 0.0;
+      for (size_t i = trim; i < count - trim; i++) {
+        sum += values[i];
+      }
+      return sum / (count - 2 * trim);
+    }
+    case Aggregation::kMean:
+    case Aggregation::kHottestCluster:
+      break;
+  }
+  double sum = 0.0;
+  for (size_t i = 0; i < count; i++) {
+    sum += values[i];
+  }
+  return sum / count;
+}
+
+bool ParseAggregation(const char* name, Aggregation& aggregation) {
+  for (const AggregationName_t& entry : kAggregationNames) {
+    if (strcmp(name, entry.name) == 0) {
+      aggregation = entry.aggregation;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* AggregationName(Aggregation aggregation) {
+  for (const AggregationName_t& entry : kAggregationNames) {
+    if (entry.aggregation == aggregation) {
+      return entry.name;
+    }
+  }
+  return "";
+}
+}
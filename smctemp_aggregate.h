@@ -0,0 +1,33 @@
+#ifndef SMCTEMP_SMCTEMP_AGGREGATE_H_
+#define SMCTEMP_SMCTEMP_AGGREGATE_H_
+#include <cstddef>
+
+namespace smctemp {
+// How the valid sensors of a sample are combined into one temperature.
+// kMedian and kTrimmedMean are not moved by one glitching sensor; kMax
+// follows the hottest core; kHottestCluster is the hottest of the per-cluster
+// means (e.g. super vs performance cores on M5), and the plain mean on sets
+// without clusters.
+enum class Aggregation {
+  kMean,
+  kMedian,
+  kTrimmedMean,
+  kMax,
+  kHottestCluster,
+};
+
+// Sets up to this many values are sorted with a compare-exchange network;
+// larger ones fall back to std::sort.
+constexpr size_t kSortNetworkMaxSize = 32;
+
+// Sorts values ascending with Batcher's odd-even merge network for the next
+// power of two, leaving out the comparators past count. The sequence of
+// comparisons depends only on count, so it has no data-dependent branches.
+void NetworkSort(double* values, size_t count);
+// Combines count values, reordering them. 0 if count is 0.
+double Aggregate(Aggregation aggregation, double* values, size_t count);
+// "mean", "median", "trimmed", "max" or "cluster-max".
+bool ParseAggregation(const char* name, Aggregation& aggregation);
+const char* AggregationName(Aggregation aggregation);
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_AGGREGATE_H_
@@ -0,0 +1,136 @@
+#include "smctemp_async.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <utility>
+
+namespace smctemp {
+namespace {
+void setNonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+}
+
+AsyncSmcReader::AsyncSmcReader(std::unique_ptr<SmcTransport> transport, size_t queue_capacity)
+    : smc_temp_(false, std::move(transport)),
+      requests_(queue_capacity),
+      completions_(queue_capacity) {
+  if (pipe(notify_fds_) == 0) {
+    setNonBlocking(notify_fds_[0]);
+    setNonBlocking(notify_fds_[1]);
+  }
+  worker_ = std::thread(&AsyncSmcReader::Run, this);
+}
+
+AsyncSmcReader::~AsyncSmcReader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_.store(true);
+  }
+  wake_.notify_one();
+  worker_.join();
+  for (int fd : notify_fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+uint64_t AsyncSmcReader::Submit(const AsyncRequest_t& request) {
+  const uint64_t id = next_id_.fetch_add(1, std::memory_order_relaxed);
+  if (!requests_.Push({id, request})) {
+    return 0;
+  }
+  // Pairs with the fence in WaitForRequest: either the worker sees the
+  // request, or this sees it asleep and wakes it.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping_.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    wake_.notify_one();
+  }
+  return id;
+}
+
+size_t AsyncSmcReader::Dispatch() {
+  char drain[64];
+  while (read(notify_fds_[0], drain, sizeof(drain)) > 0) {
+  }
+  size_t dispatched = 0;
+  Completion completion;
+  while (completions_.Pop(completion)) {
+    if (completion.callback != nullptr) {
+      completion.callback(completion.result, completion.context);
+    }
+    dispatched++;
+  }
+  return dispatched;
+}
+
+bool AsyncSmcReader::WaitForRequest(Pending& pending) {
+  if (requests_.Pop(pending)) {
+    return true;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  sleeping_.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  bool found;
+  while (!(found = requests_.Pop(pending)) && !stop_.load()) {
+    wake_.wait(lock);
+  }
+  sleeping_.store(false, std::memory_order_relaxed);
+  return found;
+}
+
+AsyncResult_t AsyncSmcReader::Execute(const Pending& pending) {
+  const AsyncRequest_t& request = pending.request;
+  AsyncResult_t result = {pending.id, request.op, request.key, 0.0, 0, false};
+  const uint32_t attempts = request.attempts > 0 ? request.attempts : 1;
+  while (result.attempts < attempts && !stop_.load(std::memory_order_relaxed)) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(request.retryIntervalMs);
+    result.attempts++;
+    if (request.op == kAsyncReadCpu) {
+      result.value = smc_temp_.GetCpuTemp();
+      result.valid = smc_temp_.IsValidTemperature(result.value, kValidTemperatureLimits);
+    } else if (request.op == kAsyncReadGpu) {
+      result.value = smc_temp_.GetGpuTemp();
+      result.valid = smc_temp_.IsValidTemperature(result.value, kValidTemperatureLimits);
+    } else if (request.op == kAsyncReadKey) {
+      kern_return_t status;
+      smc_temp_.ReadValues(&request.key, 1, &result.value, &status);
+      result.valid = status == kIOReturnSuccess;
+    } else {
+      break;
+    }
+    if (result.valid) {
+      break;
+    }
+    if (result.attempts < attempts) {
+      // Not a sleep, so that the destructor does not wait out the retries.
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait_until(lock, deadline, [this] { return stop_.load(); });
+    }
+  }
+  return result;
+}
+
+void AsyncSmcReader::Run() {
+  Pending pending;
+  while (WaitForRequest(pending)) {
+    const Completion completion = {Execute(pending), pending.request.callback, pending.request.context};
+    while (!completions_.Push(completion)) {
+      // The event loop is not dispatching; check for room every millisecond.
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (wake_.wait_for(lock, std::chrono::milliseconds(1), [this] { return stop_.load(); })) {
+        return;
+      }
+    }
+    const char signal = 1;
+    // A full pipe already signals pending completions.
+    ssize_t ignored = write(notify_fds_[1], &signal, 1);
+    (void)ignored;
+  }
+}
+}
@@ -0,0 +1,87 @@
+#ifndef SMCTEMP_SMCTEMP_ASYNC_H_
+#define SMCTEMP_SMCTEMP_ASYNC_H_
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "smctemp.h"
+#include "smctemp_queue.h"
+
+namespace smctemp {
+constexpr uint32_t kAsyncReadCpu = 1;
+constexpr uint32_t kAsyncReadGpu = 2;
+constexpr uint32_t kAsyncReadKey = 3;
+
+typedef struct {
+  uint64_t id;
+  uint32_t op;
+  uint32_t key;       // kAsyncReadKey only
+  double   value;
+  uint32_t attempts;  // reads made, including retries
+  bool     valid;     // a valid temperature, or a successful key read
+} AsyncResult_t;
+
+typedef void (*AsyncCallback)(const AsyncResult_t& result, void* context);
+
+typedef struct {
+  uint32_t      op;
+  uint32_t      key;              // kAsyncReadKey only
+  uint32_t      attempts;         // reads until one is valid, like -n; 0 means 1
+  uint32_t      retryIntervalMs;  // like -i
+  AsyncCallback callback;         // may be null
+  void*         context;
+} AsyncRequest_t;
+
+// Runs SMC reads on a dedicated I/O thread that owns the connection, so that
+// an event loop never blocks on the SMC or on retries. Requests go through a
+// bounded lock-free queue. Finished requests are signalled on NotifyFd(), and
+// their callbacks run on the thread that calls Dispatch().
+class AsyncSmcReader {
+ private:
+  struct Pending {
+    uint64_t id;
+    AsyncRequest_t request;
+  };
+  struct Completion {
+    AsyncResult_t result;
+    AsyncCallback callback;
+    void* context;
+  };
+  void Run();
+  bool WaitForRequest(Pending& pending);
+  AsyncResult_t Execute(const Pending& pending);
+
+  SmcTemp smc_temp_;
+  BoundedMpscQueue<Pending> requests_;
+  BoundedMpscQueue<Completion> completions_;
+  std::atomic<uint64_t> next_id_{1};
+  std::atomic<bool> stop_{false};
+  std::atomic<bool> sleeping_{false};
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  int notify_fds_[2] = {-1, -1};
+  std::thread worker_;
+
+ public:
+  explicit AsyncSmcReader(std::unique_ptr<SmcTransport> transport = MakeDefaultSmcTransport(),
+                          size_t queue_capacity = 256);
+  // Requests not yet finished are dropped.
+  ~AsyncSmcReader();
+  AsyncSmcReader(const AsyncSmcReader&) = delete;
+  AsyncSmcReader& operator=(const AsyncSmcReader&) = delete;
+
+  // Safe to call from any thread. Returns the request id, or 0 if the queue
+  // is full.
+  uint64_t Submit(const AsyncRequest_t& request);
+  // Becomes readable when finished requests are waiting for Dispatch().
+  int NotifyFd() const { return notify_fds_[0]; }
+  // Runs the callbacks of the finished requests and returns their count.
+  // Call from one thread only.
+  size_t Dispatch();
+};
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_ASYNC_H_
@@ -0,0 +1,2121 @@
+// Micro-benchmarks for the smctemp read path. The SMC is simulated, so this
+// builds and runs on any host: make bench && ./smctemp_bench [filter]
+// --json writes the results to stdout as JSON (the usual lines then go to
+// stderr), --json=FILE to FILE. Exits non-zero if any check fails.
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "smctemp.h"
+#include "smctemp_adaptive.h"
+#include "smctemp_aggregate.h"
+#include "smctemp_async.h"
+#include "smctemp_c.h"
+#include "smctemp_cache.h"
+#include "smctemp_clock.h"
+#include "smctemp_decode.h"
+#include "smctemp_format.h"
+#include "smctemp_metrics.h"
+#include "smctemp_shm.h"
+#include "smctemp_store.h"
+#include "smctemp_string.h"
+#include "smctemp_trace.h"
+
+// Counts heap allocations so that the sampling path can be checked to make
+// none.
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC flags the free() below once it inlines these into callers of new.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+static std::atomic<uint64_t> g_allocations{0};
+
+void* operator new(size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+namespace {
+volatile double g_sink;
+
+// One measured quantity, for --json.
+struct BenchResult {
+  std::string name;
+  std::string metric;
+  double value;
+  std::string unit;
+};
+std::vector<BenchResult> g_results;
+
+// Keeps a result for the JSON report. Allocates, so call it outside the
+// measured and allocation-counted sections.
+void Report(const std::string& name, const char* metric, double value, const char* unit) {
+  g_results.push_back({name, metric, value, unit});
+}
+
+template <typename F>
+double MeasureNsPerOp(uint64_t iterations, F&& f) {
+  const auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < iterations; ++i) {
+    f();
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+bool Selected(const char* filter, const std::string& name) {
+  return filter == nullptr || name.find(filter) != std::string::npos;
+}
+
+// Sets SMCTEMP_CPU_MODEL until the end of the scope, whatever the caller set,
+// for benchmarks that expect the sensor layout of one chip; the caller's
+// value, or its absence, is restored afterwards.
+class ScopedCpuModel {
+ private:
+  bool had_model_;
+  std::string saved_model_;
+
+ public:
+  explicit ScopedCpuModel(const char* model) {
+    const char* saved = getenv("SMCTEMP_CPU_MODEL");
+    had_model_ = saved != nullptr;
+    saved_model_ = had_model_ ? saved : "";
+    setenv("SMCTEMP_CPU_MODEL", model, 1);
+  }
+  ~ScopedCpuModel() {
+    if (had_model_) {
+      setenv("SMCTEMP_CPU_MODEL", saved_model_.c_str(), 1);
+    } else {
+      unsetenv("SMCTEMP_CPU_MODEL");
+    }
+  }
+  ScopedCpuModel(const ScopedCpuModel&) = delete;
+  ScopedCpuModel& operator=(const ScopedCpuModel&) = delete;
+};
+
+// The std::string comparison chain ReadValue used before the table-driven
+// decoder, kept as the baseline.
+double LegacyDecode(const smctemp::SmcVal_t& val) {
+  using namespace smctemp;
+  double v = 0.0;
+  if (std::string(val.dataType) == kDataTypeUi8 ||
+      std::string(val.dataType) == kDataTypeUi16 ||
+      std::string(val.dataType) == kDataTypeUi32 ||
+      std::string(val.dataType) == kDataTypeUi64) {
+    char* bytes = (char *)val.bytes;
+    uint64_t tmp = 0;
+    for (uint32_t i = 0; i < val.dataSize; i++) {
+      tmp += uint8_t(bytes[i]) * std::pow(256, val.dataSize - 1 -i);
+    }
+    v = tmp;
+  } else if (std::string(val.dataType) == kDataTypeFlt) {
+    v = *reinterpret_cast<const float*>(val.bytes);
+  } else if (std::string(val.dataType) == kDataTypeFp1f && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 32768.0;
+  } else if (std::string(val.dataType) == kDataTypeFp4c && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 4096.0;
+  } else if (std::string(val.dataType) == kDataTypeFp5b && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 2048.0;
+  } else if (std::string(val.dataType) == kDataTypeFp6a && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 1024.0;
+  } else if (std::string(val.dataType) == kDataTypeFp79 && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 512.0;
+  } else if (std::string(val.dataType) == kDataTypeFp88 && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 256.0;
+  } else if (std::string(val.dataType) == kDataTypeFpa6 && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 64.0;
+  } else if (std::string(val.dataType) == kDataTypeFpc4 && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 16.0;
+  } else if (std::string(val.dataType) == kDataTypeFpe2 && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 4.0;
+  } else if (std::string(val.dataType) == kDataTypeSp1e && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 16384.0;
+  } else if (std::string(val.dataType) == kDataTypeSp3c && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 4096.0;
+  } else if (std::string(val.dataType) == kDataTypeSp4b && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 2048.0;
+  } else if (std::string(val.dataType) == kDataTypeSp5a && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 1024.0;
+  } else if (std::string(val.dataType) == kDataTypeSp69 && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 512.0;
+  } else if (std::string(val.dataType) == kDataTypeSp78 && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 256.0;
+  } else if (std::string(val.dataType) == kDataTypeSp87 && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 128.0;
+  } else if (std::string(val.dataType) == kDataTypeSp96 && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 64.0;
+  } else if (std::string(val.dataType) == kDataTypeSpb4 && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 16.0;
+  } else if (std::string(val.dataType) == kDataTypeSpf0 && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) / 1.0;
+  } else if (std::string(val.dataType) == kDataTypeSi8 && val.dataSize == 1) {
+    const signed char* bytes = (const signed char *)val.bytes;
+    int16_t temp = 0;
+    temp += int8_t(bytes[0]);
+    v = temp;
+  } else if (std::string(val.dataType) == kDataTypeSi16 && val.dataSize == 2) {
+    v = ntohs(*reinterpret_cast<const int16_t*>(val.bytes));
+  } else if (std::string(val.dataType) == kDataTypePwm && val.dataSize == 2) {
+    v = (float)ntohs(*reinterpret_cast<const uint16_t*>(val.bytes)) * 100 / 65536.0;
+  }
+  return v;
+}
+
+smctemp::SmcVal_t MakeVal(const char* data_type, uint32_t data_size, const void* bytes) {
+  smctemp::SmcVal_t val;
+  memset(&val, 0, sizeof(val));
+  snprintf(val.dataType, sizeof(val.dataType), "%s", data_type);
+  val.dataTypeCode = smctemp::string_util::strtoul(data_type, 4, 16);
+  val.dataSize = data_size;
+  memcpy(val.bytes, bytes, data_size);
+  return val;
+}
+
+// One positive sample per type in smctemp_types.h, so that both decoders
+// must agree.
+std::vector<smctemp::SmcVal_t> DecodeSamples() {
+  using namespace smctemp;
+  std::vector<SmcVal_t> samples;
+  const float flt = 42.5f;
+  samples.push_back(MakeVal(kDataTypeFlt, sizeof(flt), &flt));
+  const unsigned char be16[] = {0x2a, 0x80};
+  for (const char* type : {kDataTypeFp1f, kDataTypeFp4c, kDataTypeFp5b, kDataTypeFp6a, kDataTypeFp79,
+                           kDataTypeFp88, kDataTypeFpa6, kDataTypeFpc4, kDataTypeFpe2, kDataTypeSp1e,
+                           kDataTypeSp3c, kDataTypeSp4b, kDataTypeSp5a, kDataTypeSp69, kDataTypeSp78,
+                           kDataTypeSp87, kDataTypeSp96, kDataTypeSpb4, kDataTypeSpf0, kDataTypeSi16,
+                           kDataTypePwm}) {
+    samples.push_back(MakeVal(type, sizeof(be16), be16));
+  }
+  const unsigned char be64[] = {0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06};
+  samples.push_back(MakeVal(kDataTypeUi8, 1, be64 + 7));
+  samples.push_back(MakeVal(kDataTypeUi16, 2, be64 + 6));
+  samples.push_back(MakeVal(kDataTypeUi32, 4, be64 + 4));
+  samples.push_back(MakeVal(kDataTypeUi64, 8, be64));
+  samples.push_back(MakeVal(kDataTypeSi8, 1, be64 + 5));
+  return samples;
+}
+
+// Values with their expected results, which the decoders must match: sp* and
+// si* are two's complement, and ui64 keeps every bit a double can hold.
+typedef struct {
+  const char* type;
+  uint32_t size;
+  unsigned char bytes[8];
+  double expected;
+} DecodeCase_t;
+
+const DecodeCase_t kDecodeCases[] = {
+  {smctemp::kDataTypeSp78, 2, {0xff, 0x80}, -0.5},
+  {smctemp::kDataTypeSp1e, 2, {0x80, 0x00}, -2.0},
+  {smctemp::kDataTypeSpf0, 2, {0xff, 0xff}, -1.0},
+  {smctemp::kDataTypeSi16, 2, {0xff, 0xfe}, -2.0},
+  {smctemp::kDataTypeSi8, 1, {0xfe}, -2.0},
+  {smctemp::kDataTypeUi64, 8, {0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02}, 9007199254740994.0},
+  {smctemp::kDataTypeUi64, 8, {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf8, 0x00}, 18446744073709549568.0},
+};
+
+int BenchDecode(const char* filter) {
+  const uint64_t iterations = 2'000'000;
+  double legacy_total = 0.0;
+  double table_total = 0.0;
+  double resolved_total = 0.0;
+  size_t count = 0;
+  int failures = 0;
+  if (Selected(filter, "decode/values")) {
+    for (const DecodeCase_t& decode_case : kDecodeCases) {
+      const smctemp::SmcVal_t val = MakeVal(decode_case.type, decode_case.size, decode_case.bytes);
+      const smctemp::SmcResolvedDecoder_t resolved = smctemp::ResolveSmcDecoder(val.dataTypeCode, val.dataSize);
+      const double table = smctemp::DecodeSmcVal(val);
+      const double handle = resolved.decode(val.bytes, val.dataSize, resolved.scale);
+      if (table != decode_case.expected || handle != decode_case.expected) {
+        std::cerr << "decode/values: " << decode_case.type << " decodes to " << table << " and " << handle
+          << ", expected " << decode_case.expected << std::endl;
+        failures++;
+      }
+    }
+    printf("%-20s %zu values checked\n", "decode/values", COUNT_OF(kDecodeCases));
+  }
+  for (const smctemp::SmcVal_t& val : DecodeSamples()) {
+    const std::string name = std::string("decode/") + val.dataType;
+    if (!Selected(filter, name)) {
+      continue;
+    }
+    const smctemp::SmcResolvedDecoder_t resolved = smctemp::ResolveSmcDecoder(val.dataTypeCode, val.dataSize);
+    const double legacy = LegacyDecode(val);
+    const double table = smctemp::DecodeSmcVal(val);
+    const double handle = resolved.decode(val.bytes, val.dataSize, resolved.scale);
+    if (legacy != table || table != handle) {
+      std::cerr << name << ": decoders disagree (" << legacy << ", " << table << ", " << handle << ")" << std::endl;
+      failures++;
+    }
+    const double legacy_ns = MeasureNsPerOp(iterations, [&] { g_sink = LegacyDecode(val); });
+    const double table_ns = MeasureNsPerOp(iterations, [&] { g_sink = smctemp::DecodeSmcVal(val); });
+    const double handle_ns = MeasureNsPerOp(iterations, [&] {
+      g_sink = resolved.decode(val.bytes, val.dataSize, resolved.scale);
+    });
+    printf("%-20s legacy %8.2f ns/op  table %8.2f ns/op  resolved %6.2f ns/op\n", name.c_str(), legacy_ns, table_ns,
+           handle_ns);
+    Report(name, "legacy", legacy_ns, "ns/op");
+    Report(name, "table", table_ns, "ns/op");
+    Report(name, "resolved", handle_ns, "ns/op");
+    legacy_total += legacy_ns;
+    table_total += table_ns;
+    resolved_total += handle_ns;
+    count++;
+  }
+  if (count > 0) {
+    printf("%-20s legacy %8.2f ns/op  table %8.2f ns/op  resolved %6.2f ns/op\n", "decode/mean",
+           legacy_total / count, table_total / count, resolved_total / count);
+    Report("decode/mean", "legacy", legacy_total / count, "ns/op");
+    Report("decode/mean", "table", table_total / count, "ns/op");
+    Report("decode/mean", "resolved", resolved_total / count, "ns/op");
+  }
+  return failures;
+}
+
+// CPU super and performance core sensors read on Apple M5.
+const char* const kM5CpuSensors[] = {
+  "Tp00", "Tp04", "Tp08", "Tp0C", "Tp0G", "Tp0K", "Tp0O", "Tp0R", "Tp0U",
+  "Tp0X", "Tp0a", "Tp0d", "Tp0g", "Tp0j", "Tp0m", "Tp0p", "Tp0u", "Tp0y",
+};
+
+std::unique_ptr<smctemp::SimulatedSmcTransport> MakeSimulatedSmc() {
+  auto smc = std::make_unique<smctemp::SimulatedSmcTransport>();
+  smctemp::PopulateDefaultSensorKeys(*smc);
+  return smc;
+}
+
+int BenchSample(const char* filter) {
+  const uint64_t iterations = 200'000;
+  const size_t sensor_count = COUNT_OF(kM5CpuSensors);
+
+  if (Selected(filter, "sample/m5_read_value")) {
+    smctemp::SmcAccessor accessor(MakeSimulatedSmc());
+    const double ns = MeasureNsPerOp(iterations, [&] {
+      double sum = 0.0;
+      for (size_t i = 0; i < sensor_count; ++i) {
+        sum += accessor.ReadValue(kM5CpuSensors[i]);
+      }
+      g_sink = sum;
+    });
+    printf("%-28s %10.1f ns/sample (%zu sensors)\n", "sample/m5_read_value", ns, sensor_count);
+    Report("sample/m5_read_value", "time", ns, "ns/sample");
+  }
+
+  if (Selected(filter, "sample/m5_read_values")) {
+    smctemp::SmcAccessor accessor(MakeSimulatedSmc());
+    std::vector<uint32_t> keys;
+    for (size_t i = 0; i < sensor_count; ++i) {
+      keys.push_back(smctemp::string_util::strtoul(kM5CpuSensors[i], 4, 16));
+    }
+    std::vector<double> values(sensor_count);
+    std::vector<kern_return_t> results(sensor_count);
+    const double ns = MeasureNsPerOp(iterations, [&] {
+      accessor.ReadValues(keys.data(), keys.size(), values.data(), results.data());
+      g_sink = values[0];
+    });
+    printf("%-28s %10.1f ns/sample (%zu sensors)\n", "sample/m5_read_values", ns, sensor_count);
+    Report("sample/m5_read_values", "time", ns, "ns/sample");
+  }
+
+  if (Selected(filter, "sample/m5_read_many")) {
+    auto smc = MakeSimulatedSmc();
+    for (size_t i = 0; i < sensor_count; ++i) {
+      smc->SetTemperature(kM5CpuSensors[i], 50.0 + i);
+    }
+    smctemp::SmcAccessor accessor(std::move(smc));
+    std::vector<smctemp::SmcSensorHandle_t> handles(sensor_count);
+    std::vector<uint32_t> keys;
+    for (size_t i = 0; i < sensor_count; ++i) {
+      keys.push_back(smctemp::string_util::strtoul(kM5CpuSensors[i], 4, 16));
+      if (accessor.Resolve(kM5CpuSensors[i], handles[i]) != kIOReturnSuccess) {
+        std::cerr << "sample/m5_read_many: failed to resolve " << kM5CpuSensors[i] << std::endl;
+        return 1;
+      }
+    }
+    std::vector<double> values(sensor_count);
+    std::vector<double> expected(sensor_count);
+    accessor.ReadValues(keys.data(), keys.size(), expected.data(), nullptr);
+    accessor.ReadMany(handles.data(), handles.size(), values.data(), nullptr);
+    if (values != expected) {
+      std::cerr << "sample/m5_read_many: handle reads disagree with ReadValues" << std::endl;
+      return 1;
+    }
+    const double ns = MeasureNsPerOp(iterations, [&] {
+      accessor.ReadMany(handles.data(), handles.size(), values.data(), nullptr);
+      g_sink = values[0];
+    });
+    printf("%-28s %10.1f ns/sample (%zu sensors)\n", "sample/m5_read_many", ns, sensor_count);
+    Report("sample/m5_read_many", "time", ns, "ns/sample");
+  }
+
+  // The C interface over the default transport, which off macOS is the
+  // simulated SMC.
+  if (Selected(filter, "sample/c_api")) {
+    smctemp_smc* smc = smctemp_open();
+    smctemp_handle handle;
+    double value = 0.0;
+    const bool ok = smc != nullptr && smctemp_resolve(smc, "#KEY", &handle) == 0 &&
+                    smctemp_read(smc, &handle, &value) == 0 && value > 0.0 &&
+                    smctemp_resolve(smc, "zzzz", &handle) != 0 && smctemp_resolve(smc, "TOOLONG", &handle) != 0;
+    smctemp_close(smc);
+    printf("%-28s %s (#KEY = %.0f)\n", "sample/c_api", ok ? "ok" : "FAILED", value);
+    Report("sample/c_api", "ok", ok, "bool");
+    if (!ok) {
+      return 1;
+    }
+  }
+
+  if (Selected(filter, "sample/cpu_temp")) {
+    const ScopedCpuModel m5("Apple M5");
+    smctemp::SmcTemp smc_temp(false, MakeSimulatedSmc());
+    const double ns = MeasureNsPerOp(iterations, [&] { g_sink = smc_temp.GetCpuTemp(); });
+    printf("%-28s %10.1f ns/sample\n", "sample/cpu_temp", ns);
+    Report("sample/cpu_temp", "time", ns, "ns/sample");
+  }
+
+  // Once the key info is cached, GetCpuTemp() and GetGpuTemp() as called by
+  // --stream and the daemon, which keeps statistics, must not touch the heap.
+  if (Selected(filter, "sample/allocations")) {
+    const ScopedCpuModel m5("Apple M5");
+    smctemp::SmcTemp smc_temp(false, MakeSimulatedSmc());
+    smc_temp.EnableStats({std::chrono::seconds(60), 3'001, std::chrono::seconds(6)});
+    g_sink = smc_temp.GetCpuTemp() + smc_temp.GetGpuTemp();
+    const uint64_t before = g_allocations.load();
+    for (int i = 0; i < 10'000; ++i) {
+      g_sink = smc_temp.GetCpuTemp() + smc_temp.GetGpuTemp() + smc_temp.LastReadings().size();
+    }
+    const uint64_t allocations = g_allocations.load() - before;
+    printf("%-28s %10llu allocations in 10000 samples\n", "sample/allocations",
+           static_cast<unsigned long long>(allocations));
+    Report("sample/allocations", "allocations", allocations, "count");
+    if (allocations != 0) {
+      std::cerr << "sample/allocations: the sampling path allocated" << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// GetCpuTemp() and GetGpuTemp() over the sensor sets of every chip in
+// kChipSensors, with every sensor present.
+int BenchChips(const char* filter) {
+  const uint64_t iterations = 100'000;
+  int failures = 0;
+  for (const smctemp::ChipSensors_t& chip : smctemp::kChipSensors) {
+    const std::string name = std::string("sample/chip_") + (chip.model[0] != '\0' ? chip.model : "x86");
+    if (!Selected(filter, name)) {
+      continue;
+    }
+    const ScopedCpuModel model((std::string("Apple ") + chip.model).c_str());
+    smctemp::SmcTemp smc_temp(false, MakeSimulatedSmc());
+    if (smc_temp.GetCpuTemp() <= 0.0 || smc_temp.GetGpuTemp() <= 0.0) {
+      std::cerr << name << ": no valid temperature" << std::endl;
+      failures++;
+      continue;
+    }
+    const double cpu_ns = MeasureNsPerOp(iterations, [&] { g_sink = smc_temp.GetCpuTemp(); });
+    const double gpu_ns = MeasureNsPerOp(iterations, [&] { g_sink = smc_temp.GetGpuTemp(); });
+    printf("%-28s cpu %8.1f ns/sample (%2zu sensors)  gpu %8.1f ns/sample (%2zu sensors)\n", name.c_str(), cpu_ns,
+           chip.cpu.count, gpu_ns, chip.gpu.count);
+    Report(name, "cpu", cpu_ns, "ns/sample");
+    Report(name, "gpu", gpu_ns, "ns/sample");
+  }
+  return failures;
+}
+
+// The fixed 100-entry, linearly scanned, lock-protected cache that
+// GetKeyInfo used before KeyInfoCache.
+class LegacyKeyInfoCache {
+ private:
+  struct {
+    uint32_t key;
+    smctemp::SmcKeyData_keyInfo_t keyInfo;
+  } entries_[100];
+  int count_ = 0;
+  std::mutex mutex_;
+
+ public:
+  bool Find(uint32_t key, smctemp::SmcKeyData_keyInfo_t& key_info) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < count_; ++i) {
+      if (entries_[i].key == key) {
+        key_info = entries_[i].keyInfo;
+        return true;
+      }
+    }
+    return false;
+  }
+  void Insert(uint32_t key, const smctemp::SmcKeyData_keyInfo_t& key_info) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (count_ < 100) {
+      entries_[count_].key = key;
+      entries_[count_].keyInfo = key_info;
+      count_++;
+    }
+  }
+};
+
+std::vector<uint32_t> SyntheticKeys(size_t count) {
+  std::vector<uint32_t> keys;
+  const char alphabet[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+  for (size_t i = 0; keys.size() < count; ++i) {
+    const char key[5] = {"TFPV"[i % 4], alphabet[(i / 4) % 62], alphabet[(i / 248) % 62], alphabet[i % 62], '\0'};
+    keys.push_back(smctemp::string_util::strtoul(key, 4, 16));
+  }
+  return keys;
+}
+
+template <typename Cache>
+double MeasureCacheLookups(Cache& cache, const std::vector<uint32_t>& keys, uint64_t iterations) {
+  smctemp::SmcKeyData_keyInfo_t key_info;
+  size_t next = 0;
+  return MeasureNsPerOp(iterations, [&] {
+    g_sink = cache.Find(keys[next], key_info);
+    next = next + 1 == keys.size() ? 0 : next + 1;
+  });
+}
+
+int BenchKeyInfoCache(const char* filter) {
+  const uint64_t iterations = 2'000'000;
+  smctemp::SmcKeyData_keyInfo_t key_info{2, smctemp::FourCC(smctemp::kDataTypeSp78), 0};
+
+  for (size_t key_count : {10, 100, 2000}) {
+    const std::string name = "key_info/lookup_" + std::to_string(key_count);
+    if (!Selected(filter, name)) {
+      continue;
+    }
+    // Misses look up as many keys again that were never inserted.
+    const std::vector<uint32_t> all_keys = SyntheticKeys(2 * key_count);
+    const std::vector<uint32_t> keys(all_keys.begin(), all_keys.begin() + key_count);
+    const std::vector<uint32_t> absent_keys(all_keys.begin() + key_count, all_keys.end());
+    LegacyKeyInfoCache legacy;
+    smctemp::KeyInfoCache cache;
+    for (uint32_t key : keys) {
+      legacy.Insert(key, key_info);
+      cache.Insert(key, key_info);
+    }
+    const double legacy_ns = MeasureCacheLookups(legacy, keys, iterations);
+    const double cache_ns = MeasureCacheLookups(cache, keys, iterations);
+    const double miss_ns = MeasureCacheLookups(cache, absent_keys, iterations);
+    printf("%-28s legacy %8.2f ns/op  hash %8.2f ns/op  miss %8.2f ns/op\n", name.c_str(), legacy_ns, cache_ns,
+           miss_ns);
+    Report(name, "legacy", legacy_ns, "ns/op");
+    Report(name, "hash", cache_ns, "ns/op");
+    Report(name, "miss", miss_ns, "ns/op");
+  }
+
+  for (size_t thread_count : {1, 2, 4, 8}) {
+    const std::string name = "key_info/contention_" + std::to_string(thread_count);
+    if (!Selected(filter, name)) {
+      continue;
+    }
+    const std::vector<uint32_t> keys = SyntheticKeys(100);
+    LegacyKeyInfoCache legacy;
+    smctemp::KeyInfoCache cache;
+    for (uint32_t key : keys) {
+      legacy.Insert(key, key_info);
+      cache.Insert(key, key_info);
+    }
+    auto run = [&](auto& target) {
+      std::vector<std::thread> threads;
+      std::vector<double> ns(thread_count);
+      for (size_t t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&, t] { ns[t] = MeasureCacheLookups(target, keys, iterations / thread_count); });
+      }
+      for (auto& thread : threads) {
+        thread.join();
+      }
+      double total = 0.0;
+      for (double v : ns) {
+        total += v;
+      }
+      return total / thread_count;
+    };
+    const double legacy_ns = run(legacy);
+    const double cache_ns = run(cache);
+    printf("%-28s legacy %8.2f ns/op  hash %8.2f ns/op (per reader)\n", name.c_str(), legacy_ns, cache_ns);
+    Report(name, "legacy", legacy_ns, "ns/op");
+    Report(name, "hash", cache_ns, "ns/op");
+  }
+  return 0;
+}
+
+// Key names to SMC keys and back, as every -l line and named read does.
+int BenchFourCC(const char* filter) {
+  if (!Selected(filter, "fourcc/convert")) {
+    return 0;
+  }
+  const uint64_t iterations = 2'000'000;
+  const std::vector<uint32_t> keys = SyntheticKeys(256);
+  std::vector<std::array<char, 5>> names(keys.size());
+  int failures = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    smctemp::string_util::ultostr(names[i].data(), names[i].size(), keys[i]);
+    if (smctemp::string_util::strtoul(names[i].data(), 4, 16) != keys[i]) {
+      std::cerr << "fourcc/convert: " << names[i].data() << " does not round-trip" << std::endl;
+      failures++;
+    }
+  }
+  size_t next = 0;
+  const double strtoul_ns = MeasureNsPerOp(iterations, [&] {
+    g_sink = smctemp::string_util::strtoul(names[next].data(), 4, 16);
+    next = (next + 1) % names.size();
+  });
+  char name[5];
+  const double ultostr_ns = MeasureNsPerOp(iterations, [&] {
+    smctemp::string_util::ultostr(name, sizeof(name), keys[next]);
+    g_sink = name[3];
+    next = (next + 1) % keys.size();
+  });
+  printf("%-28s strtoul %6.2f ns/op  ultostr %6.2f ns/op\n", "fourcc/convert", strtoul_ns, ultostr_ns);
+  Report("fourcc/convert", "strtoul", strtoul_ns, "ns/op");
+  Report("fourcc/convert", "ultostr", ultostr_ns, "ns/op");
+  return failures;
+}
+
+// SMC calls made by a fresh process reading the M5 CPU sensors, without and
+// with a warm key info cache file.
+int BenchColdStart(const char* filter) {
+  if (!Selected(filter, "cold_start/key_info_file")) {
+    return 0;
+  }
+  const std::string path = "/tmp/smctemp_bench_key_info." + std::to_string(getpid());
+  std::vector<uint32_t> keys;
+  for (const char* sensor : kM5CpuSensors) {
+    keys.push_back(smctemp::string_util::strtoul(sensor, 4, 16));
+  }
+  std::vector<double> values(keys.size());
+  uint64_t calls[3];
+  for (int run = 0; run < 3; ++run) {
+    auto smc = MakeSimulatedSmc();
+    smctemp::SimulatedSmcTransport* sim = smc.get();
+    smctemp::SmcAccessor accessor(std::move(smc));
+    if (run > 0) {
+      accessor.UsePersistentKeyInfoCache(path);
+    }
+    accessor.ReadValues(keys.data(), keys.size(), values.data(), nullptr);
+    calls[run] = sim->TotalCalls();
+  }
+  unlink(path.c_str());
+  printf("%-28s no file %3llu calls  cold file %3llu calls  warm file %3llu calls\n", "cold_start/key_info_file",
+         static_cast<unsigned long long>(calls[0]), static_cast<unsigned long long>(calls[1]),
+         static_cast<unsigned long long>(calls[2]));
+  Report("cold_start/key_info_file", "no_file", calls[0], "calls");
+  Report("cold_start/key_info_file", "cold_file", calls[1], "calls");
+  Report("cold_start/key_info_file", "warm_file", calls[2], "calls");
+  return 0;
+}
+
+// SMC calls and time of -l listings of a simulated SMC with 1500 keys. Every
+// listed key must be read exactly once: one kSmcCmdReadKeyInfo and one
+// kSmcCmdReadBytes (none with --index-only), plus the #KEY count read. Keys
+// rejected by the filter must cost only their kSmcCmdReadIndex.
+int BenchListing(const char* filter) {
+  struct Case {
+    const char* name;
+    const char* keys;
+    bool indexOnly;
+  };
+  const Case cases[] = {
+    {"listing/print_all", "", false},
+    {"listing/filtered", "V*,TC", false},
+    {"listing/index_only", "", true},
+  };
+  int failures = 0;
+  for (const Case& c : cases) {
+    if (!Selected(filter, c.name)) {
+      continue;
+    }
+    auto smc = MakeSimulatedSmc();
+    smctemp::SimulatedSmcTransport* sim = smc.get();
+    for (uint32_t key : SyntheticKeys(1500)) {
+      char name[5];
+      smctemp::string_util::ultostr(name, sizeof(name), key);
+      sim->SetTemperature(name, 40.0 + key % 50);
+    }
+    const uint64_t keys = sim->KeyCount();
+    char path[] = "/tmp/smctemp_bench_listing.XXXXXX";
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+      std::cerr << c.name << ": failed to create " << path << std::endl;
+      return failures + 1;
+    }
+    unlink(path);
+
+    smctemp::SmcAccessor accessor(std::move(smc));
+    const smctemp::SmcKeyFilter key_filter(c.keys);
+    const auto start = std::chrono::steady_clock::now();
+    accessor.PrintAll(fd, key_filter, c.indexOnly);
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    const uint64_t lines = [&] {
+      std::vector<char> buffer(1 << 16);
+      uint64_t count = 0;
+      ssize_t size;
+      lseek(fd, 0, SEEK_SET);
+      while ((size = read(fd, buffer.data(), buffer.size())) > 0) {
+        for (ssize_t i = 0; i < size; ++i) {
+          count += buffer[i] == '\n';
+        }
+      }
+      return count;
+    }();
+    close(fd);
+
+    printf("%-28s %4llu of %llu keys  %llu index + %llu key info + %llu read calls  %.2f ms\n", c.name,
+           static_cast<unsigned long long>(lines), static_cast<unsigned long long>(keys),
+           static_cast<unsigned long long>(sim->ReadIndexCalls()), static_cast<unsigned long long>(sim->KeyInfoCalls()),
+           static_cast<unsigned long long>(sim->ReadBytesCalls()), ms);
+    Report(c.name, "keys_listed", lines, "count");
+    Report(c.name, "calls", sim->TotalCalls(), "calls");
+    Report(c.name, "time", ms, "ms");
+    // #KEY is looked up for the count even when the filter rejects it.
+    const bool key_count_listed = key_filter.Matches(smctemp::FourCC("#KEY"));
+    const uint64_t key_info_calls = lines + (key_count_listed ? 0 : 1);
+    const uint64_t read_calls = c.indexOnly ? 1 : lines + 1;
+    if ((key_filter.Empty() && lines != keys) || sim->ReadIndexCalls() != keys ||
+        sim->KeyInfoCalls() != key_info_calls || sim->ReadBytesCalls() != read_calls) {
+      std::cerr << c.name << ": expected " << key_info_calls << " key info and " << read_calls << " read calls"
+        << std::endl;
+      failures++;
+    }
+  }
+  return failures;
+}
+
+// CPU samples of an SMC where half of the sensor reads come back zeroed, as
+// on M2 machines, retried every 0.5 ms until the quorum is met. Whole-set
+// retry re-reads every sensor until one pass meets the quorum, as main did
+// before retries moved into SmcTemp; per-sensor retry keeps the valid values
+// and re-reads only the others.
+int BenchRetry(const char* filter) {
+  const ScopedCpuModel m5("Apple M5");
+  const std::pair<unsigned int, unsigned int>& limits = smctemp::kValidTemperatureLimits;
+  const auto interval = std::chrono::microseconds(500);
+  const unsigned int max_attempts = 1'000;
+  const int samples = 50;
+  int failures = 0;
+  for (unsigned int quorum_percent : {0u, 75u}) {
+    const std::string name = "retry/flaky_quorum_" + std::to_string(quorum_percent);
+    if (!Selected(filter, name)) {
+      continue;
+    }
+    struct Totals {
+      uint64_t attempts = 0;
+      uint64_t reads = 0;
+      double ms = 0.0;
+    } whole, per_sensor;
+
+    {
+      auto smc = MakeSimulatedSmc();
+      smctemp::SimulatedSmcTransport* sim = smc.get();
+      sim->SetSeed(1);
+      smctemp::SmcTemp smc_temp(false, std::move(smc));
+      g_sink = smc_temp.GetCpuTemp();
+      sim->SetZeroReadRate(0.5);
+      sim->ResetCallCounts();
+      const auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < samples; ++i) {
+        int64_t deadline_ns = smctemp::MonotonicNs();
+        for (unsigned int attempt = 1; attempt <= max_attempts; ++attempt) {
+          whole.attempts++;
+          const double temp = smc_temp.GetCpuTemp();
+          size_t valid = 0;
+          for (const smctemp::SensorReading_t& reading : smc_temp.LastReadings()) {
+            valid += smc_temp.IsValidTemperature(reading.value, limits);
+          }
+#if defined(ARCH_TYPE_X86_64)
+          // The x86 sensors are alternatives; the first valid one settles it.
+          const size_t quorum = 1;
+#else
+          const size_t quorum = std::max<size_t>(1, (smc_temp.LastReadings().size() * quorum_percent + 99) / 100);
+#endif
+          if (smc_temp.IsValidTemperature(temp, limits) && valid >= quorum) {
+            break;
+          }
+          deadline_ns += std::chrono::nanoseconds(interval).count();
+          smctemp::SleepUntil(deadline_ns);
+        }
+      }
+      whole.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      whole.reads = sim->ReadBytesCalls();
+    }
+
+    {
+      auto smc = MakeSimulatedSmc();
+      smctemp::SimulatedSmcTransport* sim = smc.get();
+      sim->SetSeed(1);
+      smctemp::SmcTemp smc_temp(false, std::move(smc));
+      g_sink = smc_temp.GetCpuTemp();
+      sim->SetZeroReadRate(0.5);
+      sim->ResetCallCounts();
+      smc_temp.SetRetry(max_attempts, interval, quorum_percent);
+      const auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < samples; ++i) {
+        g_sink = smc_temp.GetCpuTemp();
+        per_sensor.attempts += smc_temp.LastSampleStats().attempts;
+      }
+      per_sensor.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      per_sensor.reads = sim->ReadBytesCalls();
+    }
+
+    printf("%-28s whole set: %6.1f passes %7.1f reads %7.2f ms  per sensor: %6.1f passes %7.1f reads %7.2f ms"
+           " (per sample)\n", name.c_str(), static_cast<double>(whole.attempts) / samples,
+           static_cast<double>(whole.reads) / samples, whole.ms / samples,
+           static_cast<double>(per_sensor.attempts) / samples, static_cast<double>(per_sensor.reads) / samples,
+           per_sensor.ms / samples);
+    Report(name, "whole_set_reads", static_cast<double>(whole.reads) / samples, "reads/sample");
+    Report(name, "per_sensor_reads", static_cast<double>(per_sensor.reads) / samples, "reads/sample");
+    Report(name, "whole_set_time", whole.ms / samples, "ms/sample");
+    Report(name, "per_sensor_time", per_sensor.ms / samples, "ms/sample");
+    if (per_sensor.reads > whole.reads) {
+      std::cerr << name << ": per-sensor retry made more reads than whole-set retry" << std::endl;
+      failures++;
+    }
+  }
+  return failures;
+}
+
+// CPU samples of an SMC where every other key of the chip's CPU list is
+// absent and one more always reads 0, with and without quarantine. Reported
+// are the keys polled and the SMC calls made per sample; afterwards an absent
+// key is brought back and must be picked up again within the longest backoff.
+int BenchHealth(const char* filter) {
+  if (!Selected(filter, "health/missing_keys")) {
+    return 0;
+  }
+  const ScopedCpuModel m5("Apple M5");
+  const smctemp::ChipSensors_t* chip = smctemp::DetectChipSensors();
+  if (chip == nullptr || chip->cpu.count < 3) {
+    return 0;
+  }
+  const int samples = 2'000;
+  auto make_smc = [&] {
+    auto smc = MakeSimulatedSmc();
+    for (size_t i = 0; i < chip->cpu.count; ++i) {
+      smctemp::UInt32Char_t key;
+      smctemp::string_util::ultostr(key, sizeof(key), chip->cpu.keys[i]);
+      smc->SetTemperature(key, 50.0 + i);
+      if (i == 1) {
+        smc->SetTemperature(key, 0.0);
+      } else if (i % 2 == 0 && i + 1 < chip->cpu.count) {
+        smc->RemoveKey(key);
+      }
+    }
+    return smc;
+  };
+  struct Totals {
+    uint64_t reads = 0;
+    uint64_t calls = 0;
+    double temp = 0.0;
+  } totals[2];
+  for (int quarantine = 0; quarantine < 2; ++quarantine) {
+    auto smc = make_smc();
+    smctemp::SimulatedSmcTransport* sim = smc.get();
+    smctemp::SmcTemp smc_temp(false, std::move(smc));
+    smc_temp.SetQuarantine(quarantine != 0);
+    g_sink = smc_temp.GetCpuTemp();
+    sim->ResetCallCounts();
+    for (int i = 0; i < samples; ++i) {
+      totals[quarantine].temp = smc_temp.GetCpuTemp();
+      totals[quarantine].reads += smc_temp.LastSampleStats().sensorReads;
+    }
+    totals[quarantine].calls = sim->TotalCalls();
+  }
+  printf("%-28s without quarantine: %5.2f keys %5.2f calls  with: %5.2f keys %5.2f calls (per sample)\n",
+         "health/missing_keys", static_cast<double>(totals[0].reads) / samples,
+         static_cast<double>(totals[0].calls) / samples, static_cast<double>(totals[1].reads) / samples,
+         static_cast<double>(totals[1].calls) / samples);
+  Report("health/missing_keys", "calls_without_quarantine", static_cast<double>(totals[0].calls) / samples,
+         "calls/sample");
+  Report("health/missing_keys", "calls_with_quarantine", static_cast<double>(totals[1].calls) / samples,
+         "calls/sample");
+  int failures = 0;
+  if (totals[1].reads >= totals[0].reads || totals[1].calls >= totals[0].calls) {
+    std::cerr << "health/missing_keys: quarantine did not cut the reads per sample" << std::endl;
+    failures++;
+  }
+  if (totals[1].temp != totals[0].temp) {
+    std::cerr << "health/missing_keys: quarantine changed the temperature" << std::endl;
+    failures++;
+  }
+
+  auto smc = make_smc();
+  smctemp::SimulatedSmcTransport* sim = smc.get();
+  smctemp::SmcTemp smc_temp(false, std::move(smc));
+  for (int i = 0; i < samples; ++i) {
+    g_sink = smc_temp.GetCpuTemp();
+  }
+  smctemp::UInt32Char_t key;
+  smctemp::string_util::ultostr(key, sizeof(key), chip->cpu.keys[0]);
+  sim->SetTemperature(key, 50.0);
+  for (int i = 0; i <= 1'024; ++i) {
+    g_sink = smc_temp.GetCpuTemp();
+  }
+  const smctemp::SensorHealth_t& health = smc_temp.SensorHealth()[0];
+  if (health.consecutiveFailures != 0 || health.quarantineLeft != 0) {
+    std::cerr << "health/missing_keys: " << key << " was not picked up again" << std::endl;
+    failures++;
+  }
+  return failures;
+}
+
+// SMC calls of a fresh process taking one CPU and one GPU sample on the SMC
+// of health/missing_keys: reading the chip's lists, probing them and writing
+// a manifest, and reading only the live keys from that manifest.
+int BenchManifest(const char* filter) {
+  int failures = 0;
+  const ScopedCpuModel m5("Apple M5");
+  const smctemp::ChipSensors_t* chip = smctemp::DetectChipSensors();
+  const std::string path = "/tmp/smctemp_bench_manifest." + std::to_string(getpid());
+  if (Selected(filter, "manifest/cold_start") && chip != nullptr && chip->cpu.count >= 3) {
+    auto make_smc = [&] {
+      auto smc = MakeSimulatedSmc();
+      for (const smctemp::SensorSet_t* sensors : {&chip->cpu, &chip->gpu}) {
+        for (size_t i = 0; i < sensors->count; ++i) {
+          smctemp::UInt32Char_t key;
+          smctemp::string_util::ultostr(key, sizeof(key), sensors->keys[i]);
+          smc->SetTemperature(key, 50.0 + i);
+          if (i == 1) {
+            smc->SetTemperature(key, 0.0);
+          } else if (i % 2 == 0 && i + 1 < sensors->count) {
+            smc->RemoveKey(key);
+          }
+        }
+      }
+      return smc;
+    };
+    uint64_t calls[3];
+    double temps[3][2];
+    for (int run = 0; run < 3; ++run) {
+      auto smc = make_smc();
+      smctemp::SimulatedSmcTransport* sim = smc.get();
+      smctemp::SmcTemp smc_temp(false, std::move(smc));
+      if (run > 0) {
+        smc_temp.UseSensorManifest(path);
+      }
+      temps[run][0] = smc_temp.GetCpuTemp();
+      temps[run][1] = smc_temp.GetGpuTemp();
+      calls[run] = sim->TotalCalls();
+    }
+    unlink(path.c_str());
+    printf("%-28s lists %4llu calls  probe %4llu calls  manifest %4llu calls\n", "manifest/cold_start",
+           static_cast<unsigned long long>(calls[0]), static_cast<unsigned long long>(calls[1]),
+           static_cast<unsigned long long>(calls[2]));
+    Report("manifest/cold_start", "lists", calls[0], "calls");
+    Report("manifest/cold_start", "probe", calls[1], "calls");
+    Report("manifest/cold_start", "manifest", calls[2], "calls");
+    if (calls[2] >= calls[0]) {
+      std::cerr << "manifest/cold_start: the manifest did not cut the SMC calls" << std::endl;
+      failures++;
+    }
+    for (int run = 1; run < 3; ++run) {
+      if (temps[run][0] != temps[0][0] || temps[run][1] != temps[0][1]) {
+        std::cerr << "manifest/cold_start: run " << run << " read other temperatures" << std::endl;
+        failures++;
+      }
+    }
+  }
+
+  // An SMC with none of the listed keys, only die sensors the lists do not
+  // name, must still give temperatures through the enumeration fallback.
+  if (Selected(filter, "manifest/unlisted_keys")) {
+    auto make_smc = [] {
+      auto smc = std::make_unique<smctemp::SimulatedSmcTransport>();
+#if defined(ARCH_TYPE_X86_64)
+      smc->SetTemperature("TC9a", 61.0);
+      smc->SetTemperature("TC9b", 0.0);
+      smc->SetTemperature("TG9x", 45.0);
+#else
+      smc->SetTemperature("Tp9a", 61.0);
+      smc->SetTemperature("Te9b", 59.0);
+      smc->SetTemperature("Tp9c", 0.0);
+      smc->SetTemperature("Tg9x", 45.0);
+#endif
+      smc->SetTemperature("Ta0P", 30.0);
+      return smc;
+    };
+#if defined(ARCH_TYPE_X86_64)
+    // The first valid alternative.
+    const double expected_cpu = 61.0;
+#else
+    // The mean of the live keys.
+    const double expected_cpu = 60.0;
+#endif
+    std::vector<std::pair<std::string, const char*>> cases = {{"manifest", "Apple M5"}};
+#if defined(ARCH_TYPE_ARM64)
+    cases.push_back({"unknown chip", "Apple M99"});
+#endif
+    for (const auto& [name, cpu_model] : cases) {
+      const ScopedCpuModel model(cpu_model);
+      smctemp::SmcTemp smc_temp(false, make_smc());
+      if (name == "manifest") {
+        smc_temp.UseSensorManifest(path);
+      }
+      const double cpu = smc_temp.GetCpuTemp();
+      const double gpu = smc_temp.GetGpuTemp();
+      printf("%-28s %-12s cpu %5.1f  gpu %5.1f\n", "manifest/unlisted_keys", name.c_str(), cpu, gpu);
+      Report("manifest/unlisted_keys/" + name, "cpu", cpu, "degrees");
+      if (cpu != expected_cpu || gpu != 45.0) {
+        std::cerr << "manifest/unlisted_keys: " << name << " did not find the die sensors" << std::endl;
+        failures++;
+      }
+    }
+    unlink(path.c_str());
+  }
+  return failures;
+}
+
+// Cost of keeping the last valid temperature for -f: rewriting a text file
+// through std::ofstream on every sample, as before, against LastValidStore,
+// whose stores are memory writes and are coalesced while the value moves by
+// less than 0.05 C. Also checks that a store left half-written by a dead
+// process is taken over and that its record still loads.
+int BenchFailSoftStore(const char* filter) {
+  if (!Selected(filter, "fail_soft/store")) {
+    return 0;
+  }
+  const std::string text_path = "/tmp/smctemp_bench_last_valid." + std::to_string(getpid()) + ".txt";
+  const std::string path = "/tmp/smctemp_bench_last_valid." + std::to_string(getpid()) + ".bin";
+  const uint64_t iterations = 20'000;
+  uint64_t i = 0;
+  const double text_ns = MeasureNsPerOp(iterations, [&] {
+    std::ofstream out_file(text_path);
+    out_file << 50.0 + (i++ % 100) * 0.25;
+  });
+  int failures = 0;
+  {
+    smctemp::LastValidStore store(path, 0.0);
+    smctemp::LastValid_t record;
+    if (store.Load(record)) {
+      std::cerr << "fail_soft/store: a new store has a record" << std::endl;
+      failures++;
+    }
+    i = 0;
+    const double store_ns = MeasureNsPerOp(iterations, [&] { store.Store(50.0 + (i++ % 100) * 0.25, 8); });
+    smctemp::LastValidStore drifting(path);
+    for (int n = 0; n < 1'000; ++n) {
+      drifting.Store(50.0 + n * 0.001, 8);
+    }
+    printf("%-28s ofstream %8.1f ns/store  mapped %6.1f ns/store  drifting: %llu of 1000 written\n",
+           "fail_soft/store", text_ns, store_ns, static_cast<unsigned long long>(drifting.Writes()));
+    Report("fail_soft/store", "ofstream", text_ns, "ns/store");
+    Report("fail_soft/store", "mapped", store_ns, "ns/store");
+    Report("fail_soft/store", "drifting_writes", drifting.Writes(), "count");
+    if (!store.Load(record) || record.sensorCount != 8 || smctemp::LastValidStore::AgeNs(record) > 1'000'000'000) {
+      std::cerr << "fail_soft/store: the last store did not load back" << std::endl;
+      failures++;
+    }
+    if (drifting.Writes() + drifting.Coalesced() != 1'000 || drifting.Writes() > 100) {
+      std::cerr << "fail_soft/store: drifting values were not coalesced" << std::endl;
+      failures++;
+    }
+  }
+  {
+    // Leave the sequence odd, as a process killed while storing would.
+    int fd = open(path.c_str(), O_RDWR);
+    const uint32_t odd = 7;
+    const bool broken = fd >= 0 && pwrite(fd, &odd, sizeof(odd), offsetof(smctemp::LastValidFile, sequence)) ==
+                                   static_cast<ssize_t>(sizeof(odd));
+    if (fd >= 0) {
+      close(fd);
+    }
+    smctemp::LastValidStore store(path);
+    smctemp::LastValid_t record;
+    const bool loaded = store.Load(record);
+    store.Store(42.0, 1);
+    if (!broken || !loaded || !store.Load(record) || record.value != 42.0) {
+      std::cerr << "fail_soft/store: a store left busy by a dead writer was not recovered" << std::endl;
+      failures++;
+    }
+  }
+  unlink(text_path.c_str());
+  unlink(path.c_str());
+  return failures;
+}
+
+// NetworkSort must agree with std::sort for every size, duplicates included,
+// and the median of an M5-sized set is timed both ways. On arm64 a set of
+// M5 sensors with one stuck and one glitching core is then sampled with each
+// aggregation: median and trimmed mean have to stay within a degree of the
+// true mean, which the plain mean cannot.
+int BenchAggregate(const char* filter) {
+  int failures = 0;
+  if (Selected(filter, "aggregate/network")) {
+    uint32_t rng = 7;
+    auto next = [&rng] {
+      rng = rng * 1664525u + 1013904223u;
+      return static_cast<double>((rng >> 8) % 64);
+    };
+    bool sorted = true;
+    for (size_t count = 0; count <= smctemp::kSortNetworkMaxSize + 8; ++count) {
+      for (int trial = 0; trial < 200; ++trial) {
+        std::vector<double> values(count);
+        for (double& value : values) {
+          value = next();
+        }
+        std::vector<double> expected(values);
+        std::sort(expected.begin(), expected.end());
+        smctemp::NetworkSort(values.data(), count);
+        sorted = sorted && values == expected;
+      }
+    }
+    const size_t count = 18;
+    std::vector<double> input(count * 1024);
+    for (double& value : input) {
+      value = 50.0 + next() / 8;
+    }
+    std::vector<double> values(count);
+    size_t offset = 0;
+    const uint64_t iterations = 200'000;
+    const double network_ns = MeasureNsPerOp(iterations, [&] {
+      std::copy_n(input.begin() + offset, count, values.begin());
+      offset = (offset + count) % input.size();
+      g_sink = smctemp::Aggregate(smctemp::Aggregation::kMedian, values.data(), count);
+    });
+    const double sort_ns = MeasureNsPerOp(iterations, [&] {
+      std::copy_n(input.begin() + offset, count, values.begin());
+      offset = (offset + count) % input.size();
+      std::sort(values.begin(), values.end());
+      g_sink = (values[count / 2 - 1] + values[count / 2]) / 2;
+    });
+    printf("%-28s %s  median of %zu: network %6.1f ns  std::sort %6.1f ns\n", "aggregate/network",
+           sorted ? "sorts 0-40" : "MISSORTED", count, network_ns, sort_ns);
+    Report("aggregate/network", "network", network_ns, "ns/median");
+    Report("aggregate/network", "std_sort", sort_ns, "ns/median");
+    if (!sorted) {
+      std::cerr << "aggregate/network: NetworkSort disagrees with std::sort" << std::endl;
+      failures++;
+    }
+  }
+
+#if defined(ARCH_TYPE_ARM64)
+  if (Selected(filter, "aggregate/glitch")) {
+    const ScopedCpuModel m5("Apple M5");
+    const smctemp::ChipSensors_t* chip = smctemp::DetectChipSensors();
+    const size_t sensor_count = chip->cpu.count;
+    std::vector<double> truth(sensor_count);
+    double true_mean = 0.0;
+    for (size_t i = 0; i < sensor_count; ++i) {
+      truth[i] = 60.0 + (i % 3) * 0.5;
+      true_mean += truth[i];
+    }
+    true_mean /= sensor_count;
+    const size_t stuck = 3;
+    const int samples = 2'000;
+    const smctemp::Aggregation modes[] = {
+      smctemp::Aggregation::kMean, smctemp::Aggregation::kMedian, smctemp::Aggregation::kTrimmedMean,
+    };
+    printf("%-28s", "aggregate/glitch");
+    for (smctemp::Aggregation mode : modes) {
+      auto smc = MakeSimulatedSmc();
+      smctemp::SimulatedSmcTransport* sim = smc.get();
+      smctemp::SmcTemp smc_temp(false, std::move(smc));
+      smc_temp.SetAggregation(mode);
+      uint32_t rng = 11;
+      double error = 0.0;
+      int within = 0;
+      uint64_t reads = 0;
+      for (int n = 0; n < samples; ++n) {
+        rng = rng * 1664525u + 1013904223u;
+        const size_t glitch = (rng >> 8) % sensor_count;
+        for (size_t i = 0; i < sensor_count; ++i) {
+          smctemp::UInt32Char_t key;
+          smctemp::string_util::ultostr(key, sizeof(key), chip->cpu.keys[i]);
+          sim->SetTemperature(key, i == stuck ? 95.0 : i == glitch && (rng >> 20) % 2 ? 110.0 : truth[i]);
+        }
+        const double temp = smc_temp.GetCpuTemp();
+        error += std::fabs(temp - true_mean);
+        within += std::fabs(temp - true_mean) < 1.0;
+        reads += smc_temp.LastSampleStats().sensorReads;
+      }
+      printf("  %s %4.2f (%3d%% within 1)", smctemp::AggregationName(mode), error / samples,
+             within * 100 / samples);
+      Report("aggregate/glitch", smctemp::AggregationName(mode), error / samples, "degrees");
+      if (mode != smctemp::Aggregation::kMean && within != samples) {
+        std::cerr << "aggregate/glitch: " << smctemp::AggregationName(mode) << " followed a glitch" << std::endl;
+        failures++;
+      }
+      if (reads != static_cast<uint64_t>(samples) * sensor_count) {
+        std::cerr << "aggregate/glitch: a sample took more than one pass" << std::endl;
+        failures++;
+      }
+    }
+    printf("\n");
+
+    // Cluster means: super cores read 70, performance cores 60, and
+    // cluster-max follows the hotter cluster without an allocation.
+    auto smc = MakeSimulatedSmc();
+    for (size_t i = 0; i < sensor_count; ++i) {
+      smctemp::UInt32Char_t key;
+      smctemp::string_util::ultostr(key, sizeof(key), chip->cpu.keys[i]);
+      smc->SetTemperature(key, i < 6 ? 70.0 : 60.0);
+    }
+    smctemp::SmcTemp smc_temp(false, std::move(smc));
+    smc_temp.SetAggregation(smctemp::Aggregation::kHottestCluster);
+    g_sink = smc_temp.GetCpuTemp();
+    const uint64_t before = g_allocations.load();
+    double temp = 0.0;
+    for (int n = 0; n < 1'000; ++n) {
+      temp = smc_temp.GetCpuTemp();
+    }
+    const uint64_t allocations = g_allocations.load() - before;
+    const std::vector<smctemp::ClusterTemp_t>& clusters = smc_temp.LastClusterTemps();
+    if (clusters.size() != 2 || strcmp(clusters[0].name, "super") != 0 || clusters[0].temperature != 70.0 ||
+        clusters[0].validSensors != 6 || clusters[1].temperature != 60.0 || temp != 70.0 || allocations != 0) {
+      std::cerr << "aggregate/glitch: cluster-max did not follow the super cores" << std::endl;
+      failures++;
+    }
+  }
+#endif
+  return failures;
+}
+
+// Replays half an hour of a 1 ms temperature trace, mostly idle with sensor
+// noise and with load bursts that ramp at 5 to 30 degrees per second to
+// between 85 and 98 degrees, through AdaptiveRate on a virtual clock. Every
+// time the noise-free temperature rises past the 90 degree threshold, a
+// sample has to see it above within one ceiling period, as a fixed schedule
+// at the ceiling rate would, while taking far fewer samples than that
+// schedule.
+int BenchAdaptive(const char* filter) {
+  if (!Selected(filter, "adaptive/replay")) {
+    return 0;
+  }
+  const int64_t step_ns = 1'000'000;
+  const size_t steps = 1'800'000;
+  const double threshold = 90.0;
+  std::vector<double> trace(steps);
+  std::vector<double> truth(steps);
+  uint32_t rng = 5;
+  auto uniform = [&rng] {
+    rng = rng * 1664525u + 1013904223u;
+    return (rng >> 8) / static_cast<double>(1u << 24);
+  };
+  double base = 45.0;
+  size_t i = 0;
+  while (i < steps) {
+    // Cooling and idle for 10 to 60 seconds, then a burst held for 1 to 5.
+    const size_t idle_end = std::min(steps, i + static_cast<size_t>((10.0 + uniform() * 50.0) * 1'000));
+    for (; i < idle_end; ++i) {
+      base += (45.0 - base) * 0.0005;
+      truth[i] = base;
+    }
+    const double slope = 5.0 + uniform() * 25.0;
+    const double peak = 85.0 + uniform() * 13.0;
+    for (; i < steps && base < peak; ++i) {
+      base += slope / 1'000;
+      truth[i] = base;
+    }
+    const size_t hold_end = std::min(steps, i + static_cast<size_t>((1.0 + uniform() * 4.0) * 1'000));
+    for (; i < hold_end; ++i) {
+      truth[i] = base;
+    }
+  }
+  for (size_t step = 0; step < steps; ++step) {
+    trace[step] = truth[step] + (uniform() - 0.5) * 0.4;
+  }
+
+  const smctemp::AdaptiveConfig_t config = {
+    std::chrono::milliseconds(50), std::chrono::seconds(1), 0.5, 5.0, threshold, 5.0,
+  };
+  const int64_t min_period_ns = config.minPeriod.count();
+  smctemp::AdaptiveRate rate(config);
+  std::vector<uint8_t> seen(steps);
+  int64_t now_ns = 0;
+  uint64_t samples = 0;
+  while (now_ns < static_cast<int64_t>(steps) * step_ns) {
+    const size_t step = now_ns / step_ns;
+    seen[step] = 1;
+    samples++;
+    now_ns += rate.Update(now_ns, trace[step]).count();
+  }
+  const uint64_t fixed_samples = (steps * step_ns + min_period_ns - 1) / min_period_ns;
+
+  // A crossing is missed if no sample is taken above the threshold within
+  // one ceiling period of it.
+  int crossings = 0;
+  int missed = 0;
+  int64_t worst_latency_ns = 0;
+  for (size_t step = 1; step < steps; ++step) {
+    if (truth[step - 1] >= threshold || truth[step] < threshold) {
+      continue;
+    }
+    crossings++;
+    size_t found = step;
+    while (found < steps && !(seen[found] && truth[found] >= threshold)) {
+      found++;
+    }
+    const int64_t latency_ns = (found - step) * step_ns;
+    worst_latency_ns = std::max(worst_latency_ns, latency_ns);
+    if (found == steps || latency_ns > min_period_ns) {
+      missed++;
+    }
+  }
+  printf("%-28s %d crossings, %d missed (worst %.0f ms)  %llu samples vs %llu fixed (%.1f%% saved, %.2f Hz)\n",
+         "adaptive/replay", crossings, missed, worst_latency_ns / 1e6, static_cast<unsigned long long>(samples),
+         static_cast<unsigned long long>(fixed_samples), 100.0 * rate.SamplesSaved(now_ns) / fixed_samples,
+         rate.EffectiveRateHz(now_ns));
+  Report("adaptive/replay", "missed", missed, "count");
+  Report("adaptive/replay", "saved", 100.0 * rate.SamplesSaved(now_ns) / fixed_samples, "percent");
+  int failures = 0;
+  if (crossings == 0 || missed != 0) {
+    std::cerr << "adaptive/replay: threshold crossings were missed" << std::endl;
+    failures++;
+  }
+  if (samples * 2 > fixed_samples) {
+    std::cerr << "adaptive/replay: saved less than half of the fixed-rate samples" << std::endl;
+    failures++;
+  }
+  return failures;
+}
+
+// Records a session against an SMC whose sensors read 0 nine times out of
+// ten, as M2 machines do, with up to 180 attempts per sample. Replaying the
+// trace through a fresh SmcTemp has to give the same temperatures after the
+// same number of attempts, without the simulated SMC. A paced recording is
+// then replayed at recorded speed and has to take about as long.
+int BenchTrace(const char* filter) {
+  if (!Selected(filter, "trace/replay")) {
+    return 0;
+  }
+  const std::string path = "/tmp/smctemp_bench.trace";
+  const int samples = 500;
+  auto run = [&](std::unique_ptr<smctemp::SmcTransport> transport, std::vector<double>& temps,
+                 std::vector<uint32_t>& attempts) {
+    smctemp::SmcTemp smc_temp(false, std::move(transport));
+    smc_temp.SetRetry(180, std::chrono::nanoseconds(0));
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < samples; ++i) {
+      temps.push_back(smc_temp.GetCpuTemp());
+      attempts.push_back(smc_temp.LastSampleStats().attempts);
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / samples;
+  };
+
+  std::vector<double> recorded;
+  std::vector<uint32_t> recorded_attempts;
+  uint64_t records = 0;
+  double simulated_ns;
+  {
+    auto smc = MakeSimulatedSmc();
+    smc->SetZeroReadRate(0.9);
+    auto recording = std::make_unique<smctemp::RecordingSmcTransport>(std::move(smc), path);
+    smctemp::RecordingSmcTransport* recorder = recording.get();
+    simulated_ns = run(std::move(recording), recorded, recorded_attempts);
+    records = recorder->Records();
+  }
+  struct stat st;
+  const off_t file_size = stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+
+  std::vector<double> replayed;
+  std::vector<uint32_t> replayed_attempts;
+  const double replay_ns = run(std::make_unique<smctemp::ReplaySmcTransport>(path), replayed, replayed_attempts);
+  double attempts = 0.0;
+  for (uint32_t n : recorded_attempts) {
+    attempts += n;
+  }
+
+  // 20 samples 5 ms apart, replayed at recorded speed.
+  {
+    smctemp::SmcTemp smc_temp(false, std::make_unique<smctemp::RecordingSmcTransport>(MakeSimulatedSmc(), path));
+    const int64_t start_ns = smctemp::MonotonicNs();
+    for (int i = 0; i < 20; ++i) {
+      smctemp::SleepUntil(start_ns + i * 5'000'000);
+      g_sink = smc_temp.GetCpuTemp();
+    }
+  }
+  const auto paced_start = std::chrono::steady_clock::now();
+  {
+    smctemp::SmcTemp smc_temp(
+      false, std::make_unique<smctemp::ReplaySmcTransport>(path, smctemp::ReplaySmcTransport::kRecorded));
+    for (int i = 0; i < 20; ++i) {
+      g_sink = smc_temp.GetCpuTemp();
+    }
+  }
+  const double paced_ms =
+    std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - paced_start).count();
+  unlink(path.c_str());
+
+  printf("%-28s %llu records, %.0f bytes each  %.1f attempts/sample  simulated %8.1f ns  replay %8.1f ns"
+         "  recorded speed %.0f ms of 95\n", "trace/replay", static_cast<unsigned long long>(records),
+         records > 0 ? static_cast<double>(file_size - sizeof(smctemp::SmcTraceHeader_t)) / records : 0.0,
+         attempts / samples, simulated_ns, replay_ns, paced_ms);
+  Report("trace/replay", "simulated", simulated_ns, "ns/sample");
+  Report("trace/replay", "replay", replay_ns, "ns/sample");
+  Report("trace/replay", "recorded_speed", paced_ms, "ms");
+  int failures = 0;
+  if (replayed != recorded || replayed_attempts != recorded_attempts) {
+    std::cerr << "trace/replay: the replay did not reproduce the recorded samples" << std::endl;
+    failures++;
+  }
+  if (paced_ms < 90.0) {
+    std::cerr << "trace/replay: the replay ran ahead of the recorded timing" << std::endl;
+    failures++;
+  }
+  return failures;
+}
+
+// GetCpuTemp() on the simulated SMC with metrics off and on, run in turns so
+// that both see the same machine state. With metrics on, the call counts and
+// the number of timed calls must agree with the simulated SMC's own call counts, the sampling
+// path must still not allocate, and an absent key must show up in the
+// per-key failures. The histogram's percentiles are checked against exact
+// ones over a log-uniform spread of latencies.
+int BenchMetrics(const char* filter) {
+  if (!Selected(filter, "metrics/overhead")) {
+    return 0;
+  }
+  const ScopedCpuModel m5("Apple M5");
+  const smctemp::ChipSensors_t* chip = smctemp::DetectChipSensors();
+  if (chip == nullptr) {
+    return 0;
+  }
+  const uint64_t iterations = 50'000;
+  int failures = 0;
+
+  smctemp::SmcTemp plain(false, MakeSimulatedSmc());
+  auto smc = MakeSimulatedSmc();
+  smctemp::SimulatedSmcTransport* sim = smc.get();
+  smctemp::SmcTemp instrumented(false, std::move(smc));
+  instrumented.EnableMetrics();
+  const smctemp::SmcMetrics& metrics = *instrumented.Metrics();
+  g_sink = plain.GetCpuTemp();
+  g_sink = instrumented.GetCpuTemp();
+  sim->ResetCallCounts();
+  const uint64_t key_info_calls = metrics.keyInfoCalls.calls.load();
+  const uint64_t read_calls = metrics.readCalls.calls.load();
+  const uint64_t samples = metrics.samples.Count();
+
+  double off_ns = 0.0, on_ns = 0.0;
+  uint64_t allocations = 0;
+  for (int round = 0; round < 4; ++round) {
+    const double off = MeasureNsPerOp(iterations, [&] { g_sink = plain.GetCpuTemp(); });
+    const uint64_t before = g_allocations.load();
+    const double on = MeasureNsPerOp(iterations, [&] { g_sink = instrumented.GetCpuTemp(); });
+    allocations += g_allocations.load() - before;
+    off_ns = round == 0 ? off : std::min(off_ns, off);
+    on_ns = round == 0 ? on : std::min(on_ns, on);
+  }
+  printf("%-28s off %7.1f ns/sample  on %7.1f ns/sample (%+.1f%%)  p50 %llu ns  p99 %llu ns\n",
+         "metrics/overhead", off_ns, on_ns, (on_ns / off_ns - 1.0) * 100.0,
+         static_cast<unsigned long long>(metrics.samples.PercentileNs(0.5)),
+         static_cast<unsigned long long>(metrics.samples.PercentileNs(0.99)));
+  Report("metrics/overhead", "off", off_ns, "ns/sample");
+  Report("metrics/overhead", "on", on_ns, "ns/sample");
+
+  // With metrics off, the hooks left in the read path are a branch per SMC
+  // call: SmcAccessor::Call against the transport's own Call, which has none.
+  smctemp::SmcAccessor accessor(MakeSimulatedSmc());
+  const std::unique_ptr<smctemp::SmcTransport> bare = MakeSimulatedSmc();
+  bare->Open();
+  smctemp::SmcKeyData_t input;
+  smctemp::SmcKeyData_t output;
+  memset(&input, 0, sizeof(input));
+  memset(&output, 0, sizeof(output));
+  input.key = chip->cpu.keys[0];
+  input.data8 = smctemp::kSmcCmdReadKeyInfo;
+  const uint64_t call_iterations = 1'000'000;
+  double bare_ns = 0.0, disabled_ns = 0.0;
+  for (int round = 0; round < 8; ++round) {
+    const double bare_call = MeasureNsPerOp(call_iterations, [&] {
+      g_sink = bare->Call(smctemp::kKernelIndexSmc, &input, &output);
+    });
+    const double disabled_call = MeasureNsPerOp(call_iterations, [&] {
+      g_sink = accessor.Call(smctemp::kKernelIndexSmc, &input, &output);
+    });
+    bare_ns = round == 0 ? bare_call : std::min(bare_ns, bare_call);
+    disabled_ns = round == 0 ? disabled_call : std::min(disabled_ns, disabled_call);
+  }
+  printf("%-28s bare %7.1f ns/call  off %7.1f ns/call (%+.1f ns)\n", "metrics/disabled", bare_ns, disabled_ns,
+         disabled_ns - bare_ns);
+  Report("metrics/disabled", "bare", bare_ns, "ns/call");
+  Report("metrics/disabled", "off", disabled_ns, "ns/call");
+  if (disabled_ns > bare_ns * 1.2 + 2.0) {
+    std::cerr << "metrics/disabled: SMC calls with metrics off cost more than a branch over the transport's"
+      << std::endl;
+    failures++;
+  }
+  if (allocations != 0) {
+    std::cerr << "metrics/overhead: sampling with metrics on allocated" << std::endl;
+    failures++;
+  }
+  if (metrics.samples.Count() - samples != 4 * iterations ||
+      metrics.readCalls.calls.load() - read_calls != sim->ReadBytesCalls() ||
+      metrics.keyInfoCalls.calls.load() - key_info_calls != sim->KeyInfoCalls() ||
+      metrics.keyInfoMisses.load() != metrics.keyInfoCalls.calls.load() ||
+      metrics.readCalls.latency.Count() !=
+        (metrics.readCalls.calls.load() + smctemp::SmcCallMetrics::kTimingPeriod - 1) /
+        smctemp::SmcCallMetrics::kTimingPeriod) {
+    std::cerr << "metrics/overhead: counts disagree with the simulated SMC" << std::endl;
+    failures++;
+  }
+
+  smctemp::UInt32Char_t key;
+  smctemp::string_util::ultostr(key, sizeof(key), chip->cpu.keys[0]);
+  sim->RemoveKey(key);
+  for (int i = 0; i < 100; ++i) {
+    g_sink = instrumented.GetCpuTemp();
+  }
+  if (metrics.keyFailures.Get(chip->cpu.keys[0]) == 0 || metrics.keysNotFound.load() == 0 ||
+      metrics.invalidReadings.load() == 0) {
+    std::cerr << "metrics/overhead: the absent key " << key << " was not counted" << std::endl;
+    failures++;
+  }
+
+  auto histogram = std::make_unique<smctemp::LatencyHistogram>();
+  std::vector<uint64_t> latencies(100'000);
+  uint32_t rng = 1;
+  for (uint64_t& latency : latencies) {
+    rng = rng * 1664525u + 1013904223u;
+    latency = static_cast<uint64_t>(std::exp((rng >> 8) / static_cast<double>(1u << 24) * std::log(1e9)));
+    histogram->Record(static_cast<int64_t>(latency));
+  }
+  std::sort(latencies.begin(), latencies.end());
+  for (double q : {0.5, 0.9, 0.99, 0.999}) {
+    const uint64_t exact = latencies[static_cast<size_t>(std::ceil(q * latencies.size())) - 1];
+    const uint64_t estimate = histogram->PercentileNs(q);
+    if (estimate < exact || estimate > exact + exact / 16) {
+      std::cerr << "metrics/overhead: p" << q * 100 << " is " << estimate << " ns, exact " << exact << " ns"
+        << std::endl;
+      failures++;
+    }
+  }
+  return failures;
+}
+
+// Everything written to fd since it was created, which must be a file.
+std::string ReadFile(int fd) {
+  std::string contents;
+  char buffer[1 << 16];
+  ssize_t size;
+  lseek(fd, 0, SEEK_SET);
+  while ((size = read(fd, buffer, sizeof(buffer))) > 0) {
+    contents.append(buffer, size);
+  }
+  return contents;
+}
+
+// One sample of three fields in each --format, written by SampleFormatter to
+// /dev/null and, as a baseline, by an ostringstream the way JSON lines would
+// be built with iostreams. A sample must not allocate and must be a single
+// write: over a datagram socket, every write(2) is one datagram. The lines
+// are checked against the exact output, AppendFixed against snprintf, and -l
+// of 1500 keys is timed in each format.
+int BenchFormat(const char* filter) {
+  if (!Selected(filter, "output/formats")) {
+    return 0;
+  }
+  using smctemp::OutputFormat;
+  const int64_t time_ns = 1'700'000'000'000'000'000;
+  const smctemp::OutputField_t fields[] = {{"cpu", 64.3, false}, {"gpu", 36.5, false}, {"Tp01", 63.8125, true}};
+  // The first sample and every later one, which CSV and Prometheus print
+  // without their header.
+  const struct {
+    OutputFormat format;
+    const char* first;
+    const char* later;
+  } cases[] = {
+    {OutputFormat::kText, "64.3 36.5 63.8\n", "64.3 36.5 63.8\n"},
+    {OutputFormat::kJsonLines, "{\"time_ns\":1700000000000000000,\"cpu\":64.3,\"gpu\":36.5,\"Tp01\":63.8125}\n",
+     "{\"time_ns\":1700000000000000000,\"cpu\":64.3,\"gpu\":36.5,\"Tp01\":63.8125}\n"},
+    {OutputFormat::kCsv, "time_ns,cpu,gpu,Tp01\n1700000000000000000,64.3,36.5,63.8125\n",
+     "1700000000000000000,64.3,36.5,63.8125\n"},
+    {OutputFormat::kInflux, "smctemp cpu=64.3,gpu=36.5,Tp01=63.8125 1700000000000000000\n",
+     "smctemp cpu=64.3,gpu=36.5,Tp01=63.8125 1700000000000000000\n"},
+    {OutputFormat::kPrometheus, "# TYPE smctemp_cpu_celsius gauge\nsmctemp_cpu_celsius 64.3\n"
+      "# TYPE smctemp_gpu_celsius gauge\nsmctemp_gpu_celsius 36.5\n"
+      "# TYPE smctemp_key_value gauge\nsmctemp_key_value{key=\"Tp01\"} 63.8125\n",
+     "smctemp_cpu_celsius 64.3\nsmctemp_gpu_celsius 36.5\nsmctemp_key_value{key=\"Tp01\"} 63.8125\n"},
+  };
+  const uint64_t iterations = 200'000;
+  const int samples = 100;
+  int failures = 0;
+  const int null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd < 0) {
+    std::cerr << "output/formats: failed to open /dev/null" << std::endl;
+    return 1;
+  }
+
+  for (const auto& c : cases) {
+    const std::string name = std::string("output/") + smctemp::OutputFormatName(c.format);
+    smctemp::SampleFormatter null_formatter(null_fd, c.format);
+    const uint64_t before = g_allocations.load();
+    const double ns = MeasureNsPerOp(iterations, [&] { null_formatter.Write(time_ns, fields, 3); });
+    const uint64_t allocations = g_allocations.load() - before;
+
+    // Datagrams are read as they come, so a small socket buffer never fills.
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) != 0) {
+      std::cerr << name << ": socketpair failed" << std::endl;
+      failures++;
+      continue;
+    }
+    std::string first, later;
+    int datagrams = 0;
+    {
+      smctemp::SampleFormatter formatter(sockets[0], c.format);
+      char buffer[4096];
+      for (int i = 0; i < samples; ++i) {
+        formatter.Write(time_ns, fields, 3);
+        ssize_t size;
+        while ((size = recv(sockets[1], buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+          (datagrams++ == 0 ? first : later).assign(buffer, size);
+        }
+      }
+    }
+    close(sockets[0]);
+    close(sockets[1]);
+
+    printf("%-28s %7.1f ns/sample  %llu allocations  %d writes for %d samples\n", name.c_str(), ns,
+           static_cast<unsigned long long>(allocations), datagrams, samples);
+    Report(name, "format", ns, "ns/sample");
+    Report(name, "allocations", allocations, "count");
+    if (allocations != 0) {
+      std::cerr << name << ": formatting a sample allocated" << std::endl;
+      failures++;
+    }
+    if (datagrams != samples) {
+      std::cerr << name << ": " << datagrams << " writes for " << samples << " samples" << std::endl;
+      failures++;
+    }
+    if (first != c.first || later != c.later) {
+      std::cerr << name << ": printed\n" << first << later << "expected\n" << c.first << c.later;
+      failures++;
+    }
+  }
+
+  {
+    const double ns = MeasureNsPerOp(iterations, [&] {
+      std::ostringstream out;
+      out << "{\"time_ns\":" << time_ns;
+      for (const smctemp::OutputField_t& field : fields) {
+        out << ",\"" << field.name << "\":" << field.value;
+      }
+      out << "}\n";
+      const std::string str = out.str();
+      g_sink = write(null_fd, str.data(), str.size());
+    });
+    printf("%-28s %7.1f ns/sample\n", "output/ostringstream", ns);
+    Report("output/ostringstream", "format", ns, "ns/sample");
+  }
+  close(null_fd);
+
+  // AppendFixed has to print what printf("%.1f") and printf("%.3f") did.
+  char path[] = "/tmp/smctemp_bench_format.XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    std::cerr << "output/formats: failed to create " << path << std::endl;
+    return failures + 1;
+  }
+  unlink(path);
+  std::vector<double> values;
+  uint32_t rng = 1;
+  for (int i = 0; i < 20'000; ++i) {
+    rng = rng * 1664525u + 1013904223u;
+    values.push_back((static_cast<int32_t>(rng) >> 8) / 1024.0);
+  }
+  for (double value : {0.0, -0.0, 0.05, 0.15, 0.25, 0.35, 64.25, 99.95, -12.25, 1e20, 123456.789}) {
+    values.push_back(value);
+  }
+  std::string expected;
+  {
+    smctemp::BufferedWriter out(fd);
+    char buffer[64];
+    for (double value : values) {
+      for (int precision : {1, 3}) {
+        out.AppendFixed(value, precision);
+        out.Append('\n');
+        snprintf(buffer, sizeof(buffer), "%.*f\n", precision, value);
+        expected += buffer;
+      }
+    }
+  }
+  if (ReadFile(fd) != expected) {
+    std::cerr << "output/formats: AppendFixed differs from snprintf" << std::endl;
+    failures++;
+  }
+  close(fd);
+
+  auto smc = MakeSimulatedSmc();
+  smctemp::SimulatedSmcTransport* sim = smc.get();
+  for (uint32_t key : SyntheticKeys(1500)) {
+    char name[5];
+    smctemp::string_util::ultostr(name, sizeof(name), key);
+    sim->SetTemperature(name, 40.0 + key % 50);
+  }
+  const uint64_t keys = sim->KeyCount();
+  smctemp::SmcAccessor accessor(std::move(smc));
+  for (const auto& c : cases) {
+    const std::string name = std::string("output/list_") + smctemp::OutputFormatName(c.format);
+    char list_path[] = "/tmp/smctemp_bench_format.XXXXXX";
+    const int list_fd = mkstemp(list_path);
+    if (list_fd < 0) {
+      std::cerr << name << ": failed to create " << list_path << std::endl;
+      return failures + 1;
+    }
+    unlink(list_path);
+    const auto start = std::chrono::steady_clock::now();
+    accessor.PrintAll(list_fd, smctemp::SmcKeyFilter(), false, c.format);
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    const std::string listing = ReadFile(list_fd);
+    close(list_fd);
+    const uint64_t lines = std::count(listing.begin(), listing.end(), '\n');
+    printf("%-28s %llu lines  %.2f ms\n", name.c_str(), static_cast<unsigned long long>(lines), ms);
+    Report(name, "time", ms, "ms");
+    const bool header = c.format == OutputFormat::kCsv || c.format == OutputFormat::kPrometheus;
+    if (lines != keys + (header ? 1 : 0)) {
+      std::cerr << name << ": " << lines << " lines for " << keys << " keys" << std::endl;
+      failures++;
+    }
+  }
+  return failures;
+}
+
+// Ten minutes of a synthetic 1 kHz temperature, a slow swing plus noise, fed
+// to one series and, with 18 sensors, to a whole TemperatureStats. The
+// window statistics, quantiles included, are checked against a brute-force
+// pass over the last minute.
+int BenchStats(const char* filter) {
+  if (!Selected(filter, "stats/1khz")) {
+    return 0;
+  }
+  const int64_t period_ns = 1'000'000;
+  const size_t samples = 600'000;
+  const smctemp::StatsConfig_t config = {std::chrono::seconds(60), 60'001, std::chrono::seconds(6)};
+  std::vector<double> values(samples);
+  uint32_t rng = 1;
+  for (size_t i = 0; i < samples; ++i) {
+    rng = rng * 1664525u + 1013904223u;
+    const double noise = (rng >> 8) / static_cast<double>(1u << 24) * 2.0 - 1.0;
+    values[i] = 60.0 + 10.0 * std::sin(i * period_ns * 2.0 * M_PI / 120e9) + noise;
+  }
+
+  smctemp::SeriesStats series(config);
+  const uint64_t before = g_allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < samples; ++i) {
+    series.Add(i * period_ns, values[i]);
+  }
+  const double series_ns =
+    std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / samples;
+  uint64_t allocations = g_allocations.load() - before;
+
+  const size_t sensor_count = 18;
+  std::vector<uint32_t> keys;
+  for (uint32_t k = 0; k < sensor_count; ++k) {
+    keys.push_back(smctemp::FourCC("Tp00") + k);
+  }
+  smctemp::TemperatureStats stats(config, keys);
+  const uint64_t stats_before = g_allocations.load();
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < samples; ++i) {
+    const int64_t now_ns = i * period_ns;
+    stats.Cpu().Add(now_ns, values[i]);
+    for (uint32_t key : keys) {
+      stats.Sensor(key)->Add(now_ns, values[i]);
+    }
+  }
+  const double stats_ns =
+    std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / samples;
+  allocations += g_allocations.load() - stats_before;
+
+  const int64_t now_ns = (samples - 1) * period_ns;
+  const smctemp::StatsSnapshot_t snapshot = series.Snapshot(now_ns);
+  const size_t window = 60'000;
+  double min = values[samples - window], max = min, sum = 0.0;
+  for (size_t i = samples - window; i < samples; ++i) {
+    min = std::min(min, values[i]);
+    max = std::max(max, values[i]);
+    sum += values[i];
+  }
+  std::vector<double> sorted(values.end() - window, values.end());
+  std::sort(sorted.begin(), sorted.end());
+  const double p95 = sorted[static_cast<size_t>(std::ceil(0.95 * window)) - 1];
+  const double p99 = sorted[static_cast<size_t>(std::ceil(0.99 * window)) - 1];
+  printf("%-28s series %6.1f ns/sample  cpu + %zu sensors %7.1f ns/sample  p95 %.2f (exact %.2f)"
+         "  p99 %.2f (exact %.2f)\n", "stats/1khz", series_ns, sensor_count, stats_ns, snapshot.p95, p95,
+         snapshot.p99, p99);
+  Report("stats/1khz", "series", series_ns, "ns/sample");
+  Report("stats/1khz", "cpu_and_sensors", stats_ns, "ns/sample");
+
+  int failures = 0;
+  if (snapshot.count != window || snapshot.min != min || snapshot.max != max ||
+      std::fabs(snapshot.mean - sum / window) > 1e-9) {
+    std::cerr << "stats/1khz: window statistics disagree with a brute-force pass" << std::endl;
+    failures++;
+  }
+  if (std::fabs(snapshot.p95 - p95) > 1.0 / 64 || std::fabs(snapshot.p99 - p99) > 1.0 / 64) {
+    std::cerr << "stats/1khz: window quantiles are off by more than 1/64 degree" << std::endl;
+    failures++;
+  }
+  if (allocations != 0) {
+    std::cerr << "stats/1khz: updates allocated" << std::endl;
+    failures++;
+  }
+  return failures;
+}
+
+// An event loop ticking every millisecond asks for the CPU temperature every
+// 50 ticks while the SMC answers in 2 ms and no read is ever valid, so each
+// request makes 3 attempts 20 ms apart as -n3 -i20 would. Reported is how
+// late the ticks run when the reads are made inline and through
+// AsyncSmcReader.
+int BenchAsync(const char* filter) {
+  if (!Selected(filter, "async/event_loop")) {
+    return 0;
+  }
+  const int64_t tick_ns = 1'000'000;
+  const int64_t duration_ns = 400'000'000;
+  auto make_smc = [] {
+    auto smc = std::make_unique<smctemp::SimulatedSmcTransport>();
+    smc->SetLatency(std::chrono::milliseconds(2));
+    return smc;
+  };
+  struct LoopStats {
+    int64_t maxLateNs = 0;
+    uint64_t completed = 0;
+  };
+  // on_tick runs on every tick; wait_until returns at the given deadline.
+  auto run_loop = [&](LoopStats& stats, auto&& on_tick, auto&& wait_until) {
+    const int64_t start = smctemp::MonotonicNs();
+    uint64_t tick = 0;
+    for (int64_t next = start; next < start + duration_ns; next += tick_ns, ++tick) {
+      wait_until(next);
+      stats.maxLateNs = std::max(stats.maxLateNs, smctemp::MonotonicNs() - next);
+      on_tick(tick);
+    }
+  };
+
+  LoopStats inline_stats;
+  {
+    smctemp::SmcTemp smc_temp(false, make_smc());
+    const std::pair<unsigned int, unsigned int>& limits = smctemp::kValidTemperatureLimits;
+    run_loop(inline_stats, [&](uint64_t tick) {
+      if (tick % 50 != 0) {
+        return;
+      }
+      for (int attempt = 0; attempt < 3; ++attempt) {
+        if (smc_temp.IsValidTemperature(smc_temp.GetCpuTemp(), limits)) {
+          break;
+        }
+        if (attempt < 2) {
+          smctemp::SleepUntil(smctemp::MonotonicNs() + 20'000'000);
+        }
+      }
+      inline_stats.completed++;
+    }, [](int64_t deadline_ns) { smctemp::SleepUntil(deadline_ns); });
+  }
+
+  LoopStats async_stats;
+  {
+    smctemp::AsyncSmcReader reader(make_smc());
+    const smctemp::AsyncRequest_t request = {
+      smctemp::kAsyncReadCpu, 0, 3, 20,
+      [](const smctemp::AsyncResult_t& result, void* context) {
+        static_cast<LoopStats*>(context)->completed += result.attempts == 3 ? 1 : 0;
+      },
+      &async_stats,
+    };
+    run_loop(async_stats, [&](uint64_t tick) {
+      if (tick % 50 == 0) {
+        reader.Submit(request);
+      }
+    }, [&](int64_t deadline_ns) {
+      for (;;) {
+        const int64_t remaining_ns = deadline_ns - smctemp::MonotonicNs();
+        if (remaining_ns <= 0) {
+          return;
+        }
+        pollfd fd = {reader.NotifyFd(), POLLIN, 0};
+        if (poll(&fd, 1, static_cast<int>(remaining_ns / 1'000'000)) > 0) {
+          reader.Dispatch();
+        } else {
+          smctemp::SleepUntil(deadline_ns);
+        }
+      }
+    });
+    // Collect what was still in flight when the loop ended.
+    const int64_t drain_deadline = smctemp::MonotonicNs() + 200'000'000;
+    while (async_stats.completed < inline_stats.completed && smctemp::MonotonicNs() < drain_deadline) {
+      pollfd fd = {reader.NotifyFd(), POLLIN, 0};
+      if (poll(&fd, 1, 10) > 0) {
+        reader.Dispatch();
+      }
+    }
+  }
+
+  printf("%-28s inline: %llu reads, ticks up to %.2f ms late  async: %llu reads, ticks up to %.2f ms late\n",
+         "async/event_loop", static_cast<unsigned long long>(inline_stats.completed), inline_stats.maxLateNs / 1e6,
+         static_cast<unsigned long long>(async_stats.completed), async_stats.maxLateNs / 1e6);
+  Report("async/event_loop", "inline_max_late", inline_stats.maxLateNs / 1e6, "ms");
+  Report("async/event_loop", "async_max_late", async_stats.maxLateNs / 1e6, "ms");
+  if (async_stats.completed == 0 || async_stats.maxLateNs * 2 > inline_stats.maxLateNs) {
+    std::cerr << "async/event_loop: reads through AsyncSmcReader still delayed the loop" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Destroying an AsyncSmcReader while requests wait out their retries must
+// not wait for those retries.
+int BenchAsyncShutdown(const char* filter) {
+  if (!Selected(filter, "async/shutdown")) {
+    return 0;
+  }
+  // No sensor keys, so every read is invalid and is retried.
+  auto reader = std::make_unique<smctemp::AsyncSmcReader>(std::make_unique<smctemp::SimulatedSmcTransport>());
+  const smctemp::AsyncRequest_t request = {smctemp::kAsyncReadCpu, 0, 1'000, 200, nullptr, nullptr};
+  for (int i = 0; i < 4; ++i) {
+    reader->Submit(request);
+  }
+  smctemp::SleepUntil(smctemp::MonotonicNs() + 10'000'000);
+  const int64_t start_ns = smctemp::MonotonicNs();
+  reader.reset();
+  const double ms = (smctemp::MonotonicNs() - start_ns) / 1e6;
+  printf("%-28s %.2f ms with 4 requests retrying every 200 ms\n", "async/shutdown", ms);
+  Report("async/shutdown", "destroy", ms, "ms");
+  if (ms > 50.0) {
+    std::cerr << "async/shutdown: the destructor waited for the retries" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Concurrent writers publish samples whose every field is derived from one
+// counter; readers flag any snapshot mixing two samples. A writer restarted
+// over a segment left mid-publish must take it over rather than hang, and a
+// sample must go stale once its daemon stops publishing.
+int BenchSharedSample(const char* filter) {
+  if (!Selected(filter, "shm/seqlock_stress")) {
+    return 0;
+  }
+  const std::string name = "/smctemp_bench." + std::to_string(getpid());
+  smctemp::SharedSampleWriter writer(name);
+  smctemp::SharedSampleReader reader(name);
+  writer.Unlink();
+  if (!writer.IsOpen() || !reader.IsOpen()) {
+    std::cerr << "shm/seqlock_stress: failed to map " << name << std::endl;
+    return 1;
+  }
+
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> next{1};
+  std::atomic<uint64_t> reads{0};
+  std::atomic<uint64_t> torn{0};
+  std::vector<std::thread> threads;
+  for (int w = 0; w < 2; ++w) {
+    threads.emplace_back([&] {
+      smctemp::SharedSample_t sample;
+      while (!stop.load(std::memory_order_relaxed)) {
+        const uint64_t n = next.fetch_add(1, std::memory_order_relaxed);
+        sample.timestampNs = n;
+        sample.sequence = n;
+        sample.cpu = sample.gpu = static_cast<double>(n);
+        sample.flags = static_cast<uint32_t>(n);
+        sample.sensorCount = static_cast<uint32_t>(n);
+        sample.validMask = n;
+        for (size_t i = 0; i < smctemp::kSharedSampleMaxSensors; ++i) {
+          sample.keys[i] = static_cast<uint32_t>(n);
+          sample.values[i] = static_cast<double>(n);
+        }
+        writer.Publish(sample);
+      }
+    });
+  }
+  const auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < 2; ++r) {
+    threads.emplace_back([&] {
+      smctemp::SharedSample_t sample;
+      while (!stop.load(std::memory_order_relaxed)) {
+        if (!reader.Read(sample)) {
+          continue;
+        }
+        const uint64_t n = sample.sequence;
+        bool ok = static_cast<uint64_t>(sample.timestampNs) == n && sample.cpu == n && sample.gpu == n &&
+                  sample.flags == static_cast<uint32_t>(n) && sample.validMask == n;
+        for (size_t i = 0; i < smctemp::kSharedSampleMaxSensors; ++i) {
+          ok = ok && sample.keys[i] == static_cast<uint32_t>(n) && sample.values[i] == n;
+        }
+        reads.fetch_add(1, std::memory_order_relaxed);
+        if (!ok) {
+          torn.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  stop.store(true);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%-28s %llu writes  %llu reads  %llu torn  (%.0f reads/s)\n", "shm/seqlock_stress",
+         static_cast<unsigned long long>(next.load() - 1), static_cast<unsigned long long>(reads.load()),
+         static_cast<unsigned long long>(torn.load()), reads.load() / seconds);
+  Report("shm/seqlock_stress", "torn", torn.load(), "count");
+  Report("shm/seqlock_stress", "reads", reads.load() / seconds, "reads/s");
+
+  smctemp::SharedSample_t sample;
+  const double read_ns = MeasureNsPerOp(1'000'000, [&] { g_sink = reader.Read(sample); });
+  printf("%-28s %10.1f ns/read (uncontended)\n", "shm/read", read_ns);
+  Report("shm/read", "time", read_ns, "ns/read");
+  int failures = torn.load() == 0 ? 0 : 1;
+
+  const std::string crashed_name = name + ".crashed";
+  {
+    smctemp::SharedSampleWriter crashed(crashed_name);
+    const int fd = shm_open(crashed_name.c_str(), O_RDWR, 0);
+    void* map = fd < 0 ? MAP_FAILED
+                       : mmap(nullptr, sizeof(smctemp::SharedSampleSegment), PROT_READ | PROT_WRITE, MAP_SHARED,
+                              fd, 0);
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (!crashed.IsOpen() || map == MAP_FAILED) {
+      std::cerr << "shm/seqlock_stress: failed to map " << crashed_name << std::endl;
+      crashed.Unlink();
+      return failures + 1;
+    }
+    static_cast<smctemp::SharedSampleSegment*>(map)->sequence.fetch_add(1);
+    munmap(map, sizeof(smctemp::SharedSampleSegment));
+  }
+  smctemp::SharedSampleWriter restarted(crashed_name);
+  smctemp::SharedSampleReader crashed_reader(crashed_name);
+  restarted.Unlink();
+  sample.timestampNs = 42;
+  const auto takeover_start = std::chrono::steady_clock::now();
+  restarted.Publish(sample);
+  const double takeover_ms =
+    std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - takeover_start).count();
+  printf("%-28s %10.2f ms\n", "shm/takeover", takeover_ms);
+  Report("shm/takeover", "time", takeover_ms, "ms");
+  if (!crashed_reader.Read(sample) || sample.timestampNs != 42) {
+    std::cerr << "shm/takeover: the restarted writer's sample was not readable" << std::endl;
+    failures++;
+  }
+
+  // A client must stop trusting the segment of a daemon that is gone.
+  const int64_t now_ns = smctemp::RealtimeNs();
+  sample.periodNs = 2'000'000'000;
+  sample.timestampNs = now_ns - 5'000'000'000;
+  const bool recent_current = smctemp::IsSharedSampleCurrent(sample, now_ns);
+  sample.timestampNs = now_ns - 7'000'000'000;
+  if (!recent_current || smctemp::IsSharedSampleCurrent(sample, now_ns)) {
+    std::cerr << "shm/stale: a sample 3 periods old is not cut off" << std::endl;
+    failures++;
+  }
+  return failures;
+}
+
+// The results as one JSON object, for tracking them across releases.
+bool WriteJson(FILE* out, int failures) {
+#if defined(ARCH_TYPE_X86_64)
+  const char* arch = "x86_64";
+#else
+  const char* arch = "arm64";
+#endif
+  fprintf(out, "{\"version\": \"%s\", \"arch\": \"%s\", \"failures\": %d, \"results\": [", smctemp::kVersion, arch,
+          failures);
+  for (size_t i = 0; i < g_results.size(); ++i) {
+    const BenchResult& result = g_results[i];
+    fprintf(out, "%s\n  {\"name\": \"%s\", \"metric\": \"%s\", \"value\": ", i > 0 ? "," : "",
+            result.name.c_str(), result.metric.c_str());
+    if (std::isfinite(result.value)) {
+      fprintf(out, "%.9g", result.value);
+    } else {
+      fprintf(out, "null");
+    }
+    fprintf(out, ", \"unit\": \"%s\"}", result.unit.c_str());
+  }
+  fprintf(out, "\n]}\n");
+  return fclose(out) == 0;
+}
+}
+
+int main(int argc, char *argv[]) {
+  const char* filter = nullptr;
+  const char* json_path = nullptr;
+  bool json = false;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (strncmp(argv[i], "--json=", 7) == 0) {
+      json = true;
+      json_path = argv[i] + 7;
+    } else {
+      filter = argv[i];
+    }
+  }
+  // With the JSON going to stdout, the human-readable lines go to stderr.
+  int json_fd = -1;
+  if (json && json_path == nullptr) {
+    fflush(stdout);
+    json_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+  }
+
+  int failures = 0;
+  failures += BenchDecode(filter);
+  failures += BenchFourCC(filter);
+  failures += BenchSample(filter);
+  failures += BenchChips(filter);
+  failures += BenchKeyInfoCache(filter);
+  failures += BenchColdStart(filter);
+  failures += BenchListing(filter);
+  failures += BenchRetry(filter);
+  failures += BenchHealth(filter);
+  failures += BenchManifest(filter);
+  failures += BenchFailSoftStore(filter);
+  failures += BenchStats(filter);
+  failures += BenchAggregate(filter);
+  failures += BenchAdaptive(filter);
+  failures += BenchTrace(filter);
+  failures += BenchMetrics(filter);
+  failures += BenchFormat(filter);
+  failures += BenchAsync(filter);
+  failures += BenchAsyncShutdown(filter);
+  failures += BenchSharedSample(filter);
+
+  if (json) {
+    fflush(stdout);
+    FILE* out = json_path != nullptr ? fopen(json_path, "w") : fdopen(json_fd, "w");
+    if (out == nullptr || !WriteJson(out, failures)) {
+      std::cerr << "Failed to write the JSON report" << std::endl;
+      return 1;
+    }
+  }
+  return failures == 0 ? 0 : 1;
+}
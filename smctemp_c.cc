@@ -0,0 +1,77 @@
+#include "smctemp_c.h"
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "smctemp.h"
+
+struct smctemp_smc {
+  explicit smctemp_smc(std::unique_ptr<smctemp::SmcTransport> transport) : accessor(std::move(transport)) {}
+  smctemp::SmcAccessor accessor;
+};
+
+static_assert(sizeof(smctemp_handle) == sizeof(smctemp::SmcSensorHandle_t) &&
+              offsetof(smctemp_handle, key) == offsetof(smctemp::SmcSensorHandle_t, key) &&
+              offsetof(smctemp_handle, data_size) == offsetof(smctemp::SmcSensorHandle_t, dataSize) &&
+              offsetof(smctemp_handle, decode) == offsetof(smctemp::SmcSensorHandle_t, decode) &&
+              offsetof(smctemp_handle, scale) == offsetof(smctemp::SmcSensorHandle_t, scale),
+              "smctemp_handle must mirror SmcSensorHandle_t");
+
+static_assert(std::is_same<int32_t, kern_return_t>::value, "results are kern_return_t");
+
+namespace {
+smctemp::SmcSensorHandle_t toHandle(const smctemp_handle& handle) {
+  smctemp::SmcSensorHandle_t resolved;
+  memcpy(&resolved, &handle, sizeof(resolved));
+  return resolved;
+}
+}
+
+smctemp_smc* smctemp_open(void) {
+  smctemp_smc* smc = new (std::nothrow) smctemp_smc(smctemp::MakeDefaultSmcTransport());
+  if (smc != nullptr && !smc->accessor.IsOpen()) {
+    delete smc;
+    return nullptr;
+  }
+  return smc;
+}
+
+void smctemp_close(smctemp_smc* smc) {
+  delete smc;
+}
+
+int32_t smctemp_resolve(smctemp_smc* smc, const char* key, smctemp_handle* handle) {
+  if (smc == nullptr || key == nullptr || handle == nullptr || strnlen(key, 5) != 4) {
+    return kIOReturnBadArgument;
+  }
+  smctemp::SmcSensorHandle_t resolved;
+  kern_return_t result = smc->accessor.Resolve(smctemp::string_util::strtoul(key, 4, 16), resolved);
+  if (result == kIOReturnSuccess) {
+    memcpy(handle, &resolved, sizeof(resolved));
+  }
+  return result;
+}
+
+int32_t smctemp_read(smctemp_smc* smc, const smctemp_handle* handle, double* value) {
+  if (smc == nullptr || handle == nullptr || value == nullptr) {
+    return kIOReturnBadArgument;
+  }
+  return smc->accessor.Read(toHandle(*handle), *value);
+}
+
+void smctemp_read_many(smctemp_smc* smc, const smctemp_handle* handles, size_t count, double* values,
+                       int32_t* results) {
+  if (smc == nullptr) {
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    kern_return_t result = smc->accessor.Read(toHandle(handles[i]), values[i]);
+    if (results != nullptr) {
+      results[i] = result;
+    }
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef SMCTEMP_SMCTEMP_C_H_
+#define SMCTEMP_SMCTEMP_C_H_
+/*
+ * C interface to the handle API of SmcAccessor, for callers that load
+ * libsmctemp through an FFI. Functions returning int32_t return the
+ * kern_return_t of the call; 0 is success.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct smctemp_smc smctemp_smc;
+
+/* Filled by smctemp_resolve; treat as opaque. */
+typedef struct {
+  uint32_t key;
+  uint32_t data_size;
+  void*    decode;
+  double   scale;
+} smctemp_handle;
+
+/* Null if the SMC cannot be opened. */
+smctemp_smc* smctemp_open(void);
+void smctemp_close(smctemp_smc* smc);
+/* key is the four character code, e.g. "Tp01". */
+int32_t smctemp_resolve(smctemp_smc* smc, const char* key, smctemp_handle* handle);
+int32_t smctemp_read(smctemp_smc* smc, const smctemp_handle* handle, double* value);
+/* results may be null. Values of failed reads are 0. */
+void smctemp_read_many(smctemp_smc* smc, const smctemp_handle* handles, size_t count, double* values,
+                       int32_t* results);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // #ifndef SMCTEMP_SMCTEMP_C_H_
@@ -0,0 +1,192 @@
+#include "smctemp_cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "smctemp_file.h"
+#include "smctemp_string.h"
+
+namespace smctemp {
+KeyInfoCache::Table::Table(size_t capacity) {
+  size_t bits = 1;
+  while ((size_t{1} << bits) < capacity) {
+    bits++;
+  }
+  shift = 32 - bits;
+  mask = (size_t{1} << bits) - 1;
+  slots = std::make_unique<Slot[]>(mask + 1);
+}
+
+KeyInfoCache::KeyInfoCache(size_t initial_capacity) {
+  tables_.push_back(std::make_unique<Table>(initial_capacity));
+  table_.store(tables_.back().get(), std::memory_order_release);
+}
+
+bool KeyInfoCache::Find(uint32_t key, SmcKeyData_keyInfo_t& key_info) const {
+  const Table* table = table_.load(std::memory_order_acquire);
+  for (size_t i = Home(*table, key);; i = (i + 1) & table->mask) {
+    const uint32_t slot_key = table->slots[i].key.load(std::memory_order_acquire);
+    if (slot_key == key) {
+      // keyInfo is written before the key is published and never changes.
+      key_info = table->slots[i].keyInfo;
+      return true;
+    }
+    if (slot_key == 0) {
+      return false;
+    }
+  }
+}
+
+void KeyInfoCache::Place(Table& table, uint32_t key, const SmcKeyData_keyInfo_t& key_info) {
+  size_t i = Home(table, key);
+  while (table.slots[i].key.load(std::memory_order_relaxed) != 0) {
+    i = (i + 1) & table.mask;
+  }
+  table.slots[i].keyInfo = key_info;
+  table.slots[i].key.store(key, std::memory_order_release);
+}
+
+void KeyInfoCache::Insert(uint32_t key, const SmcKeyData_keyInfo_t& key_info) {
+  if (key == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(writer_mutex_);
+  SmcKeyData_keyInfo_t existing;
+  if (Find(key, existing)) {
+    return;
+  }
+
+  Table* table = table_.load(std::memory_order_relaxed);
+  const size_t size = size_.load(std::memory_order_relaxed);
+  if ((size + 1) * 2 > table->mask + 1) {
+    auto grown = std::make_unique<Table>((table->mask + 1) * 2);
+    for (size_t i = 0; i <= table->mask; i++) {
+      const uint32_t slot_key = table->slots[i].key.load(std::memory_order_relaxed);
+      if (slot_key != 0) {
+        Place(*grown, slot_key, table->slots[i].keyInfo);
+      }
+    }
+    table = grown.get();
+    tables_.push_back(std::move(grown));
+    table_.store(table, std::memory_order_release);
+  }
+  Place(*table, key, key_info);
+  size_.store(size + 1, std::memory_order_relaxed);
+}
+
+std::vector<std::pair<uint32_t, SmcKeyData_keyInfo_t>> KeyInfoCache::Entries() const {
+  std::vector<std::pair<uint32_t, SmcKeyData_keyInfo_t>> entries;
+  const Table* table = table_.load(std::memory_order_acquire);
+  for (size_t i = 0; i <= table->mask; i++) {
+    const uint32_t key = table->slots[i].key.load(std::memory_order_acquire);
+    if (key != 0) {
+      entries.emplace_back(key, table->slots[i].keyInfo);
+    }
+  }
+  return entries;
+}
+
+namespace {
+constexpr uint32_t kKeyInfoCacheFileMagic = 0x534d4b43;  // "SMKC"
+constexpr uint32_t kKeyInfoCacheFileVersion = 1;
+}
+
+KeyInfoCacheFile::KeyInfoCacheFile(std::string path, const std::string& machine_model, uint32_t smc_key_count)
+    : path_(std::move(path)),
+      model_hash_(string_util::fnv1a(machine_model)),
+      smc_key_count_(smc_key_count) {
+}
+
+KeyInfoCacheFile::~KeyInfoCacheFile() {
+  Unmap();
+}
+
+void KeyInfoCacheFile::Unmap() {
+  if (map_ != nullptr) {
+    munmap(map_, map_size_);
+  }
+  map_ = nullptr;
+  map_size_ = 0;
+  entries_ = nullptr;
+  entry_count_ = 0;
+}
+
+bool KeyInfoCacheFile::Load() {
+  Unmap();
+  int fd = open(path_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Header))) {
+    close(fd);
+    return false;
+  }
+  void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  const Header* header = static_cast<const Header*>(map);
+  const size_t expected_size = sizeof(Header) + size_t{header->entryCount} * sizeof(Entry);
+  if (header->magic != kKeyInfoCacheFileMagic ||
+      header->version != kKeyInfoCacheFileVersion ||
+      header->modelHash != model_hash_ ||
+      header->smcKeyCount != smc_key_count_ ||
+      static_cast<size_t>(st.st_size) != expected_size) {
+    munmap(map, st.st_size);
+    return false;
+  }
+  map_ = map;
+  map_size_ = st.st_size;
+  entries_ = reinterpret_cast<const Entry*>(header + 1);
+  entry_count_ = header->entryCount;
+  return true;
+}
+
+bool KeyInfoCacheFile::Find(uint32_t key, SmcKeyData_keyInfo_t& key_info) const {
+  const Entry* end = entries_ + entry_count_;
+  const Entry* it = std::lower_bound(entries_, end, key,
+                                     [](const Entry& entry, uint32_t k) { return entry.key < k; });
+  if (it == end || it->key != key) {
+    return false;
+  }
+  key_info.dataSize = it->dataSize;
+  key_info.dataType = it->dataType;
+  key_info.dataAttributes = static_cast<char>(it->dataAttributes);
+  return true;
+}
+
+bool KeyInfoCacheFile::Save(const KeyInfoCache& cache) const {
+  std::vector<Entry> entries(entries_, entries_ + entry_count_);
+  for (const auto& [key, key_info] : cache.Entries()) {
+    entries.push_back({key, key_info.dataSize, key_info.dataType,
+                       static_cast<uint32_t>(static_cast<unsigned char>(key_info.dataAttributes))});
+  }
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const Entry& a, const Entry& b) { return a.key < b.key; });
+  entries.erase(std::unique(entries.begin(), entries.end(),
+                            [](const Entry& a, const Entry& b) { return a.key == b.key; }),
+                entries.end());
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kKeyInfoCacheFileMagic;
+  header.version = kKeyInfoCacheFileVersion;
+  header.modelHash = model_hash_;
+  header.smcKeyCount = smc_key_count_;
+  header.entryCount = static_cast<uint32_t>(entries.size());
+
+  const size_t entries_size = entries.size() * sizeof(Entry);
+  return ReplaceFile(path_, [&](int fd) {
+    return write(fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header)) &&
+           write(fd, entries.data(), entries_size) == static_cast<ssize_t>(entries_size);
+  });
+}
+}
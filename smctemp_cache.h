@@ -0,0 +1,98 @@
+#ifndef SMCTEMP_SMCTEMP_CACHE_H_
+#define SMCTEMP_SMCTEMP_CACHE_H_
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "smctemp_types.h"
+
+namespace smctemp {
+// Read-mostly cache of key info keyed by the fourcc. Lookups are lock-free
+// and may run concurrently with an insert; inserts are serialized by a mutex.
+// The open-addressing table doubles when it gets half full. Replaced tables
+// are kept until the cache is destroyed, so a reader still probing one of them
+// never touches freed memory.
+class KeyInfoCache {
+ private:
+  struct Slot {
+    std::atomic<uint32_t> key{0};
+    SmcKeyData_keyInfo_t keyInfo{};
+  };
+  struct Table {
+    explicit Table(size_t capacity);
+    size_t shift;
+    size_t mask;
+    std::unique_ptr<Slot[]> slots;
+  };
+  static size_t Home(const Table& table, uint32_t key) {
+    return static_cast<uint32_t>(key * 0x9E3779B1u) >> table.shift;
+  }
+  static void Place(Table& table, uint32_t key, const SmcKeyData_keyInfo_t& key_info);
+
+  std::atomic<Table*> table_;
+  std::vector<std::unique_ptr<Table>> tables_;
+  std::mutex writer_mutex_;
+  std::atomic<size_t> size_{0};
+
+ public:
+  explicit KeyInfoCache(size_t initial_capacity = 256);
+  KeyInfoCache(const KeyInfoCache&) = delete;
+  KeyInfoCache& operator=(const KeyInfoCache&) = delete;
+
+  bool Find(uint32_t key, SmcKeyData_keyInfo_t& key_info) const;
+  void Insert(uint32_t key, const SmcKeyData_keyInfo_t& key_info);
+  size_t Size() const { return size_.load(std::memory_order_relaxed); }
+  size_t Capacity() const { return table_.load(std::memory_order_acquire)->mask + 1; }
+  std::vector<std::pair<uint32_t, SmcKeyData_keyInfo_t>> Entries() const;
+};
+
+// Key info persisted across processes. The file is a fixed header followed by
+// entries sorted by key; it is mapped read-only and searched in place, so
+// loading involves no parsing. It is only trusted when it was written on the
+// same machine model for an SMC exposing the same number of keys, and it is
+// replaced atomically by renaming a fully written temporary file.
+class KeyInfoCacheFile {
+ private:
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t modelHash;
+    uint32_t smcKeyCount;
+    uint32_t entryCount;
+  };
+  struct Entry {
+    uint32_t key;
+    uint32_t dataSize;
+    uint32_t dataType;
+    uint32_t dataAttributes;
+  };
+  void Unmap();
+
+  std::string path_;
+  uint64_t model_hash_;
+  uint32_t smc_key_count_;
+  void* map_ = nullptr;
+  size_t map_size_ = 0;
+  const Entry* entries_ = nullptr;
+  size_t entry_count_ = 0;
+
+ public:
+  KeyInfoCacheFile(std::string path, const std::string& machine_model, uint32_t smc_key_count);
+  ~KeyInfoCacheFile();
+  KeyInfoCacheFile(const KeyInfoCacheFile&) = delete;
+  KeyInfoCacheFile& operator=(const KeyInfoCacheFile&) = delete;
+
+  // Maps the file; false when it is missing, malformed or from another machine.
+  bool Load();
+  bool Find(uint32_t key, SmcKeyData_keyInfo_t& key_info) const;
+  // Writes the loaded entries merged with the cache contents.
+  bool Save(const KeyInfoCache& cache) const;
+  size_t Size() const { return entry_count_; }
+};
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_CACHE_H_
@@ -0,0 +1,80 @@
+#include "smctemp_clock.h"
+
+#include <cerrno>
+#include <ctime>
+
+namespace smctemp {
+int64_t MonotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+int64_t RealtimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+bool SleepUntil(int64_t deadline_ns) {
+#if defined(__APPLE__)
+  // macOS has no clock_nanosleep; sleep for what is left of the absolute
+  // deadline, which still keeps the schedule free of drift.
+  for (;;) {
+    const int64_t remaining_ns = deadline_ns - MonotonicNs();
+    if (remaining_ns <= 0) {
+      return true;
+    }
+    struct timespec ts;
+    ts.tv_sec = remaining_ns / 1'000'000'000;
+    ts.tv_nsec = remaining_ns % 1'000'000'000;
+    if (nanosleep(&ts, nullptr) != 0 && errno == EINTR) {
+      return false;
+    }
+  }
+#else
+  struct timespec ts;
+  ts.tv_sec = deadline_ns / 1'000'000'000;
+  ts.tv_nsec = deadline_ns % 1'000'000'000;
+  for (;;) {
+    int result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+    if (result == 0) {
+      return true;
+    }
+    if (result == EINTR) {
+      return false;
+    }
+  }
+#endif
+}
+
+PeriodicTimer::PeriodicTimer(std::chrono::nanoseconds period)
+    : period_ns_(period.count()),
+      next_deadline_ns_(MonotonicNs() + period.count()) {
+}
+
+void PeriodicTimer::SetPeriod(std::chrono::nanoseconds period) {
+  next_deadline_ns_ += period.count() - period_ns_;
+  period_ns_ = period.count();
+}
+
+bool PeriodicTimer::Wait() {
+  const int64_t now = MonotonicNs();
+  if (now > next_deadline_ns_) {
+    overruns_++;
+    const int64_t missed = (now - next_deadline_ns_) / period_ns_ + 1;
+    next_deadline_ns_ += missed * period_ns_;
+  }
+  if (!SleepUntil(next_deadline_ns_)) {
+    return false;
+  }
+  last_jitter_ns_ = MonotonicNs() - next_deadline_ns_;
+  if (last_jitter_ns_ > max_jitter_ns_) {
+    max_jitter_ns_ = last_jitter_ns_;
+  }
+  jitter_sum_ns_ += last_jitter_ns_;
+  ticks_++;
+  next_deadline_ns_ += period_ns_;
+  return true;
+}
+}
@@ -0,0 +1,45 @@
+#ifndef SMCTEMP_SMCTEMP_CLOCK_H_
+#define SMCTEMP_SMCTEMP_CLOCK_H_
+#include <chrono>
+#include <cstdint>
+
+namespace smctemp {
+int64_t MonotonicNs();
+// CLOCK_REALTIME, for timestamps meant for other processes and hosts.
+int64_t RealtimeNs();
+// Sleeps until the absolute CLOCK_MONOTONIC time deadline_ns. Returns false
+// if a signal cut the sleep short.
+bool SleepUntil(int64_t deadline_ns);
+
+// Fires on a fixed grid start + k * period. Deadlines are absolute, so the
+// time spent between waits does not accumulate as drift. A wait that starts
+// after its deadline counts as an overrun and skips to the next deadline still
+// ahead instead of firing a burst of late ticks.
+class PeriodicTimer {
+ private:
+  int64_t period_ns_;
+  int64_t next_deadline_ns_;
+  uint64_t ticks_ = 0;
+  uint64_t overruns_ = 0;
+  int64_t last_jitter_ns_ = 0;
+  int64_t max_jitter_ns_ = 0;
+  double jitter_sum_ns_ = 0.0;
+
+ public:
+  explicit PeriodicTimer(std::chrono::nanoseconds period);
+  // Sleeps until the next deadline. Returns false if interrupted by a signal.
+  bool Wait();
+  // Moves the next deadline to period after the last one, so the schedule
+  // stays free of drift across changes.
+  void SetPeriod(std::chrono::nanoseconds period);
+
+  int64_t PeriodNs() const { return period_ns_; }
+  uint64_t Ticks() const { return ticks_; }
+  uint64_t Overruns() const { return overruns_; }
+  // How late the last wake-up was, in nanoseconds.
+  int64_t LastJitterNs() const { return last_jitter_ns_; }
+  int64_t MaxJitterNs() const { return max_jitter_ns_; }
+  double MeanJitterNs() const { return ticks_ > 0 ? jitter_sum_ns_ / ticks_ : 0.0; }
+};
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_CLOCK_H_
@@ -0,0 +1,420 @@
+#include "smctemp_daemon.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+#include "smctemp_clock.h"
+
+namespace smctemp {
+namespace {
+volatile sig_atomic_t g_signaled = 0;
+
+void onSignal(int) {
+  g_signaled = 1;
+}
+
+// How long either end of a connection waits for the other, so that a stalled
+// client does not hold up the daemon and a stopped daemon does not hold up
+// its clients.
+constexpr struct timeval kSocketTimeout = {0, 100'000};
+
+void setSocketTimeouts(int fd) {
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &kSocketTimeout, sizeof(kSocketTimeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &kSocketTimeout, sizeof(kSocketTimeout));
+}
+
+bool fillAddress(const std::string& path, struct sockaddr_un& addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+bool writeAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool readAll(int fd, void* data, size_t size) {
+  char* p = static_cast<char*>(data);
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+uint32_t parseTextOp(const std::string& line) {
+  if (line == "cpu") {
+    return kDaemonOpCpu;
+  } else if (line == "gpu") {
+    return kDaemonOpGpu;
+  } else if (line == "all") {
+    return kDaemonOpAll;
+  } else if (line == "cpu-stats") {
+    return kDaemonOpCpuStats;
+  } else if (line == "gpu-stats") {
+    return kDaemonOpGpuStats;
+  } else if (line == "rate") {
+    return kDaemonOpRate;
+  } else if (line == "metrics") {
+    return kDaemonOpMetrics;
+  }
+  return 0;
+}
+
+// interval after deadline, or after now if that has passed already: after a
+// slow sample, or when the adaptive rate slows down, the ticks missed are
+// skipped as PeriodicTimer does rather than sampled back to back.
+std::chrono::steady_clock::time_point nextDeadline(std::chrono::steady_clock::time_point deadline,
+                                                   std::chrono::nanoseconds interval) {
+  const auto now = std::chrono::steady_clock::now();
+  const auto next = deadline + interval;
+  return next > now ? next : now + interval;
+}
+
+// Whether reply has a value of each temperature op asks for; the daemon
+// serves 0 for one it has no valid reading of.
+bool hasValue(const DaemonReply_t& reply, uint32_t op) {
+  const bool cpu = reply.cpu != 0.0;
+  const bool gpu = reply.gpu != 0.0;
+  return op == kDaemonOpCpu ? cpu : op == kDaemonOpGpu ? gpu : cpu && gpu;
+}
+}
+
+SmcDaemon::SmcDaemon(SmcTemp& smc_temp, std::string socket_path, std::chrono::milliseconds interval)
+    : smc_temp_(smc_temp),
+      socket_path_(std::move(socket_path)),
+      interval_(interval) {
+  memset(&latest_, 0, sizeof(latest_));
+  latest_.magic = kDaemonMagic;
+  latest_.status = kDaemonStatusNoSample;
+  memset(&shared_sample_, 0, sizeof(shared_sample_));
+  memset(&cpu_stats_, 0, sizeof(cpu_stats_));
+  memset(&gpu_stats_, 0, sizeof(gpu_stats_));
+  cpu_readings_.reserve(kSharedSampleMaxSensors);
+  gpu_readings_.reserve(kSharedSampleMaxSensors);
+}
+
+void SmcDaemon::SetAdaptive(const AdaptiveConfig_t& config) {
+  cpu_rate_ = std::make_unique<AdaptiveRate>(config);
+  gpu_rate_ = std::make_unique<AdaptiveRate>(config);
+}
+
+bool SmcDaemon::PublishToSharedMemory(const std::string& name) {
+  shared_writer_ = std::make_unique<SharedSampleWriter>(name);
+  if (!shared_writer_->IsOpen()) {
+    std::cerr << "Failed to open shared memory: " << name << std::endl;
+    shared_writer_.reset();
+    return false;
+  }
+  return true;
+}
+
+void SmcDaemon::Stop() {
+  stop_.store(true);
+  wake_.notify_all();
+}
+
+void SmcDaemon::CollectReadings(const std::vector<SensorReading_t>& readings) {
+  for (const SensorReading_t& reading : readings) {
+    const uint32_t i = shared_sample_.sensorCount;
+    if (i == kSharedSampleMaxSensors) {
+      return;
+    }
+    shared_sample_.keys[i] = reading.key;
+    shared_sample_.values[i] = reading.value;
+    if (smc_temp_.IsValidTemperature(reading.value, kValidTemperatureLimits)) {
+      shared_sample_.validMask |= uint64_t{1} << i;
+    }
+    shared_sample_.sensorCount++;
+  }
+}
+
+std::chrono::nanoseconds SmcDaemon::NextInterval(AdaptiveRate* rate, int64_t now_ns, double temperature) {
+  if (rate == nullptr) {
+    return interval_;
+  }
+  return smc_temp_.IsValidTemperature(temperature, kValidTemperatureLimits) ? rate->Update(now_ns, temperature)
+                                                                             : rate->Missed(now_ns);
+}
+
+// Samples the CPU and the GPU when each is due, every interval or as their
+// AdaptiveRate says, and publishes the latest values of both.
+void SmcDaemon::SampleLoop() {
+  auto cpu_deadline = std::chrono::steady_clock::now();
+  auto gpu_deadline = cpu_deadline;
+  while (!stop_.load()) {
+    const auto now = std::chrono::steady_clock::now();
+    const int64_t now_ns = MonotonicNs();
+    const bool sample_cpu = now >= cpu_deadline;
+    const bool sample_gpu = now >= gpu_deadline;
+    double cpu = 0.0;
+    double gpu = 0.0;
+    // A reading that fails validation is served as missing, or with -f as
+    // the last valid value not older than --max-age.
+    if (sample_cpu) {
+      cpu = smc_temp_.GetCpuTemp();
+      cpu_readings_.assign(smc_temp_.LastReadings().begin(), smc_temp_.LastReadings().end());
+      cpu_deadline = nextDeadline(cpu_deadline, NextInterval(cpu_rate_.get(), now_ns, cpu));
+      if (!smc_temp_.IsValidTemperature(cpu, kValidTemperatureLimits)) {
+        cpu = smc_temp_.GetLastValidCpuTemp();
+      }
+    }
+    if (sample_gpu) {
+      gpu = smc_temp_.GetGpuTemp();
+      gpu_readings_.assign(smc_temp_.LastReadings().begin(), smc_temp_.LastReadings().end());
+      gpu_deadline = nextDeadline(gpu_deadline, NextInterval(gpu_rate_.get(), now_ns, gpu));
+      if (!smc_temp_.IsValidTemperature(gpu, kValidTemperatureLimits)) {
+        gpu = smc_temp_.GetLastValidGpuTemp();
+      }
+    }
+    shared_sample_.sensorCount = 0;
+    shared_sample_.validMask = 0;
+    CollectReadings(cpu_readings_);
+    CollectReadings(gpu_readings_);
+    TemperatureStats* stats = smc_temp_.Stats();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (sample_cpu) {
+        latest_.cpu = cpu;
+      }
+      if (sample_gpu) {
+        latest_.gpu = gpu;
+      }
+      latest_.status = kDaemonStatusOk;
+      latest_.sequence++;
+      latest_.timestampNs = RealtimeNs();
+      if (stats != nullptr) {
+        cpu_stats_ = stats->Cpu().Snapshot(now_ns);
+        gpu_stats_ = stats->Gpu().Snapshot(now_ns);
+      }
+      if (cpu_rate_) {
+        cpu_rate_hz_ = cpu_rate_->EffectiveRateHz(now_ns);
+        gpu_rate_hz_ = gpu_rate_->EffectiveRateHz(now_ns);
+        cpu_saved_ = cpu_rate_->SamplesSaved(now_ns);
+        gpu_saved_ = gpu_rate_->SamplesSaved(now_ns);
+      } else {
+        cpu_rate_hz_ = gpu_rate_hz_ = 1e9 / std::chrono::nanoseconds(interval_).count();
+      }
+    }
+    if (shared_writer_) {
+      shared_sample_.timestampNs = latest_.timestampNs;
+      shared_sample_.sequence = latest_.sequence;
+      shared_sample_.periodNs = std::max(std::chrono::nanoseconds(std::min(cpu_deadline, gpu_deadline) - now),
+                                         std::chrono::nanoseconds(interval_)).count();
+      shared_sample_.cpu = latest_.cpu;
+      shared_sample_.gpu = latest_.gpu;
+      shared_sample_.flags = (latest_.cpu != 0.0 ? kSharedSampleCpuValid : 0) |
+                             (latest_.gpu != 0.0 ? kSharedSampleGpuValid : 0);
+      shared_writer_->Publish(shared_sample_);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    wake_.wait_until(lock, std::min(cpu_deadline, gpu_deadline), [this] { return stop_.load(); });
+  }
+}
+
+void SmcDaemon::Serve(int client_fd) {
+  char buffer[256];
+  ssize_t n = read(client_fd, buffer, sizeof(buffer));
+  if (n <= 0) {
+    return;
+  }
+
+  DaemonReply_t reply;
+  StatsSnapshot_t cpu_stats;
+  StatsSnapshot_t gpu_stats;
+  double cpu_rate_hz;
+  double gpu_rate_hz;
+  uint64_t cpu_saved;
+  uint64_t gpu_saved;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    reply = latest_;
+    cpu_stats = cpu_stats_;
+    gpu_stats = gpu_stats_;
+    cpu_rate_hz = cpu_rate_hz_;
+    gpu_rate_hz = gpu_rate_hz_;
+    cpu_saved = cpu_saved_;
+    gpu_saved = gpu_saved_;
+  }
+  if (static_cast<size_t>(n) >= sizeof(DaemonRequest_t)) {
+    DaemonRequest_t request;
+    memcpy(&request, buffer, sizeof(request));
+    if (request.magic == kDaemonMagic) {
+      if (request.op < kDaemonOpCpu || request.op > kDaemonOpAll) {
+        reply.status = kDaemonStatusBadRequest;
+      } else if (!hasValue(reply, request.op)) {
+        reply.status = kDaemonStatusNoSample;
+      }
+      writeAll(client_fd, &reply, sizeof(reply));
+      return;
+    }
+  }
+
+  std::string response;
+  std::string line;
+  for (ssize_t i = 0; i < n; i++) {
+    if (buffer[i] == '\r') {
+      continue;
+    }
+    if (buffer[i] != '\n' && i + 1 < n) {
+      line += buffer[i];
+      continue;
+    }
+    if (buffer[i] != '\n') {
+      line += buffer[i];
+    }
+    char value[128];
+    const uint32_t op = parseTextOp(line);
+    if (op == 0) {
+      snprintf(value, sizeof(value), "error: unknown request\n");
+    } else if (op == kDaemonOpMetrics) {
+      // The counters are atomics, read without stopping the sampler.
+      const SmcMetrics* metrics = smc_temp_.Metrics();
+      if (metrics == nullptr) {
+        snprintf(value, sizeof(value), "error: metrics are off\n");
+      } else {
+        std::ostringstream out;
+        metrics->Print(out);
+        response += out.str();
+        line.clear();
+        continue;
+      }
+    } else if (reply.status != kDaemonStatusOk || (op <= kDaemonOpAll && !hasValue(reply, op))) {
+      snprintf(value, sizeof(value), "error: no sample yet\n");
+    } else if (op == kDaemonOpCpuStats || op == kDaemonOpGpuStats) {
+      const StatsSnapshot_t& stats = op == kDaemonOpCpuStats ? cpu_stats : gpu_stats;
+      if (stats.count == 0) {
+        snprintf(value, sizeof(value), "error: no statistics\n");
+      } else {
+        snprintf(value, sizeof(value), "%.1f %.1f %.1f %.1f %.1f %.1f\n", stats.min, stats.max, stats.mean,
+                 stats.ewma, stats.p95, stats.p99);
+      }
+    } else if (op == kDaemonOpRate) {
+      snprintf(value, sizeof(value), "%.2f %.2f %llu %llu\n", cpu_rate_hz, gpu_rate_hz,
+               static_cast<unsigned long long>(cpu_saved), static_cast<unsigned long long>(gpu_saved));
+    } else if (op == kDaemonOpCpu) {
+      snprintf(value, sizeof(value), "%.1f\n", reply.cpu);
+    } else if (op == kDaemonOpGpu) {
+      snprintf(value, sizeof(value), "%.1f\n", reply.gpu);
+    } else {
+      snprintf(value, sizeof(value), "%.1f %.1f\n", reply.cpu, reply.gpu);
+    }
+    response += value;
+    line.clear();
+  }
+  writeAll(client_fd, response.data(), response.size());
+}
+
+int SmcDaemon::Run() {
+  struct sockaddr_un addr;
+  if (!fillAddress(socket_path_, addr)) {
+    std::cerr << "Socket path is too long: " << socket_path_ << std::endl;
+    return 1;
+  }
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    std::cerr << "Failed to create socket: " << strerror(errno) << std::endl;
+    return 1;
+  }
+  const size_t slash = socket_path_.rfind('/');
+  if (slash != std::string::npos && slash > 0) {
+    mkdir(socket_path_.substr(0, slash).c_str(), 0777);
+  }
+  unlink(socket_path_.c_str());
+  if (bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      listen(listen_fd, 16) != 0) {
+    std::cerr << "Failed to listen on " << socket_path_ << ": " << strerror(errno) << std::endl;
+    close(listen_fd);
+    return 1;
+  }
+
+  g_signaled = 0;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onSignal;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
+  std::thread sampler(&SmcDaemon::SampleLoop, this);
+  while (!stop_.load() && !g_signaled) {
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    int ready = poll(&pfd, 1, 200);
+    if (ready <= 0) {
+      continue;
+    }
+    int client_fd = accept(listen_fd, nullptr, nullptr);
+    if (client_fd < 0) {
+      continue;
+    }
+    setSocketTimeouts(client_fd);
+    Serve(client_fd);
+    close(client_fd);
+  }
+
+  Stop();
+  sampler.join();
+  if (shared_writer_) {
+    shared_writer_->Unlink();
+  }
+  close(listen_fd);
+  unlink(socket_path_.c_str());
+  return 0;
+}
+
+bool QueryDaemon(const std::string& socket_path, uint32_t op, DaemonReply_t& reply) {
+  struct sockaddr_un addr;
+  if (!fillAddress(socket_path, addr)) {
+    return false;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+  setSocketTimeouts(fd);
+  DaemonRequest_t request = {kDaemonMagic, op};
+  bool ok = connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0 &&
+            writeAll(fd, &request, sizeof(request)) &&
+            readAll(fd, &reply, sizeof(reply));
+  close(fd);
+  return ok && reply.magic == kDaemonMagic && reply.status == kDaemonStatusOk;
+}
+}
@@ -0,0 +1,107 @@
+#ifndef SMCTEMP_SMCTEMP_DAEMON_H_
+#define SMCTEMP_SMCTEMP_DAEMON_H_
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "smctemp.h"
+#include "smctemp_adaptive.h"
+#include "smctemp_shm.h"
+
+namespace smctemp {
+constexpr char kDefaultSocketPath[] = "/tmp/smctemp/smctemp.sock";
+
+// Binary protocol: a client writes one DaemonRequest and reads one
+// DaemonReply. Anything not starting with kDaemonMagic is read as the text
+// protocol, one request per line ("cpu", "gpu" or "all"), answered with the
+// values separated by spaces, one line per request. The text protocol also
+// answers "cpu-stats" and "gpu-stats" with the rolling statistics of the
+// daemon's SmcTemp: min, max, mean, EWMA, p95 and p99, and "rate" with the
+// CPU and GPU samples per second and the samples adaptive sampling saved,
+// and "metrics" with SmcMetrics::Print() if the SmcTemp has metrics enabled.
+constexpr uint32_t kDaemonMagic = 0x534d4354;  // "SMCT"
+constexpr uint32_t kDaemonOpCpu = 1;
+constexpr uint32_t kDaemonOpGpu = 2;
+constexpr uint32_t kDaemonOpAll = 3;
+// Text protocol only.
+constexpr uint32_t kDaemonOpCpuStats = 4;
+constexpr uint32_t kDaemonOpGpuStats = 5;
+constexpr uint32_t kDaemonOpRate = 6;
+constexpr uint32_t kDaemonOpMetrics = 7;
+constexpr uint32_t kDaemonStatusOk = 0;
+constexpr uint32_t kDaemonStatusNoSample = 1;
+constexpr uint32_t kDaemonStatusBadRequest = 2;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t op;
+} DaemonRequest_t;
+
+// status is kDaemonStatusNoSample while the daemon has no valid value of a
+// temperature asked for. A reading that fails validation leaves none unless
+// the daemon runs with -f, which serves the last valid value instead for as
+// long as --max-age allows.
+typedef struct {
+  uint32_t magic;
+  uint32_t status;
+  uint64_t sequence;
+  int64_t  timestampNs;  // CLOCK_REALTIME of the sample
+  double   cpu;
+  double   gpu;
+} DaemonReply_t;
+
+// Keeps one SmcTemp open, samples it on a fixed interval and answers queries
+// for the latest sample on a UNIX socket.
+class SmcDaemon {
+ private:
+  void SampleLoop();
+  void CollectReadings(const std::vector<SensorReading_t>& readings);
+  std::chrono::nanoseconds NextInterval(AdaptiveRate* rate, int64_t now_ns, double temperature);
+  void Serve(int client_fd);
+
+  SmcTemp& smc_temp_;
+  const std::string socket_path_;
+  const std::chrono::milliseconds interval_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  DaemonReply_t latest_;
+  StatsSnapshot_t cpu_stats_;
+  StatsSnapshot_t gpu_stats_;
+  // The sensor readings of the last CPU and GPU sample, which with adaptive
+  // sampling may be from different ticks.
+  std::vector<SensorReading_t> cpu_readings_;
+  std::vector<SensorReading_t> gpu_readings_;
+  std::unique_ptr<AdaptiveRate> cpu_rate_;
+  std::unique_ptr<AdaptiveRate> gpu_rate_;
+  double cpu_rate_hz_ = 0.0;
+  double gpu_rate_hz_ = 0.0;
+  uint64_t cpu_saved_ = 0;
+  uint64_t gpu_saved_ = 0;
+  SharedSample_t shared_sample_;
+  std::unique_ptr<SharedSampleWriter> shared_writer_;
+  std::atomic<bool> stop_{false};
+
+ public:
+  SmcDaemon(SmcTemp& smc_temp, std::string socket_path, std::chrono::milliseconds interval);
+  // Serves until Stop() is called or SIGINT/SIGTERM is received. Returns 0 on
+  // a clean shutdown.
+  int Run();
+  void Stop();
+  // Also publishes every sample, with the per-sensor values, to a shared
+  // memory segment that SharedSampleReader can map.
+  bool PublishToSharedMemory(const std::string& name);
+  // Samples the CPU and the GPU each on its own AdaptiveRate instead of
+  // every interval. Call before Run().
+  void SetAdaptive(const AdaptiveConfig_t& config);
+};
+
+// Asks a running daemon for the latest sample. False if no daemon answers
+// within 100 ms.
+bool QueryDaemon(const std::string& socket_path, uint32_t op, DaemonReply_t& reply);
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_DAEMON_H_
@@ -0,0 +1,116 @@
+#include "smctemp_decode.h"
+
+#include <arpa/inet.h>
+
+#include <cstring>
+
+namespace smctemp {
+double DecodeSmcBytes(uint32_t dataType, uint32_t dataSize, const unsigned char* bytes) {
+  const SmcDataTypeDecoder* decoder = FindSmcDataTypeDecoder(dataType);
+  if (decoder == nullptr) {
+    return 0.0;
+  }
+  if (decoder->dataSize != 0 ? dataSize != decoder->dataSize : (dataSize == 0 || dataSize > 8)) {
+    return 0.0;
+  }
+
+  if (decoder->kind == SmcValueKind::kFloat) {
+    float f;
+    memcpy(&f, bytes, sizeof(f));
+    return f;
+  }
+
+  uint64_t raw = 0;
+  for (uint32_t i = 0; i < dataSize; i++) {
+    raw = (raw << 8) | bytes[i];
+  }
+  if (decoder->kind == SmcValueKind::kSigned) {
+    const unsigned shift = 64 - dataSize * 8;
+    return static_cast<double>(static_cast<int64_t>(raw << shift) >> shift) * decoder->scale;
+  }
+  return static_cast<double>(raw) * decoder->scale;
+}
+
+double DecodeSmcVal(const SmcVal_t& val) {
+  return DecodeSmcBytes(val.dataTypeCode, val.dataSize, val.bytes);
+}
+
+namespace {
+double decodeZero(const unsigned char*, uint32_t, double) {
+  return 0.0;
+}
+
+double decodeFloat(const unsigned char* bytes, uint32_t, double) {
+  float f;
+  memcpy(&f, bytes, sizeof(f));
+  return f;
+}
+
+double decodeUnsigned8(const unsigned char* bytes, uint32_t, double scale) {
+  return bytes[0] * scale;
+}
+
+double decodeUnsigned16(const unsigned char* bytes, uint32_t, double scale) {
+  return static_cast<uint16_t>((bytes[0] << 8) | bytes[1]) * scale;
+}
+
+double decodeUnsigned32(const unsigned char* bytes, uint32_t, double scale) {
+  uint32_t raw;
+  memcpy(&raw, bytes, sizeof(raw));
+  return ntohl(raw) * scale;
+}
+
+double decodeSigned8(const unsigned char* bytes, uint32_t, double scale) {
+  return static_cast<int8_t>(bytes[0]) * scale;
+}
+
+double decodeSigned16(const unsigned char* bytes, uint32_t, double scale) {
+  return static_cast<int16_t>((bytes[0] << 8) | bytes[1]) * scale;
+}
+
+uint64_t readBigEndian(const unsigned char* bytes, uint32_t dataSize) {
+  uint64_t raw = 0;
+  for (uint32_t i = 0; i < dataSize; i++) {
+    raw = (raw << 8) | bytes[i];
+  }
+  return raw;
+}
+
+double decodeUnsignedN(const unsigned char* bytes, uint32_t dataSize, double scale) {
+  return static_cast<double>(readBigEndian(bytes, dataSize)) * scale;
+}
+
+double decodeSignedN(const unsigned char* bytes, uint32_t dataSize, double scale) {
+  const unsigned shift = 64 - dataSize * 8;
+  return static_cast<double>(static_cast<int64_t>(readBigEndian(bytes, dataSize) << shift) >> shift) * scale;
+}
+}
+
+SmcResolvedDecoder_t ResolveSmcDecoder(uint32_t dataType, uint32_t dataSize) {
+  const SmcDataTypeDecoder* decoder = FindSmcDataTypeDecoder(dataType);
+  if (decoder == nullptr ||
+      (decoder->dataSize != 0 ? dataSize != decoder->dataSize : (dataSize == 0 || dataSize > 8))) {
+    return {decodeZero, 0.0};
+  }
+  switch (decoder->kind) {
+    case SmcValueKind::kFloat:
+      return {decodeFloat, 1.0};
+    case SmcValueKind::kUnsigned:
+      switch (dataSize) {
+        case 1: return {decodeUnsigned8, decoder->scale};
+        case 2: return {decodeUnsigned16, decoder->scale};
+        case 4: return {decodeUnsigned32, decoder->scale};
+        default: return {decodeUnsignedN, decoder->scale};
+      }
+    case SmcValueKind::kSigned:
+      switch (dataSize) {
+        case 1: return {decodeSigned8, decoder->scale};
+        case 2: return {decodeSigned16, decoder->scale};
+        default: return {decodeSignedN, decoder->scale};
+      }
+    case SmcValueKind::kNone:
+      break;
+  }
+  return {decodeZero, 0.0};
+}
+}
@@ -0,0 +1,131 @@
+#ifndef SMCTEMP_SMCTEMP_DECODE_H_
+#define SMCTEMP_SMCTEMP_DECODE_H_
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "smctemp_types.h"
+
+namespace smctemp {
+// Packs a four character code the same way the SMC does (first char in the
+// most significant byte), e.g. FourCC("sp78") == keyInfo.dataType.
+constexpr uint32_t FourCC(const char (&code)[5]) {
+  return (static_cast<uint32_t>(static_cast<unsigned char>(code[0])) << 24) |
+         (static_cast<uint32_t>(static_cast<unsigned char>(code[1])) << 16) |
+         (static_cast<uint32_t>(static_cast<unsigned char>(code[2])) << 8) |
+         static_cast<uint32_t>(static_cast<unsigned char>(code[3]));
+}
+
+enum class SmcValueKind : uint8_t {
+  kNone = 0,
+  kUnsigned,  // big-endian unsigned integer of dataSize bytes
+  kSigned,    // big-endian two's complement integer
+  kFloat,     // native float
+};
+
+struct SmcDataTypeDecoder {
+  uint32_t dataType;
+  SmcValueKind kind;
+  uint8_t dataSize;  // required dataSize, 0 accepts 1 to 8 bytes
+  double scale;      // multiplier applied to the raw integer
+};
+
+constexpr SmcDataTypeDecoder kSmcDataTypeDecoders[] = {
+  {FourCC(kDataTypeFlt),  SmcValueKind::kFloat,    4, 1.0},
+  {FourCC(kDataTypeFp1f), SmcValueKind::kUnsigned, 2, 1.0 / 32768.0},
+  {FourCC(kDataTypeFp4c), SmcValueKind::kUnsigned, 2, 1.0 / 4096.0},
+  {FourCC(kDataTypeFp5b), SmcValueKind::kUnsigned, 2, 1.0 / 2048.0},
+  {FourCC(kDataTypeFp6a), SmcValueKind::kUnsigned, 2, 1.0 / 1024.0},
+  {FourCC(kDataTypeFp79), SmcValueKind::kUnsigned, 2, 1.0 / 512.0},
+  {FourCC(kDataTypeFp88), SmcValueKind::kUnsigned, 2, 1.0 / 256.0},
+  {FourCC(kDataTypeFpa6), SmcValueKind::kUnsigned, 2, 1.0 / 64.0},
+  {FourCC(kDataTypeFpc4), SmcValueKind::kUnsigned, 2, 1.0 / 16.0},
+  {FourCC(kDataTypeFpe2), SmcValueKind::kUnsigned, 2, 1.0 / 4.0},
+  {FourCC(kDataTypeSp1e), SmcValueKind::kSigned,   2, 1.0 / 16384.0},
+  {FourCC(kDataTypeSp3c), SmcValueKind::kSigned,   2, 1.0 / 4096.0},
+  {FourCC(kDataTypeSp4b), SmcValueKind::kSigned,   2, 1.0 / 2048.0},
+  {FourCC(kDataTypeSp5a), SmcValueKind::kSigned,   2, 1.0 / 1024.0},
+  {FourCC(kDataTypeSp69), SmcValueKind::kSigned,   2, 1.0 / 512.0},
+  {FourCC(kDataTypeSp78), SmcValueKind::kSigned,   2, 1.0 / 256.0},
+  {FourCC(kDataTypeSp87), SmcValueKind::kSigned,   2, 1.0 / 128.0},
+  {FourCC(kDataTypeSp96), SmcValueKind::kSigned,   2, 1.0 / 64.0},
+  {FourCC(kDataTypeSpb4), SmcValueKind::kSigned,   2, 1.0 / 16.0},
+  {FourCC(kDataTypeSpf0), SmcValueKind::kSigned,   2, 1.0},
+  {FourCC(kDataTypeUi8),  SmcValueKind::kUnsigned, 0, 1.0},
+  {FourCC(kDataTypeUi16), SmcValueKind::kUnsigned, 0, 1.0},
+  {FourCC(kDataTypeUi32), SmcValueKind::kUnsigned, 0, 1.0},
+  {FourCC(kDataTypeUi64), SmcValueKind::kUnsigned, 0, 1.0},
+  {FourCC(kDataTypeSi8),  SmcValueKind::kSigned,   1, 1.0},
+  {FourCC(kDataTypeSi16), SmcValueKind::kSigned,   2, 1.0},
+  {FourCC(kDataTypePwm),  SmcValueKind::kUnsigned, 2, 100.0 / 65536.0},
+};
+
+// The decoders are placed in an open-addressing table indexed by a
+// multiplicative hash of the type code, built at compile time.
+constexpr size_t kSmcDataTypeSlotBits = 6;
+constexpr size_t kSmcDataTypeSlotCount = size_t{1} << kSmcDataTypeSlotBits;
+constexpr size_t kSmcDataTypeMaxProbe = 2;
+
+constexpr size_t SmcDataTypeSlot(uint32_t dataType) {
+  return static_cast<uint32_t>(dataType * 0x9E3779B1u) >> (32 - kSmcDataTypeSlotBits);
+}
+
+constexpr std::array<SmcDataTypeDecoder, kSmcDataTypeSlotCount> BuildSmcDataTypeTable() {
+  std::array<SmcDataTypeDecoder, kSmcDataTypeSlotCount> table{};
+  for (const SmcDataTypeDecoder& decoder : kSmcDataTypeDecoders) {
+    size_t slot = SmcDataTypeSlot(decoder.dataType);
+    while (table[slot].kind != SmcValueKind::kNone) {
+      slot = (slot + 1) % kSmcDataTypeSlotCount;
+    }
+    table[slot] = decoder;
+  }
+  return table;
+}
+
+constexpr std::array<SmcDataTypeDecoder, kSmcDataTypeSlotCount> kSmcDataTypeTable = BuildSmcDataTypeTable();
+
+constexpr bool SmcDataTypeTableIsShallow() {
+  for (const SmcDataTypeDecoder& decoder : kSmcDataTypeDecoders) {
+    size_t slot = SmcDataTypeSlot(decoder.dataType);
+    size_t probes = 0;
+    while (kSmcDataTypeTable[slot].dataType != decoder.dataType) {
+      slot = (slot + 1) % kSmcDataTypeSlotCount;
+      if (++probes > kSmcDataTypeMaxProbe) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+static_assert(SmcDataTypeTableIsShallow(), "SMC data type table needs a larger size or another hash");
+
+constexpr const SmcDataTypeDecoder* FindSmcDataTypeDecoder(uint32_t dataType) {
+  size_t slot = SmcDataTypeSlot(dataType);
+  for (size_t probes = 0; probes <= kSmcDataTypeMaxProbe; ++probes) {
+    const SmcDataTypeDecoder& decoder = kSmcDataTypeTable[slot];
+    if (decoder.dataType == dataType && decoder.kind != SmcValueKind::kNone) {
+      return &decoder;
+    }
+    slot = (slot + 1) % kSmcDataTypeSlotCount;
+  }
+  return nullptr;
+}
+
+// Decodes the raw bytes of a key. Unknown types and unexpected sizes decode to 0.
+double DecodeSmcBytes(uint32_t dataType, uint32_t dataSize, const unsigned char* bytes);
+double DecodeSmcVal(const SmcVal_t& val);
+
+// A decoder specialized for one type and size, picked once so that repeated
+// reads of a key skip the table lookup and the checks on kind and size.
+typedef double (*SmcDecodeFn)(const unsigned char* bytes, uint32_t dataSize, double scale);
+
+typedef struct {
+  SmcDecodeFn decode;
+  double      scale;
+} SmcResolvedDecoder_t;
+
+// Always returns a callable decoder; unknown types and unexpected sizes get
+// one that returns 0, as DecodeSmcBytes would.
+SmcResolvedDecoder_t ResolveSmcDecoder(uint32_t dataType, uint32_t dataSize);
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_DECODE_H_
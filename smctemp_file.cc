@@ -0,0 +1,28 @@
+#include "smctemp_file.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace smctemp {
+bool ReplaceFile(const std::string& path, const std::function<bool(int fd)>& write_contents) {
+  std::vector<char> tmp_path(path.begin(), path.end());
+  const char kSuffix[] = ".XXXXXX";
+  tmp_path.insert(tmp_path.end(), kSuffix, kSuffix + sizeof(kSuffix));
+  const int fd = mkstemp(tmp_path.data());
+  if (fd < 0) {
+    return false;
+  }
+  // mkstemp creates the file 0600; the files are meant for every user.
+  bool ok = fchmod(fd, 0644) == 0 && write_contents(fd);
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(tmp_path.data(), path.c_str()) != 0) {
+    unlink(tmp_path.data());
+    return false;
+  }
+  return true;
+}
+}
@@ -0,0 +1,14 @@
+#ifndef SMCTEMP_SMCTEMP_FILE_H_
+#define SMCTEMP_SMCTEMP_FILE_H_
+#include <functional>
+#include <string>
+
+namespace smctemp {
+// Replaces path with what write_contents(fd) writes, by renaming a temporary
+// file over it, so readers see either the old or the new contents. The
+// temporary file comes from mkstemp: /tmp/smctemp is writable by everyone,
+// and a predictable name could be a symlink another user planted there.
+// False if write_contents or any system call failed; path is then untouched.
+bool ReplaceFile(const std::string& path, const std::function<bool(int fd)>& write_contents);
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_FILE_H_
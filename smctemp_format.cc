@@ -0,0 +1,321 @@
+#include "smctemp_format.h"
+
+#include <cmath>
+#include <cstring>
+
+#include "smctemp_decode.h"
+
+namespace smctemp {
+namespace {
+constexpr struct {
+  const char* name;
+  OutputFormat format;
+} kOutputFormats[] = {
+  {"text", OutputFormat::kText},
+  {"json", OutputFormat::kJsonLines},
+  {"csv", OutputFormat::kCsv},
+  {"influx", OutputFormat::kInflux},
+  {"prometheus", OutputFormat::kPrometheus},
+};
+
+// Control characters and bytes outside ASCII are escaped, so an odd SMC key
+// still makes valid UTF-8.
+void appendJsonString(const char* str, size_t size, BufferedWriter& out) {
+  out.Append('"');
+  for (size_t i = 0; i < size; i++) {
+    const uint8_t c = static_cast<uint8_t>(str[i]);
+    if (c == '"' || c == '\\') {
+      out.Append('\\');
+      out.Append(str[i]);
+    } else if (c < 0x20 || c >= 0x7f) {
+      out.Append("\\u00", 4);
+      out.AppendHexByte(c);
+    } else {
+      out.Append(str[i]);
+    }
+  }
+  out.Append('"');
+}
+
+void appendJsonNumber(double value, BufferedWriter& out) {
+  if (std::isfinite(value)) {
+    out.AppendNumber(value);
+  } else {
+    out.Append("null", 4);
+  }
+}
+
+// Quoted only if it has to be, with quotes doubled (RFC 4180).
+void appendCsvField(const char* str, size_t size, BufferedWriter& out) {
+  if (strcspn(str, ",\"\r\n") >= size) {
+    out.Append(str, size);
+    return;
+  }
+  out.Append('"');
+  for (size_t i = 0; i < size; i++) {
+    if (str[i] == '"') {
+      out.Append('"');
+    }
+    out.Append(str[i]);
+  }
+  out.Append('"');
+}
+
+// Tag keys, tag values and field keys of the line protocol.
+void appendInfluxName(const char* str, size_t size, BufferedWriter& out) {
+  for (size_t i = 0; i < size; i++) {
+    if (str[i] == ',' || str[i] == '=' || str[i] == ' ' || str[i] == '\\') {
+      out.Append('\\');
+    }
+    out.Append(str[i]);
+  }
+}
+
+void appendPrometheusLabel(const char* str, size_t size, BufferedWriter& out) {
+  out.Append('"');
+  for (size_t i = 0; i < size; i++) {
+    if (str[i] == '\n') {
+      out.Append("\\n", 2);
+      continue;
+    }
+    if (str[i] == '"' || str[i] == '\\') {
+      out.Append('\\');
+    }
+    out.Append(str[i]);
+  }
+  out.Append('"');
+}
+
+// Metric names allow only [a-zA-Z0-9_:].
+void appendPrometheusName(const char* str, BufferedWriter& out) {
+  for (; *str != '\0'; str++) {
+    const char c = *str;
+    const bool valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == ':';
+    out.Append(valid ? c : '_');
+  }
+}
+
+void appendPrometheusNumber(double value, BufferedWriter& out) {
+  if (std::isnan(value)) {
+    out.Append("NaN", 3);
+  } else if (std::isinf(value)) {
+    out.Append(value > 0 ? "+Inf" : "-Inf", 4);
+  } else {
+    out.AppendNumber(value);
+  }
+}
+
+void appendHexBytes(const SmcVal_t& val, BufferedWriter& out) {
+  for (uint32_t i = 0; i < val.dataSize && i < sizeof(val.bytes); i++) {
+    out.AppendHexByte(static_cast<uint8_t>(val.bytes[i]));
+  }
+}
+}
+
+bool ParseOutputFormat(const char* name, OutputFormat& format) {
+  for (const auto& entry : kOutputFormats) {
+    if (strcmp(name, entry.name) == 0) {
+      format = entry.format;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* OutputFormatName(OutputFormat format) {
+  for (const auto& entry : kOutputFormats) {
+    if (entry.format == format) {
+      return entry.name;
+    }
+  }
+  return "";
+}
+
+SampleFormatter::SampleFormatter(int fd, OutputFormat format) : format_(format), out_(fd) {
+}
+
+bool SampleFormatter::Write(int64_t realtime_ns, const OutputField_t* fields, size_t count) {
+  switch (format_) {
+    case OutputFormat::kText:
+      for (size_t i = 0; i < count; i++) {
+        if (i > 0) {
+          out_.Append(' ');
+        }
+        out_.AppendFixed(fields[i].value, 1);
+      }
+      out_.Append('\n');
+      break;
+    case OutputFormat::kJsonLines:
+      out_.Append("{\"time_ns\":", 11);
+      out_.AppendSigned(realtime_ns);
+      for (size_t i = 0; i < count; i++) {
+        out_.Append(',');
+        appendJsonString(fields[i].name, strlen(fields[i].name), out_);
+        out_.Append(':');
+        appendJsonNumber(fields[i].value, out_);
+      }
+      out_.Append("}\n", 2);
+      break;
+    case OutputFormat::kCsv:
+      if (!wrote_header_) {
+        out_.Append("time_ns", 7);
+        for (size_t i = 0; i < count; i++) {
+          out_.Append(',');
+          appendCsvField(fields[i].name, strlen(fields[i].name), out_);
+        }
+        out_.Append('\n');
+        wrote_header_ = true;
+      }
+      out_.AppendSigned(realtime_ns);
+      for (size_t i = 0; i < count; i++) {
+        out_.Append(',');
+        if (std::isfinite(fields[i].value)) {
+          out_.AppendNumber(fields[i].value);
+        }
+      }
+      out_.Append('\n');
+      break;
+    case OutputFormat::kInflux:
+      AppendInflux(realtime_ns, fields, count);
+      break;
+    case OutputFormat::kPrometheus:
+      AppendPrometheus(fields, count);
+      break;
+  }
+  return out_.Flush();
+}
+
+// A line needs at least one field, and the line protocol has no NaN.
+void SampleFormatter::AppendInflux(int64_t realtime_ns, const OutputField_t* fields, size_t count) {
+  bool first = true;
+  for (size_t i = 0; i < count; i++) {
+    if (!std::isfinite(fields[i].value)) {
+      continue;
+    }
+    out_.Append(first ? "smctemp " : ",");
+    appendInfluxName(fields[i].name, strlen(fields[i].name), out_);
+    out_.Append('=');
+    out_.AppendNumber(fields[i].value);
+    first = false;
+  }
+  if (!first) {
+    out_.Append(' ');
+    out_.AppendSigned(realtime_ns);
+    out_.Append('\n');
+  }
+}
+
+// Each derived temperature is its own gauge, smctemp_<name>_celsius; the SMC
+// keys share smctemp_key_value with the key as a label, as in the listing.
+// The TYPE lines come with the first sample only, since a parser rejects a
+// second one for the same metric. No timestamps, so the scrape time applies.
+void SampleFormatter::AppendPrometheus(const OutputField_t* fields, size_t count) {
+  bool have_keys = false;
+  for (size_t i = 0; i < count; i++) {
+    if (fields[i].isKey) {
+      have_keys = true;
+      continue;
+    }
+    if (!wrote_header_) {
+      out_.Append("# TYPE smctemp_");
+      appendPrometheusName(fields[i].name, out_);
+      out_.Append("_celsius gauge\n");
+    }
+    out_.Append("smctemp_");
+    appendPrometheusName(fields[i].name, out_);
+    out_.Append("_celsius ");
+    appendPrometheusNumber(fields[i].value, out_);
+    out_.Append('\n');
+  }
+  if (have_keys && !wrote_header_) {
+    out_.Append("# TYPE smctemp_key_value gauge\n");
+  }
+  wrote_header_ = true;
+  for (size_t i = 0; have_keys && i < count; i++) {
+    if (!fields[i].isKey) {
+      continue;
+    }
+    out_.Append("smctemp_key_value{key=");
+    appendPrometheusLabel(fields[i].name, strlen(fields[i].name), out_);
+    out_.Append("} ");
+    appendPrometheusNumber(fields[i].value, out_);
+    out_.Append('\n');
+  }
+}
+
+void FormatListingHeader(OutputFormat format, BufferedWriter& out) {
+  if (format == OutputFormat::kCsv) {
+    out.Append("key,type,size,value,bytes\n");
+  } else if (format == OutputFormat::kPrometheus) {
+    out.Append("# TYPE smctemp_key_value gauge\n");
+  }
+}
+
+void FormatListingEntry(OutputFormat format, const SmcVal_t& val, bool with_value, BufferedWriter& out) {
+  const size_t key_size = strnlen(val.key, sizeof(val.key));
+  const size_t type_size = strnlen(val.dataType, sizeof(val.dataType));
+  const bool have_value = with_value && val.dataSize > 0;
+  const double value = have_value ? DecodeSmcVal(val) : NAN;
+  switch (format) {
+    case OutputFormat::kText:
+      break;
+    case OutputFormat::kJsonLines:
+      out.Append("{\"key\":");
+      appendJsonString(val.key, key_size, out);
+      out.Append(",\"type\":");
+      appendJsonString(val.dataType, type_size, out);
+      out.Append(",\"size\":");
+      out.AppendUnsigned(val.dataSize);
+      if (with_value) {
+        out.Append(",\"value\":");
+        appendJsonNumber(value, out);
+        out.Append(",\"bytes\":\"");
+        appendHexBytes(val, out);
+        out.Append('"');
+      }
+      out.Append("}\n");
+      break;
+    case OutputFormat::kCsv:
+      appendCsvField(val.key, key_size, out);
+      out.Append(',');
+      appendCsvField(val.dataType, type_size, out);
+      out.Append(',');
+      out.AppendUnsigned(val.dataSize);
+      out.Append(',');
+      if (have_value && std::isfinite(value)) {
+        out.AppendNumber(value);
+      }
+      out.Append(',');
+      appendHexBytes(val, out);
+      out.Append('\n');
+      break;
+    case OutputFormat::kInflux:
+      // Tag values may not be empty, so an unknown type is left out.
+      out.Append("smc,key=");
+      appendInfluxName(val.key, key_size, out);
+      if (type_size > 0) {
+        out.Append(",type=");
+        appendInfluxName(val.dataType, type_size, out);
+      }
+      out.Append(" size=");
+      out.AppendUnsigned(val.dataSize);
+      out.Append('i');
+      if (have_value && std::isfinite(value)) {
+        out.Append(",value=");
+        out.AppendNumber(value);
+        out.Append(",bytes=\"");
+        appendHexBytes(val, out);
+        out.Append('"');
+      }
+      out.Append('\n');
+      break;
+    case OutputFormat::kPrometheus:
+      out.Append("smctemp_key_value{key=");
+      appendPrometheusLabel(val.key, key_size, out);
+      out.Append("} ");
+      appendPrometheusNumber(value, out);
+      out.Append('\n');
+      break;
+  }
+}
+}
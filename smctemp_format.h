@@ -0,0 +1,58 @@
+#ifndef SMCTEMP_SMCTEMP_FORMAT_H_
+#define SMCTEMP_SMCTEMP_FORMAT_H_
+#include <cstddef>
+#include <cstdint>
+
+#include "smctemp_types.h"
+#include "smctemp_writer.h"
+
+namespace smctemp {
+// How -c, -g, --snapshot, --stream and -l print. kText is the plain output;
+// the others are meant to be ingested by collectors as they are.
+enum class OutputFormat {
+  kText,
+  kJsonLines,   // one JSON object per line
+  kCsv,         // a header line, then one row per sample or key
+  kInflux,      // InfluxDB line protocol, nanosecond timestamps
+  kPrometheus,  // Prometheus text exposition format
+};
+
+// Accepts "text", "json", "csv", "influx" and "prometheus".
+bool ParseOutputFormat(const char* name, OutputFormat& format);
+const char* OutputFormatName(OutputFormat format);
+
+typedef struct {
+  const char* name;   // "cpu", "gpu", "cpu_p95", ... or an SMC key
+  double      value;
+  bool        isKey;  // name is an SMC key, not a temperature we derived
+} OutputField_t;
+
+// Renders samples into BufferedWriter's fixed buffer and writes each with a
+// single write(2). Numbers go through std::to_chars, so a sample neither
+// allocates nor depends on the locale. kText prints the values separated by
+// spaces with one decimal, as smctemp always has.
+class SampleFormatter {
+ private:
+  void AppendInflux(int64_t realtime_ns, const OutputField_t* fields, size_t count);
+  void AppendPrometheus(const OutputField_t* fields, size_t count);
+
+  const OutputFormat format_;
+  BufferedWriter out_;
+  bool wrote_header_ = false;
+
+ public:
+  SampleFormatter(int fd, OutputFormat format);
+  // Every call must pass the same fields in the same order; the CSV header
+  // and the Prometheus TYPE lines come with the first one. False if the
+  // write failed.
+  bool Write(int64_t realtime_ns, const OutputField_t* fields, size_t count);
+};
+
+// The lines of -l in formats other than kText. The header (CSV columns, the
+// Prometheus TYPE line) goes before the first key. An entry without a value
+// (--index-only) has only the key, type and size; a key that could not be
+// read has dataSize 0.
+void FormatListingHeader(OutputFormat format, BufferedWriter& out);
+void FormatListingEntry(OutputFormat format, const SmcVal_t& val, bool with_value, BufferedWriter& out);
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_FORMAT_H_
@@ -0,0 +1,72 @@
+#include "smctemp_manifest.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <utility>
+
+#include "smctemp_file.h"
+#include "smctemp_string.h"
+
+namespace smctemp {
+namespace {
+constexpr uint32_t kSensorManifestMagic = 0x534d534d;  // "SMSM"
+constexpr uint32_t kSensorManifestVersion = 1;
+// More keys than any chip has; anything above is a corrupt header.
+constexpr uint32_t kSensorManifestMaxKeys = 1024;
+}
+
+SensorManifestFile::SensorManifestFile(std::string path, const std::string& model, uint32_t smc_key_count)
+    : path_(std::move(path)),
+      model_hash_(string_util::fnv1a(model)),
+      smc_key_count_(smc_key_count) {
+}
+
+bool SensorManifestFile::Load(SensorKeys_t& keys) const {
+  int fd = open(path_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  Header header;
+  bool ok = read(fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header)) &&
+            header.magic == kSensorManifestMagic &&
+            header.version == kSensorManifestVersion &&
+            header.modelHash == model_hash_ &&
+            header.smcKeyCount == smc_key_count_ &&
+            size_t{header.cpuCount} + header.auxCpuCount + header.gpuCount <= kSensorManifestMaxKeys;
+  if (ok) {
+    std::vector<uint32_t>* groups[] = {&keys.cpu, &keys.auxCpu, &keys.gpu};
+    const uint32_t counts[] = {header.cpuCount, header.auxCpuCount, header.gpuCount};
+    for (size_t i = 0; ok && i < 3; i++) {
+      groups[i]->resize(counts[i]);
+      const ssize_t size = static_cast<ssize_t>(counts[i] * sizeof(uint32_t));
+      ok = read(fd, groups[i]->data(), size) == size;
+    }
+    char extra;
+    ok = ok && read(fd, &extra, 1) == 0;
+  }
+  close(fd);
+  return ok;
+}
+
+bool SensorManifestFile::Save(const SensorKeys_t& keys) const {
+  Header header;
+  header.magic = kSensorManifestMagic;
+  header.version = kSensorManifestVersion;
+  header.modelHash = model_hash_;
+  header.smcKeyCount = smc_key_count_;
+  header.cpuCount = static_cast<uint32_t>(keys.cpu.size());
+  header.auxCpuCount = static_cast<uint32_t>(keys.auxCpu.size());
+  header.gpuCount = static_cast<uint32_t>(keys.gpu.size());
+
+  return ReplaceFile(path_, [&](int fd) {
+    bool ok = write(fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header));
+    for (const std::vector<uint32_t>* group : {&keys.cpu, &keys.auxCpu, &keys.gpu}) {
+      const ssize_t size = static_cast<ssize_t>(group->size() * sizeof(uint32_t));
+      ok = ok && write(fd, group->data(), size) == size;
+    }
+    return ok;
+  });
+}
+}
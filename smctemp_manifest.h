@@ -0,0 +1,42 @@
+#ifndef SMCTEMP_SMCTEMP_MANIFEST_H_
+#define SMCTEMP_SMCTEMP_MANIFEST_H_
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace smctemp {
+// Sensor keys found live on one machine, grouped like ChipSensors_t.
+typedef struct {
+  std::vector<uint32_t> cpu;
+  std::vector<uint32_t> auxCpu;
+  std::vector<uint32_t> gpu;
+} SensorKeys_t;
+
+// The sensor keys probed on this machine, kept so that later runs skip the
+// probe. The file is a fixed header followed by the CPU, aux CPU and GPU
+// keys. Like KeyInfoCacheFile, it is only trusted for the same model and SMC
+// key count, and it is replaced atomically.
+class SensorManifestFile {
+ private:
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t modelHash;
+    uint32_t smcKeyCount;
+    uint32_t cpuCount;
+    uint32_t auxCpuCount;
+    uint32_t gpuCount;
+  };
+
+  std::string path_;
+  uint64_t model_hash_;
+  uint32_t smc_key_count_;
+
+ public:
+  SensorManifestFile(std::string path, const std::string& model, uint32_t smc_key_count);
+  // False when the file is missing, malformed or from another machine.
+  bool Load(SensorKeys_t& keys) const;
+  bool Save(const SensorKeys_t& keys) const;
+};
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_MANIFEST_H_
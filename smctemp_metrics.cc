@@ -0,0 +1,149 @@
+#include "smctemp_metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <ostream>
+
+#include "smctemp_string.h"
+
+namespace smctemp {
+size_t LatencyHistogram::BucketOf(uint64_t ns) {
+  constexpr uint64_t kSubBuckets = uint64_t{1} << kSubBucketBits;
+  if (ns < kSubBuckets) {
+    return ns;
+  }
+  if (ns >= uint64_t{1} << kMaxBits) {
+    return kBuckets - 1;
+  }
+  const int exponent = 63 - __builtin_clzll(ns);
+  const uint64_t sub_bucket = (ns >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+  return (size_t(exponent - kSubBucketBits + 1) << kSubBucketBits) + sub_bucket;
+}
+
+uint64_t LatencyHistogram::BucketUpperNs(size_t bucket) {
+  constexpr uint64_t kSubBuckets = uint64_t{1} << kSubBucketBits;
+  if (bucket < kSubBuckets) {
+    return bucket;
+  }
+  const int shift = static_cast<int>(bucket >> kSubBucketBits) - 1;
+  const uint64_t lower = (kSubBuckets + (bucket & (kSubBuckets - 1))) << shift;
+  return lower + (uint64_t{1} << shift) - 1;
+}
+
+void LatencyHistogram::Record(int64_t ns) {
+  const uint64_t value = ns > 0 ? static_cast<uint64_t>(ns) : 0;
+  buckets_[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+  sum_ns_.fetch_add(value, std::memory_order_relaxed);
+  uint64_t max = max_ns_.load(std::memory_order_relaxed);
+  while (value > max && !max_ns_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+uint64_t LatencyHistogram::Count() const {
+  uint64_t count = 0;
+  for (const std::atomic<uint64_t>& bucket : buckets_) {
+    count += bucket.load(std::memory_order_relaxed);
+  }
+  return count;
+}
+
+double LatencyHistogram::MeanNs() const {
+  const uint64_t count = Count();
+  return count > 0 ? static_cast<double>(sum_ns_.load(std::memory_order_relaxed)) / count : 0.0;
+}
+
+uint64_t LatencyHistogram::PercentileNs(double q) const {
+  const uint64_t count = Count();
+  if (count == 0) {
+    return 0;
+  }
+  const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * count)));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; i++) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      return std::min(BucketUpperNs(i), MaxNs());
+    }
+  }
+  return MaxNs();
+}
+
+void KeyFailureCounts::Add(uint32_t key) {
+  // 0 marks a free slot; no SMC key is all zero bytes.
+  const size_t start = (key * 0x9e3779b1u) % kMaxKeys;
+  for (size_t probe = 0; probe < kMaxKeys; probe++) {
+    const size_t i = (start + probe) % kMaxKeys;
+    uint32_t slot = keys_[i].load(std::memory_order_acquire);
+    if (slot == 0 && keys_[i].compare_exchange_strong(slot, key, std::memory_order_acq_rel)) {
+      slot = key;
+    }
+    if (slot == key) {
+      failures_[i].fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+  overflow_.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t KeyFailureCounts::Get(uint32_t key) const {
+  const size_t start = (key * 0x9e3779b1u) % kMaxKeys;
+  for (size_t probe = 0; probe < kMaxKeys; probe++) {
+    const size_t i = (start + probe) % kMaxKeys;
+    const uint32_t slot = keys_[i].load(std::memory_order_acquire);
+    if (slot == key) {
+      return failures_[i].load(std::memory_order_relaxed);
+    }
+    if (slot == 0) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+void SmcMetrics::Print(std::ostream& out) const {
+  const struct {
+    const char* name;
+    const LatencyHistogram& histogram;
+    const std::atomic<uint64_t>* calls;
+  } histograms[] = {
+    {"open", open, nullptr},
+    {"key_info_calls", keyInfoCalls.latency, &keyInfoCalls.calls},
+    {"read_calls", readCalls.latency, &readCalls.calls},
+    {"index_calls", indexCalls.latency, &indexCalls.calls},
+    {"samples", samples, nullptr},
+    {"fail_soft_stores", failSoftStores, nullptr},
+  };
+  for (const auto& entry : histograms) {
+    const LatencyHistogram& h = entry.histogram;
+    out << entry.name;
+    if (entry.calls != nullptr) {
+      out << " calls " << entry.calls->load(std::memory_order_relaxed);
+    }
+    out << " count " << h.Count() << " mean_ns " << static_cast<uint64_t>(h.MeanNs())
+      << " p50_ns " << h.PercentileNs(0.5) << " p99_ns " << h.PercentileNs(0.99)
+      << " max_ns " << h.MaxNs() << "\n";
+  }
+  const struct {
+    const char* name;
+    const std::atomic<uint64_t>& counter;
+  } counters[] = {
+    {"call_failures", callFailures},
+    {"keys_not_found", keysNotFound},
+    {"key_info_hits", keyInfoHits},
+    {"key_info_misses", keyInfoMisses},
+    {"retries", retries},
+    {"invalid_readings", invalidReadings},
+  };
+  for (const auto& entry : counters) {
+    out << entry.name << " " << entry.counter.load(std::memory_order_relaxed) << "\n";
+  }
+  keyFailures.ForEach([&out](uint32_t key, uint64_t failures) {
+    char name[5];
+    string_util::ultostr(name, sizeof(name), key);
+    out << "key_failures " << name << " " << failures << "\n";
+  });
+  if (keyFailures.Overflow() > 0) {
+    out << "key_failures_other " << keyFailures.Overflow() << "\n";
+  }
+}
+}
@@ -0,0 +1,100 @@
+#ifndef SMCTEMP_SMCTEMP_METRICS_H_
+#define SMCTEMP_SMCTEMP_METRICS_H_
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+
+namespace smctemp {
+// Latencies in nanoseconds, in log-linear buckets: 16 per power of two, so
+// any percentile is within 1/16 of the recorded value, from 1 ns up to about
+// 18 minutes. Recording is two relaxed atomic adds and never blocks; the
+// count is summed from the buckets when read.
+class LatencyHistogram {
+ private:
+  static constexpr int kSubBucketBits = 4;
+  static constexpr int kMaxBits = 40;
+  static constexpr size_t kBuckets = size_t{kMaxBits - kSubBucketBits + 1} << kSubBucketBits;
+
+  std::atomic<uint64_t> buckets_[kBuckets] = {};
+  std::atomic<uint64_t> sum_ns_{0};
+  std::atomic<uint64_t> max_ns_{0};
+
+ public:
+  static size_t BucketOf(uint64_t ns);
+  // The largest latency that falls into bucket.
+  static uint64_t BucketUpperNs(size_t bucket);
+
+  void Record(int64_t ns);
+  uint64_t Count() const;
+  double MeanNs() const;
+  uint64_t MaxNs() const { return max_ns_.load(std::memory_order_relaxed); }
+  // Upper bound of the bucket holding the q-quantile; 0 if empty.
+  uint64_t PercentileNs(double q) const;
+};
+
+// Failure counts of up to kMaxKeys keys in an open-addressed table whose
+// slots are claimed with a CAS, so counting takes no lock. Keys beyond the
+// table are only counted in Overflow().
+class KeyFailureCounts {
+ private:
+  static constexpr size_t kMaxKeys = 64;
+  std::atomic<uint32_t> keys_[kMaxKeys] = {};
+  std::atomic<uint64_t> failures_[kMaxKeys] = {};
+  std::atomic<uint64_t> overflow_{0};
+
+ public:
+  void Add(uint32_t key);
+  uint64_t Get(uint32_t key) const;
+  uint64_t Overflow() const { return overflow_.load(std::memory_order_relaxed); }
+  // Calls visit(key, failures) for every key counted so far.
+  template <typename Visit>
+  void ForEach(Visit visit) const {
+    for (size_t i = 0; i < kMaxKeys; i++) {
+      const uint32_t key = keys_[i].load(std::memory_order_acquire);
+      if (key != 0) {
+        visit(key, failures_[i].load(std::memory_order_relaxed));
+      }
+    }
+  }
+};
+
+// Calls of one SMC command. Every call is counted but only one in
+// kTimingPeriod is timed, starting with the first: reading the clock twice
+// costs more than a simulated call and a good part of a real one.
+struct SmcCallMetrics {
+  static constexpr uint64_t kTimingPeriod = 16;
+  std::atomic<uint64_t> calls{0};
+  LatencyHistogram latency;
+
+  // Counts a call and tells whether to time it.
+  bool Count() { return calls.fetch_add(1, std::memory_order_relaxed) % kTimingPeriod == 0; }
+};
+
+// Counters and latencies of the SMC read path. SmcAccessor and SmcTemp only
+// record into one when it was handed to them, so with instrumentation off
+// the hot path pays a null check.
+struct SmcMetrics {
+  // SmcAccessor
+  LatencyHistogram open;          // opening the transport (IOServiceOpen)
+  SmcCallMetrics keyInfoCalls;    // kSmcCmdReadKeyInfo
+  SmcCallMetrics readCalls;       // kSmcCmdReadBytes
+  SmcCallMetrics indexCalls;      // kSmcCmdReadIndex
+  std::atomic<uint64_t> callFailures{0};  // the call itself failed
+  std::atomic<uint64_t> keysNotFound{0};  // the SMC has no such key
+  std::atomic<uint64_t> keyInfoHits{0};
+  std::atomic<uint64_t> keyInfoMisses{0};
+  KeyFailureCounts keyFailures;
+  // SmcTemp
+  LatencyHistogram samples;         // GetCpuTemp() and GetGpuTemp()
+  LatencyHistogram failSoftStores;  // storing the last valid value
+  std::atomic<uint64_t> retries{0};  // passes after the first of a sample
+  std::atomic<uint64_t> invalidReadings{0};
+
+  // One line per histogram with its count, mean, p50, p99 and max (and the
+  // calls, for the SMC commands), one per counter, then the failures of each
+  // key.
+  void Print(std::ostream& out) const;
+};
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_METRICS_H_
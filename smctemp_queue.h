@@ -0,0 +1,82 @@
+#ifndef SMCTEMP_SMCTEMP_QUEUE_H_
+#define SMCTEMP_SMCTEMP_QUEUE_H_
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace smctemp {
+// Bounded lock-free queue for many producers and one consumer. Every cell
+// carries a sequence number telling whether it is free for the producer at
+// that position or filled for the consumer, so producers only contend on the
+// tail counter and never wait for each other. The capacity is rounded up to a
+// power of two.
+template <typename T>
+class BoundedMpscQueue {
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+  static size_t RoundUp(size_t capacity) {
+    size_t rounded = 2;
+    while (rounded < capacity) {
+      rounded <<= 1;
+    }
+    return rounded;
+  }
+
+  const size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) size_t head_ = 0;
+
+ public:
+  explicit BoundedMpscQueue(size_t capacity)
+      : mask_(RoundUp(capacity) - 1),
+        cells_(new Cell[mask_ + 1]) {
+    for (size_t i = 0; i <= mask_; i++) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+  BoundedMpscQueue(const BoundedMpscQueue&) = delete;
+  BoundedMpscQueue& operator=(const BoundedMpscQueue&) = delete;
+
+  // False if the queue is full.
+  bool Push(const T& value) {
+    size_t position = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = cells_[position & mask_];
+      const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      const intptr_t distance = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+      if (distance == 0) {
+        if (tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+          cell.value = value;
+          cell.sequence.store(position + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (distance < 0) {
+        return false;
+      } else {
+        position = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Consumer side only. False if the queue is empty or the next value is
+  // still being written.
+  bool Pop(T& value) {
+    Cell& cell = cells_[head_ & mask_];
+    if (cell.sequence.load(std::memory_order_acquire) != head_ + 1) {
+      return false;
+    }
+    value = cell.value;
+    cell.sequence.store(head_ + mask_ + 1, std::memory_order_release);
+    head_++;
+    return true;
+  }
+
+  size_t Capacity() const { return mask_ + 1; }
+};
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_QUEUE_H_
@@ -0,0 +1,138 @@
+#include "smctemp_shm.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <utility>
+
+namespace smctemp {
+namespace {
+constexpr uint32_t kSharedSampleMagic = 0x534d5348;  // "SMSH"
+constexpr uint32_t kSharedSampleVersion = 2;
+// Yields a writer waits for another one before taking the segment over from
+// a daemon that died while publishing, as LastValidStore does.
+constexpr unsigned int kSharedSampleTakeoverSpins = 10'000;
+}
+
+SharedSampleWriter::SharedSampleWriter(std::string name) : name_(std::move(name)) {
+  int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return;
+  }
+  if (ftruncate(fd, sizeof(SharedSampleSegment)) != 0) {
+    close(fd);
+    return;
+  }
+  void* map = mmap(nullptr, sizeof(SharedSampleSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return;
+  }
+  segment_ = static_cast<SharedSampleSegment*>(map);
+  segment_->sampleSize = sizeof(SharedSample_t);
+  segment_->version = kSharedSampleVersion;
+  std::atomic_thread_fence(std::memory_order_release);
+  segment_->magic = kSharedSampleMagic;
+}
+
+SharedSampleWriter::~SharedSampleWriter() {
+  if (segment_ != nullptr) {
+    munmap(segment_, sizeof(SharedSampleSegment));
+  }
+}
+
+void SharedSampleWriter::Publish(const SharedSample_t& sample) {
+  if (segment_ == nullptr) {
+    return;
+  }
+  uint64_t words[kSharedSampleWords] = {};
+  memcpy(words, &sample, sizeof(sample));
+
+  uint32_t sequence = segment_->sequence.load(std::memory_order_relaxed);
+  unsigned int spins = 0;
+  for (;;) {
+    if ((sequence & 1) == 0 &&
+        segment_->sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire,
+                                                 std::memory_order_relaxed)) {
+      break;
+    }
+    if (sequence & 1) {
+      // Still odd after the takeover, so readers keep retrying until the
+      // store below.
+      if (++spins >= kSharedSampleTakeoverSpins &&
+          segment_->sequence.compare_exchange_strong(sequence, sequence + 2, std::memory_order_acquire,
+                                                     std::memory_order_relaxed)) {
+        sequence += 1;
+        break;
+      }
+      std::this_thread::yield();
+      sequence = segment_->sequence.load(std::memory_order_relaxed);
+    }
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t i = 0; i < kSharedSampleWords; i++) {
+    segment_->words[i].store(words[i], std::memory_order_relaxed);
+  }
+  segment_->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void SharedSampleWriter::Unlink() {
+  shm_unlink(name_.c_str());
+}
+
+SharedSampleReader::SharedSampleReader(const std::string& name) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return;
+  }
+  void* map = mmap(nullptr, sizeof(SharedSampleSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return;
+  }
+  const SharedSampleSegment* segment = static_cast<const SharedSampleSegment*>(map);
+  if (segment->magic != kSharedSampleMagic || segment->version != kSharedSampleVersion ||
+      segment->sampleSize != sizeof(SharedSample_t)) {
+    munmap(map, sizeof(SharedSampleSegment));
+    return;
+  }
+  segment_ = segment;
+}
+
+SharedSampleReader::~SharedSampleReader() {
+  if (segment_ != nullptr) {
+    munmap(const_cast<SharedSampleSegment*>(segment_), sizeof(SharedSampleSegment));
+  }
+}
+
+bool SharedSampleReader::Read(SharedSample_t& sample, unsigned int max_retries) const {
+  if (segment_ == nullptr) {
+    return false;
+  }
+  uint64_t words[kSharedSampleWords];
+  for (unsigned int attempt = 0; attempt <= max_retries; attempt++) {
+    const uint32_t before = segment_->sequence.load(std::memory_order_acquire);
+    if (before & 1) {
+      continue;
+    }
+    for (size_t i = 0; i < kSharedSampleWords; i++) {
+      words[i] = segment_->words[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (segment_->sequence.load(std::memory_order_relaxed) == before) {
+      memcpy(&sample, words, sizeof(sample));
+      return sample.timestampNs != 0;
+    }
+  }
+  return false;
+}
+
+bool IsSharedSampleCurrent(const SharedSample_t& sample, int64_t now_ns) {
+  const int64_t period_ns = std::max<int64_t>(sample.periodNs, 1'000'000'000);
+  return (now_ns - sample.timestampNs) / kSharedSampleStalePeriods <= period_ns;
+}
+}
@@ -0,0 +1,87 @@
+#ifndef SMCTEMP_SMCTEMP_SHM_H_
+#define SMCTEMP_SMCTEMP_SHM_H_
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace smctemp {
+constexpr char kDefaultSharedMemoryName[] = "/smctemp";
+constexpr size_t kSharedSampleMaxSensors = 32;
+constexpr uint32_t kSharedSampleCpuValid = 1;
+constexpr uint32_t kSharedSampleGpuValid = 2;
+// Periods without a newer sample after which a sample is stale.
+constexpr int64_t kSharedSampleStalePeriods = 3;
+
+typedef struct {
+  int64_t  timestampNs;  // CLOCK_REALTIME of the sample
+  uint64_t sequence;     // number of samples published so far
+  int64_t  periodNs;     // until the next sample is due
+  double   cpu;
+  double   gpu;
+  uint32_t flags;        // kSharedSampleCpuValid | kSharedSampleGpuValid
+  uint32_t sensorCount;
+  uint64_t validMask;    // bit i is set when values[i] passed validation
+  uint32_t keys[kSharedSampleMaxSensors];
+  double   values[kSharedSampleMaxSensors];
+} SharedSample_t;
+
+// Layout of the shared memory segment. The sample is guarded by a seqlock:
+// the sequence is odd while a writer is copying, and a reader retries when it
+// saw an odd sequence or the sequence changed under it. The payload is
+// stored as relaxed 64-bit atomics so that the racing copy is well defined.
+constexpr size_t kSharedSampleWords = (sizeof(SharedSample_t) + 7) / 8;
+struct alignas(64) SharedSampleSegment {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sampleSize;
+  alignas(64) std::atomic<uint32_t> sequence;
+  alignas(64) std::atomic<uint64_t> words[kSharedSampleWords];
+};
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+              "the shared segment needs address-free atomics");
+
+// Creates (or reuses) the segment and publishes samples into it. Publishing
+// from several threads or processes is serialized on the sequence; a writer
+// that finds it held for kSharedSampleTakeoverSpins yields takes it over, so
+// a daemon restarted after dying mid-publish does not hang.
+class SharedSampleWriter {
+ private:
+  std::string name_;
+  SharedSampleSegment* segment_ = nullptr;
+
+ public:
+  explicit SharedSampleWriter(std::string name = kDefaultSharedMemoryName);
+  ~SharedSampleWriter();
+  SharedSampleWriter(const SharedSampleWriter&) = delete;
+  SharedSampleWriter& operator=(const SharedSampleWriter&) = delete;
+
+  bool IsOpen() const { return segment_ != nullptr; }
+  void Publish(const SharedSample_t& sample);
+  // Removes the segment name; mapped readers keep their view.
+  void Unlink();
+};
+
+// Maps the segment read-only. Read() takes no locks and makes no system calls.
+class SharedSampleReader {
+ private:
+  const SharedSampleSegment* segment_ = nullptr;
+
+ public:
+  explicit SharedSampleReader(const std::string& name = kDefaultSharedMemoryName);
+  ~SharedSampleReader();
+  SharedSampleReader(const SharedSampleReader&) = delete;
+  SharedSampleReader& operator=(const SharedSampleReader&) = delete;
+
+  bool IsOpen() const { return segment_ != nullptr; }
+  // Copies a consistent snapshot. False if the segment is not mapped, nothing
+  // has been published yet, or a writer kept it busy for max_retries attempts.
+  bool Read(SharedSample_t& sample, unsigned int max_retries = 1000) const;
+};
+
+// False once kSharedSampleStalePeriods periods, and at least as many seconds,
+// have passed since the sample without a newer one: the daemon that
+// published it has exited without unlinking the segment, or is stuck.
+bool IsSharedSampleCurrent(const SharedSample_t& sample, int64_t now_ns);
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_SHM_H_
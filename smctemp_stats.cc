@@ -0,0 +1,164 @@
+#include "smctemp_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace smctemp {
+TemperatureHistogram::TemperatureHistogram()
+    : bins_((kMaxValue - kMinValue) * kBinsPerDegree),
+      degrees_(kMaxValue - kMinValue) {
+}
+
+size_t TemperatureHistogram::BinOf(double value) {
+  constexpr size_t kLastBin = (kMaxValue - kMinValue) * kBinsPerDegree - 1;
+  const double bin = std::floor((value - kMinValue) * kBinsPerDegree);
+  // Written so that NaN lands in the first bin.
+  if (!(bin > 0.0)) {
+    return 0;
+  }
+  return bin >= kLastBin ? kLastBin : static_cast<size_t>(bin);
+}
+
+void TemperatureHistogram::Add(double value) {
+  const size_t bin = BinOf(value);
+  bins_[bin]++;
+  degrees_[bin / kBinsPerDegree]++;
+  count_++;
+}
+
+void TemperatureHistogram::Remove(double value) {
+  const size_t bin = BinOf(value);
+  bins_[bin]--;
+  degrees_[bin / kBinsPerDegree]--;
+  count_--;
+}
+
+double TemperatureHistogram::Quantile(double q) const {
+  if (count_ == 0) {
+    return 0.0;
+  }
+  const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * count_)));
+  uint64_t seen = 0;
+  size_t degree = 0;
+  while (degree + 1 < degrees_.size() && seen + degrees_[degree] < rank) {
+    seen += degrees_[degree++];
+  }
+  size_t bin = degree * kBinsPerDegree;
+  while (bin + 1 < bins_.size() && seen + bins_[bin] < rank) {
+    seen += bins_[bin++];
+  }
+  return kMinValue + (bin + 0.5) / kBinsPerDegree;
+}
+
+RollingWindow::RollingWindow(std::chrono::nanoseconds window, size_t capacity)
+    : window_ns_(window.count()),
+      capacity_(std::max<size_t>(capacity, 1)),
+      samples_(capacity_),
+      min_queue_(capacity_),
+      max_queue_(capacity_) {
+}
+
+void RollingWindow::EvictFront() {
+  const Entry& oldest = samples_.Front();
+  if (min_queue_.Front().sequence == oldest.sequence) {
+    min_queue_.PopFront();
+  }
+  if (max_queue_.Front().sequence == oldest.sequence) {
+    max_queue_.PopFront();
+  }
+  sum_ -= oldest.value;
+  histogram_.Remove(oldest.value);
+  samples_.PopFront();
+}
+
+void RollingWindow::Add(int64_t time_ns, double value) {
+  Expire(time_ns);
+  if (samples_.Size() == capacity_) {
+    EvictFront();
+  }
+  const Entry entry = {sequence_++, time_ns, value};
+  samples_.PushBack(entry);
+  while (!min_queue_.Empty() && min_queue_.Back().value >= value) {
+    min_queue_.PopBack();
+  }
+  min_queue_.PushBack(entry);
+  while (!max_queue_.Empty() && max_queue_.Back().value <= value) {
+    max_queue_.PopBack();
+  }
+  max_queue_.PushBack(entry);
+  histogram_.Add(value);
+  sum_ += value;
+  // Resum once per capacity samples so that rounding errors do not pile up.
+  if (sequence_ % capacity_ == 0) {
+    sum_ = 0.0;
+    for (size_t i = 0; i < samples_.Size(); i++) {
+      sum_ += samples_.At(i).value;
+    }
+  }
+}
+
+void RollingWindow::Expire(int64_t now_ns) {
+  while (!samples_.Empty() && samples_.Front().timeNs <= now_ns - window_ns_) {
+    EvictFront();
+  }
+}
+
+double RollingWindow::Quantile(double q) const {
+  if (samples_.Empty()) {
+    return 0.0;
+  }
+  return std::clamp(histogram_.Quantile(q), Min(), Max());
+}
+
+Ewma::Ewma(std::chrono::nanoseconds time_constant)
+    : time_constant_ns_(static_cast<double>(time_constant.count())) {
+}
+
+void Ewma::Add(int64_t time_ns, double value) {
+  if (empty_ || time_constant_ns_ <= 0.0) {
+    value_ = value;
+    empty_ = false;
+  } else {
+    const double alpha = 1.0 - std::exp(-static_cast<double>(time_ns - last_ns_) / time_constant_ns_);
+    value_ += alpha * (value - value_);
+  }
+  last_ns_ = time_ns;
+}
+
+SeriesStats::SeriesStats(const StatsConfig_t& config)
+    : window_(config.window, config.capacity),
+      ewma_(config.ewmaTimeConstant) {
+}
+
+void SeriesStats::Add(int64_t time_ns, double value) {
+  window_.Add(time_ns, value);
+  ewma_.Add(time_ns, value);
+}
+
+StatsSnapshot_t SeriesStats::Snapshot(int64_t now_ns) {
+  window_.Expire(now_ns);
+  return {window_.Count(), window_.Last(), window_.Min(), window_.Max(), window_.Mean(),
+          ewma_.Value(), window_.Quantile(0.95), window_.Quantile(0.99)};
+}
+
+TemperatureStats::TemperatureStats(const StatsConfig_t& config, std::vector<uint32_t> keys)
+    : cpu_(config),
+      gpu_(config),
+      keys_(std::move(keys)) {
+  std::sort(keys_.begin(), keys_.end());
+  keys_.erase(std::unique(keys_.begin(), keys_.end()), keys_.end());
+  sensors_.reserve(keys_.size());
+  for (size_t i = 0; i < keys_.size(); i++) {
+    sensors_.emplace_back(config);
+  }
+}
+
+SeriesStats* TemperatureStats::Sensor(uint32_t key) {
+  auto it = std::lower_bound(keys_.begin(), keys_.end(), key);
+  if (it == keys_.end() || *it != key) {
+    return nullptr;
+  }
+  return &sensors_[it - keys_.begin()];
+}
+}
@@ -0,0 +1,157 @@
+#ifndef SMCTEMP_SMCTEMP_STATS_H_
+#define SMCTEMP_SMCTEMP_STATS_H_
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace smctemp {
+// Counts of temperatures in bins of 1/kBinsPerDegree degrees from kMinValue
+// to kMaxValue, with a total per degree so that finding a quantile scans a
+// few hundred counters. Adding and removing are O(1); values out of range
+// count in the first or last bin.
+class TemperatureHistogram {
+ private:
+  static constexpr int kMinValue = -64;
+  static constexpr int kMaxValue = 192;
+  static constexpr int kBinsPerDegree = 32;
+  static size_t BinOf(double value);
+
+  std::vector<uint32_t> bins_;
+  std::vector<uint32_t> degrees_;
+  uint64_t count_ = 0;
+
+ public:
+  TemperatureHistogram();
+  void Add(double value);
+  void Remove(double value);
+  // The middle of the bin holding the nearest-rank q-quantile; 0 if empty.
+  double Quantile(double q) const;
+};
+
+// Min, max, mean and quantiles of the samples added during the last window,
+// keeping at most capacity of them. Min and max come from monotonic queues
+// and quantiles from a TemperatureHistogram, so adding a sample is amortized
+// O(1) and reading a statistic is O(1) but for the quantiles' scan. Nothing
+// is allocated after construction.
+class RollingWindow {
+ private:
+  struct Entry {
+    uint64_t sequence;
+    int64_t  timeNs;
+    double   value;
+  };
+  // Fixed-capacity double-ended queue.
+  class Ring {
+   private:
+    std::vector<Entry> entries_;
+    size_t head_ = 0;
+    size_t size_ = 0;
+
+   public:
+    explicit Ring(size_t capacity) : entries_(capacity) {}
+    size_t Size() const { return size_; }
+    bool Empty() const { return size_ == 0; }
+    const Entry& Front() const { return entries_[head_]; }
+    const Entry& Back() const { return entries_[(head_ + size_ - 1) % entries_.size()]; }
+    const Entry& At(size_t i) const { return entries_[(head_ + i) % entries_.size()]; }
+    void PushBack(const Entry& entry) {
+      entries_[(head_ + size_) % entries_.size()] = entry;
+      size_++;
+    }
+    void PopFront() {
+      head_ = (head_ + 1) % entries_.size();
+      size_--;
+    }
+    void PopBack() { size_--; }
+  };
+  void EvictFront();
+
+  const int64_t window_ns_;
+  const size_t capacity_;
+  Ring samples_;
+  Ring min_queue_;
+  Ring max_queue_;
+  TemperatureHistogram histogram_;
+  uint64_t sequence_ = 0;
+  double sum_ = 0.0;
+
+ public:
+  RollingWindow(std::chrono::nanoseconds window, size_t capacity);
+  // time_ns must not go backwards.
+  void Add(int64_t time_ns, double value);
+  // Drops the samples older than the window ending at now_ns.
+  void Expire(int64_t now_ns);
+  size_t Count() const { return samples_.Size(); }
+  double Min() const { return min_queue_.Empty() ? 0.0 : min_queue_.Front().value; }
+  double Max() const { return max_queue_.Empty() ? 0.0 : max_queue_.Front().value; }
+  double Mean() const { return samples_.Empty() ? 0.0 : sum_ / samples_.Size(); }
+  double Last() const { return samples_.Empty() ? 0.0 : samples_.Back().value; }
+  // Within 1/64 degree of the nearest-rank quantile, and never beyond Min()
+  // or Max().
+  double Quantile(double q) const;
+};
+
+// Exponentially weighted moving average with a time constant, so irregular
+// sample intervals weigh correctly.
+class Ewma {
+ private:
+  const double time_constant_ns_;
+  double value_ = 0.0;
+  int64_t last_ns_ = 0;
+  bool empty_ = true;
+
+ public:
+  explicit Ewma(std::chrono::nanoseconds time_constant);
+  void Add(int64_t time_ns, double value);
+  double Value() const { return value_; }
+};
+
+typedef struct {
+  uint64_t count;  // samples in the window
+  double   last;
+  double   min;    // over the window
+  double   max;
+  double   mean;
+  double   ewma;
+  double   p95;    // over the window
+  double   p99;
+} StatsSnapshot_t;
+
+typedef struct {
+  std::chrono::nanoseconds window;        // of min, max, mean and quantiles
+  size_t capacity;                        // samples kept per window
+  std::chrono::nanoseconds ewmaTimeConstant;
+} StatsConfig_t;
+
+// The statistics of one temperature series.
+class SeriesStats {
+ private:
+  RollingWindow window_;
+  Ewma ewma_;
+
+ public:
+  explicit SeriesStats(const StatsConfig_t& config);
+  void Add(int64_t time_ns, double value);
+  StatsSnapshot_t Snapshot(int64_t now_ns);
+};
+
+// SeriesStats of the CPU and GPU temperatures and of each sensor key. All
+// series are allocated at construction.
+class TemperatureStats {
+ private:
+  SeriesStats cpu_;
+  SeriesStats gpu_;
+  std::vector<uint32_t> keys_;  // sorted
+  std::vector<SeriesStats> sensors_;
+
+ public:
+  TemperatureStats(const StatsConfig_t& config, std::vector<uint32_t> keys);
+  SeriesStats& Cpu() { return cpu_; }
+  SeriesStats& Gpu() { return gpu_; }
+  // Null for keys not given at construction.
+  SeriesStats* Sensor(uint32_t key);
+  const std::vector<uint32_t>& Keys() const { return keys_; }
+};
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_STATS_H_
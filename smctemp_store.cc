@@ -0,0 +1,157 @@
+#include "smctemp_store.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <thread>
+
+#include "smctemp_clock.h"
+
+namespace smctemp {
+namespace {
+constexpr uint32_t kLastValidMagic = 0x534d4c56;  // "SMLV"
+constexpr uint32_t kLastValidVersion = 1;
+// Yields a writer waits for another one before taking the record over from
+// a process that died while storing.
+constexpr unsigned int kLastValidTakeoverSpins = 10'000;
+
+int64_t WallNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+uint32_t Checksum(const LastValid_t& record) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&record);
+  uint32_t hash = 0x811c9dc5;
+  for (size_t i = 0; i < offsetof(LastValid_t, checksum); i++) {
+    hash = (hash ^ bytes[i]) * 0x01000193;
+  }
+  return hash;
+}
+}
+
+LastValidStore::LastValidStore(const std::string& path, double resolution, std::chrono::nanoseconds refresh)
+    : resolution_(resolution),
+      refresh_ns_(refresh.count()) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (st.st_size != sizeof(LastValidFile) && ftruncate(fd, sizeof(LastValidFile)) != 0)) {
+    close(fd);
+    return;
+  }
+  void* map = mmap(nullptr, sizeof(LastValidFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return;
+  }
+  file_ = static_cast<LastValidFile*>(map);
+  if (file_->magic != kLastValidMagic || file_->version != kLastValidVersion ||
+      file_->recordSize != sizeof(LastValid_t)) {
+    // New or foreign file. Zeroed words fail the checksum, so a reader
+    // racing with this sees no record rather than a wrong one.
+    file_->sequence.store(0, std::memory_order_relaxed);
+    for (size_t i = 0; i < kLastValidWords; i++) {
+      file_->words[i].store(0, std::memory_order_relaxed);
+    }
+    file_->recordSize = sizeof(LastValid_t);
+    file_->version = kLastValidVersion;
+    std::atomic_thread_fence(std::memory_order_release);
+    file_->magic = kLastValidMagic;
+  }
+}
+
+LastValidStore::~LastValidStore() {
+  if (file_ != nullptr) {
+    munmap(file_, sizeof(LastValidFile));
+  }
+}
+
+void LastValidStore::Store(double value, uint32_t sensor_count) {
+  if (file_ == nullptr) {
+    return;
+  }
+  const int64_t now = MonotonicNs();
+  if (writes_ > 0 && std::fabs(value - last_value_) < resolution_ && now - last_store_ns_ < refresh_ns_) {
+    coalesced_++;
+    return;
+  }
+  LastValid_t record;
+  memset(&record, 0, sizeof(record));
+  record.value = value;
+  record.monotonicNs = now;
+  record.wallNs = WallNs();
+  record.sensorCount = sensor_count;
+  record.checksum = Checksum(record);
+  uint64_t words[kLastValidWords] = {};
+  memcpy(words, &record, sizeof(record));
+
+  uint32_t sequence = file_->sequence.load(std::memory_order_relaxed);
+  unsigned int spins = 0;
+  for (;;) {
+    if ((sequence & 1) == 0 &&
+        file_->sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire,
+                                              std::memory_order_relaxed)) {
+      sequence++;
+      break;
+    }
+    if (sequence & 1) {
+      if (++spins >= kLastValidTakeoverSpins &&
+          file_->sequence.compare_exchange_strong(sequence, sequence + 2, std::memory_order_acquire,
+                                                  std::memory_order_relaxed)) {
+        sequence += 2;
+        break;
+      }
+      std::this_thread::yield();
+      sequence = file_->sequence.load(std::memory_order_relaxed);
+    }
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t i = 0; i < kLastValidWords; i++) {
+    file_->words[i].store(words[i], std::memory_order_relaxed);
+  }
+  file_->sequence.store(sequence + 1, std::memory_order_release);
+  last_value_ = value;
+  last_store_ns_ = now;
+  writes_++;
+}
+
+bool LastValidStore::Load(LastValid_t& record) const {
+  if (file_ == nullptr) {
+    return false;
+  }
+  uint64_t words[kLastValidWords];
+  for (unsigned int attempt = 0; attempt < 1000; attempt++) {
+    const uint32_t before = file_->sequence.load(std::memory_order_acquire);
+    for (size_t i = 0; i < kLastValidWords; i++) {
+      words[i] = file_->words[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const bool stable = (before & 1) == 0 && file_->sequence.load(std::memory_order_relaxed) == before;
+    memcpy(&record, words, sizeof(record));
+    // A sequence left odd by a dead writer never settles; the checksum
+    // still tells whether the words it left behind are whole.
+    if ((stable || attempt == 999) && record.checksum == Checksum(record)) {
+      return true;
+    }
+    if (stable) {
+      return false;
+    }
+  }
+  return false;
+}
+
+int64_t LastValidStore::AgeNs(const LastValid_t& record) {
+  return std::max(MonotonicNs() - record.monotonicNs, WallNs() - record.wallNs);
+}
+}
@@ -0,0 +1,64 @@
+#ifndef SMCTEMP_SMCTEMP_STORE_H_
+#define SMCTEMP_SMCTEMP_STORE_H_
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace smctemp {
+typedef struct {
+  double   value;
+  int64_t  monotonicNs;  // CLOCK_MONOTONIC when stored
+  int64_t  wallNs;       // CLOCK_REALTIME when stored
+  uint32_t sensorCount;  // sensors averaged into value
+  uint32_t checksum;     // FNV-1a of the fields above
+} LastValid_t;
+
+// Layout of the store file: a header and one LastValid_t behind a seqlock,
+// as in SharedSampleSegment.
+constexpr size_t kLastValidWords = (sizeof(LastValid_t) + 7) / 8;
+struct alignas(64) LastValidFile {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t recordSize;
+  alignas(64) std::atomic<uint32_t> sequence;
+  alignas(64) std::atomic<uint64_t> words[kLastValidWords];
+};
+
+// The last valid temperature, kept for fail-soft reads in a small file that
+// every process using it maps. Storing is a few memory writes and no system
+// call, and is coalesced: the record is only rewritten when the value moves
+// by at least resolution or the record is older than refresh. The checksum
+// lets a reader tell a valid record from an empty file or from the torn
+// write of a process that died while storing.
+class LastValidStore {
+ private:
+  LastValidFile* file_ = nullptr;
+  const double resolution_;
+  const int64_t refresh_ns_;
+  double last_value_ = 0.0;
+  int64_t last_store_ns_ = 0;
+  uint64_t writes_ = 0;
+  uint64_t coalesced_ = 0;
+
+ public:
+  explicit LastValidStore(const std::string& path, double resolution = 0.05,
+                          std::chrono::nanoseconds refresh = std::chrono::seconds(1));
+  ~LastValidStore();
+  LastValidStore(const LastValidStore&) = delete;
+  LastValidStore& operator=(const LastValidStore&) = delete;
+
+  bool IsOpen() const { return file_ != nullptr; }
+  void Store(double value, uint32_t sensor_count);
+  // False if the file holds no valid record.
+  bool Load(LastValid_t& record) const;
+  // How long ago the record was stored: the larger of its monotonic and wall
+  // clock ages, so that neither a reboot nor a clock change makes an old
+  // value look fresh.
+  static int64_t AgeNs(const LastValid_t& record);
+  uint64_t Writes() const { return writes_; }
+  uint64_t Coalesced() const { return coalesced_; }
+};
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_STORE_H_
@@ -1,5 +1,9 @@
 #include "smctemp_string.h"
 
+#include <fnmatch.h>
+
+#include <cstdio>
+#include <cstring>
 #include <string>
 namespace smctemp {
 namespace string_util {
@@ -23,5 +27,43 @@ void ultostr(char* str, size_t strlen, uint32_t val) {
           (unsigned int) val >> 8,
           (unsigned int) val);
 }
+
+uint64_t fnv1a(const std::string& str) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (unsigned char c : str) {
+    hash = (hash ^ c) * 0x100000001b3ull;
+  }
+  return hash;
+}
+}
+
+SmcKeyFilter::SmcKeyFilter(const std::string& spec) {
+  size_t start = 0;
+  while (start <= spec.size()) {
+    size_t end = spec.find(',', start);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+    std::string term = spec.substr(start, end - start);
+    if (!term.empty()) {
+      terms_.push_back({term.find_first_of("*?[") != std::string::npos, term});
+    }
+    start = end + 1;
+  }
+}
+
+bool SmcKeyFilter::Matches(uint32_t key) const {
+  if (terms_.empty()) {
+    return true;
+  }
+  char name[5];
+  string_util::ultostr(name, sizeof(name), key);
+  for (const Term& term : terms_) {
+    if (term.isGlob ? fnmatch(term.pattern.c_str(), name, 0) == 0
+                    : strncmp(name, term.pattern.c_str(), term.pattern.size()) == 0) {
+      return true;
+    }
+  }
+  return false;
 }
 }
@@ -2,12 +2,34 @@
 #define SMCTEMP_SMCTEMP_STRING_H_
 #include <cstdint>
 #include <cstdlib>
+#include <string>
+#include <vector>
 
 namespace smctemp {
 namespace string_util {
 uint32_t strtoul(const char * str, int size, int base);
 void ultostr(char* str, size_t strlen, uint32_t val);
+// 64-bit FNV-1a, used to fingerprint model names in cache files.
+uint64_t fnv1a(const std::string& str);
 }
+
+// Selects SMC keys by a comma separated list of terms. A term with *, ? or [
+// is a glob matched by fnmatch ("T?0*", "Tp0[1-4]"); any other term is a
+// prefix ("Tp", or a whole key "TC0P"). An empty filter matches every key.
+class SmcKeyFilter {
+ private:
+  struct Term {
+    bool isGlob;
+    std::string pattern;
+  };
+  std::vector<Term> terms_;
+
+ public:
+  SmcKeyFilter() = default;
+  explicit SmcKeyFilter(const std::string& spec);
+  bool Empty() const { return terms_.empty(); }
+  bool Matches(uint32_t key) const;
+};
 }
 #endif // #ifndef SMCTEMP_SMCTEMP_STRING_H_
 
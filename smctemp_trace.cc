@@ -0,0 +1,210 @@
+#include "smctemp_trace.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <ctime>
+#include <utility>
+
+#include "smctemp.h"
+#include "smctemp_clock.h"
+
+namespace smctemp {
+namespace {
+constexpr uint32_t kTraceMagic = 0x534d5452;  // "SMTR"
+constexpr uint32_t kTraceVersion = 1;
+constexpr size_t kTraceBatchRecords = 256;
+
+uint64_t ReplyId(uint8_t command, uint32_t key, uint32_t data32) {
+  return uint64_t{command} << 32 | (command == static_cast<uint8_t>(kSmcCmdReadIndex) ? data32 : key);
+}
+
+bool WriteAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+}
+
+RecordingSmcTransport::RecordingSmcTransport(std::unique_ptr<SmcTransport> transport, const std::string& path)
+    : transport_(std::move(transport)) {
+  pending_.reserve(kTraceBatchRecords);
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0) {
+    return;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  SmcTraceHeader_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kTraceMagic;
+  header.version = kTraceVersion;
+  header.recordSize = sizeof(SmcTraceRecord_t);
+  header.startRealtimeNs = static_cast<int64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+  if (!WriteAll(fd_, &header, sizeof(header))) {
+    close(fd_);
+    fd_ = -1;
+  }
+  start_ns_ = MonotonicNs();
+}
+
+RecordingSmcTransport::~RecordingSmcTransport() {
+  Flush();
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+void RecordingSmcTransport::Flush() {
+  if (fd_ >= 0 && !pending_.empty()) {
+    WriteAll(fd_, pending_.data(), pending_.size() * sizeof(SmcTraceRecord_t));
+  }
+  pending_.clear();
+}
+
+kern_return_t RecordingSmcTransport::Open() {
+  return transport_->Open();
+}
+
+kern_return_t RecordingSmcTransport::Close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Flush();
+  }
+  return transport_->Close();
+}
+
+kern_return_t RecordingSmcTransport::Call(int index, SmcKeyData_t *inputStructure,
+                                          SmcKeyData_t *outputStructure) {
+  const int64_t offset_ns = MonotonicNs() - start_ns_;
+  const kern_return_t status = transport_->Call(index, inputStructure, outputStructure);
+  if (fd_ < 0) {
+    return status;
+  }
+  SmcTraceRecord_t record;
+  memset(&record, 0, sizeof(record));
+  record.offsetNs = offset_ns;
+  record.status = status;
+  record.index = index;
+  record.key = inputStructure->key;
+  record.data32 = inputStructure->data32;
+  record.dataSize = inputStructure->keyInfo.dataSize;
+  record.command = static_cast<uint8_t>(inputStructure->data8);
+  record.result = static_cast<int8_t>(outputStructure->result);
+  record.keyAttributes = static_cast<uint8_t>(outputStructure->keyInfo.dataAttributes);
+  record.replyKey = outputStructure->key;
+  record.keyDataSize = outputStructure->keyInfo.dataSize;
+  record.keyDataType = outputStructure->keyInfo.dataType;
+  memcpy(record.bytes, outputStructure->bytes, sizeof(record.bytes));
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  pending_.push_back(record);
+  records_++;
+  if (pending_.size() == kTraceBatchRecords) {
+    Flush();
+  }
+  return status;
+}
+
+ReplaySmcTransport::ReplaySmcTransport(const std::string& path, Speed speed) : speed_(speed) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SmcTraceHeader_t)) {
+    close(fd);
+    return;
+  }
+  void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return;
+  }
+  const SmcTraceHeader_t* header = static_cast<const SmcTraceHeader_t*>(map);
+  if (header->magic != kTraceMagic || header->version != kTraceVersion ||
+      header->recordSize != sizeof(SmcTraceRecord_t)) {
+    munmap(map, st.st_size);
+    return;
+  }
+  map_ = map;
+  map_size_ = st.st_size;
+  records_ = reinterpret_cast<const SmcTraceRecord_t*>(static_cast<const char*>(map) + sizeof(SmcTraceHeader_t));
+  record_count_ = (map_size_ - sizeof(SmcTraceHeader_t)) / sizeof(SmcTraceRecord_t);
+  for (size_t i = 0; i < record_count_; i++) {
+    const SmcTraceRecord_t& record = records_[i];
+    replies_[ReplyId(record.command, record.key, record.data32)].records.push_back(static_cast<uint32_t>(i));
+  }
+  if (record_count_ > 0) {
+    duration_ns_ = records_[record_count_ - 1].offsetNs + 1;
+  }
+}
+
+ReplaySmcTransport::~ReplaySmcTransport() {
+  if (map_ != nullptr) {
+    munmap(map_, map_size_);
+  }
+}
+
+kern_return_t ReplaySmcTransport::Open() {
+  if (map_ == nullptr) {
+    return kIOReturnNotOpen;
+  }
+  is_open_ = true;
+  open_ns_ = MonotonicNs();
+  return kIOReturnSuccess;
+}
+
+kern_return_t ReplaySmcTransport::Close() {
+  is_open_ = false;
+  return kIOReturnSuccess;
+}
+
+kern_return_t ReplaySmcTransport::Call(int index, SmcKeyData_t *inputStructure, SmcKeyData_t *outputStructure) {
+  if (!is_open_) {
+    return kIOReturnNotOpen;
+  }
+  memset(outputStructure, 0, sizeof(SmcKeyData_t));
+  int64_t due_ns = 0;
+  const SmcTraceRecord_t* record = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = replies_.find(ReplyId(static_cast<uint8_t>(inputStructure->data8), inputStructure->key,
+                                    inputStructure->data32));
+    if (it == replies_.end()) {
+      outputStructure->result = static_cast<char>(kSmcKeyNotFound);
+      return kIOReturnSuccess;
+    }
+    Replies& replies = it->second;
+    record = &records_[replies.records[replies.next]];
+    due_ns = open_ns_ + replies.laps * duration_ns_ + record->offsetNs;
+    if (++replies.next == replies.records.size()) {
+      replies.next = 0;
+      replies.laps++;
+    }
+  }
+  if (speed_ == kRecorded) {
+    SleepUntil(due_ns);
+  }
+  if (record->index != static_cast<uint32_t>(index)) {
+    return kIOReturnBadArgument;
+  }
+  outputStructure->key = record->replyKey;
+  outputStructure->result = static_cast<char>(record->result);
+  outputStructure->keyInfo.dataSize = record->keyDataSize;
+  outputStructure->keyInfo.dataType = record->keyDataType;
+  outputStructure->keyInfo.dataAttributes = static_cast<char>(record->keyAttributes);
+  memcpy(outputStructure->bytes, record->bytes, sizeof(record->bytes));
+  return record->status;
+}
+}
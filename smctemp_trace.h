@@ -0,0 +1,112 @@
+#ifndef SMCTEMP_SMCTEMP_TRACE_H_
+#define SMCTEMP_SMCTEMP_TRACE_H_
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "smctemp_transport.h"
+
+namespace smctemp {
+// A trace file is a SmcTraceHeader_t followed by fixed-size records, one per
+// SmcTransport::Call, so it can be mapped and indexed as an array. A record
+// keeps the request fields the SMC looks at and the reply fields SmcAccessor
+// reads.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t reserved;
+  int64_t  startRealtimeNs;  // CLOCK_REALTIME when recording started
+} SmcTraceHeader_t;
+
+typedef struct {
+  int64_t    offsetNs;       // since recording started, CLOCK_MONOTONIC
+  int32_t    status;         // kern_return_t of the call
+  uint32_t   index;          // kernel index
+  uint32_t   key;            // request
+  uint32_t   data32;         // request, the position for kSmcCmdReadIndex
+  uint32_t   dataSize;       // request, the size for kSmcCmdReadBytes
+  uint8_t    command;        // request data8
+  int8_t     result;         // reply
+  uint8_t    keyAttributes;  // reply keyInfo.dataAttributes
+  uint8_t    reserved;
+  uint32_t   replyKey;
+  uint32_t   keyDataSize;    // reply keyInfo.dataSize
+  uint32_t   keyDataType;    // reply keyInfo.dataType
+  SmcBytes_t bytes;          // reply
+} SmcTraceRecord_t;
+
+// Passes every call through to transport and appends it to the trace file
+// at path. Records are written in batches and when the transport is closed
+// or destroyed.
+class RecordingSmcTransport : public SmcTransport {
+ private:
+  void Flush();
+
+  std::unique_ptr<SmcTransport> transport_;
+  int fd_ = -1;
+  int64_t start_ns_ = 0;
+  std::mutex mutex_;
+  std::vector<SmcTraceRecord_t> pending_;
+  uint64_t records_ = 0;
+
+ public:
+  RecordingSmcTransport(std::unique_ptr<SmcTransport> transport, const std::string& path);
+  ~RecordingSmcTransport() override;
+  bool IsOpen() const { return fd_ >= 0; }
+  kern_return_t Open() override;
+  kern_return_t Close() override;
+  kern_return_t Call(int index, SmcKeyData_t *inputStructure, SmcKeyData_t *outputStructure) override;
+  uint64_t Records() const { return records_; }
+};
+
+// Answers calls from a mapped trace file. Each request gets the next
+// recorded reply to the same command and key (or position, for
+// kSmcCmdReadIndex), starting over at the first one when they run out, so a
+// run that makes the same calls as the recorded one sees the same replies in
+// the same order, and a run that makes fewer or more still gets the values
+// of its keys. A key the trace never asked for is reported as not found.
+// kRecorded paces the replies to the recorded offsets, measured from Open().
+class ReplaySmcTransport : public SmcTransport {
+ public:
+  enum Speed {
+    kAsFastAsPossible,
+    kRecorded,
+  };
+
+ private:
+  struct Replies {
+    std::vector<uint32_t> records;
+    size_t next = 0;
+    uint32_t laps = 0;
+  };
+
+  const SmcTraceRecord_t* records_ = nullptr;
+  size_t record_count_ = 0;
+  size_t map_size_ = 0;
+  void* map_ = nullptr;
+  const Speed speed_;
+  int64_t duration_ns_ = 0;
+  int64_t open_ns_ = 0;
+  bool is_open_ = false;
+  std::mutex mutex_;
+  std::unordered_map<uint64_t, Replies> replies_;
+
+ public:
+  explicit ReplaySmcTransport(const std::string& path, Speed speed = kAsFastAsPossible);
+  ~ReplaySmcTransport() override;
+  ReplaySmcTransport(const ReplaySmcTransport&) = delete;
+  ReplaySmcTransport& operator=(const ReplaySmcTransport&) = delete;
+  // False if the file is missing or not a trace.
+  bool IsLoaded() const { return map_ != nullptr; }
+  size_t RecordCount() const { return record_count_; }
+  kern_return_t Open() override;
+  kern_return_t Close() override;
+  kern_return_t Call(int index, SmcKeyData_t *inputStructure, SmcKeyData_t *outputStructure) override;
+};
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_TRACE_H_
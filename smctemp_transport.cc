@@ -0,0 +1,268 @@
+#include "smctemp_transport.h"
+
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include "smctemp.h"
+#include "smctemp_string.h"
+
+namespace smctemp {
+namespace {
+constexpr uint32_t kKeyCountKey = FourCC("#KEY");
+}
+
+#if defined(__APPLE__)
+kern_return_t IOKitSmcTransport::Open() {
+  mach_port_t masterPort;
+  IOMasterPort(MACH_PORT_NULL, &masterPort);
+  CFMutableDictionaryRef matchingDictionary = IOServiceMatching(kIOAppleSmcHiddenClassName);
+
+  io_iterator_t iterator;
+  kern_return_t result = IOServiceGetMatchingServices(masterPort, matchingDictionary, &iterator);
+  if (result != kIOReturnSuccess) {
+    std::ios_base::fmtflags ef(std::cerr.flags());
+    std::cerr << "Error: IOServiceGetMatchingServices() = "
+      << std::hex << result << std::endl;
+    std::cerr.flags(ef);
+    return result;
+  }
+
+  io_object_t device = IOIteratorNext(iterator);
+  IOObjectRelease(iterator);
+  if (device == 0) {
+    std::ios_base::fmtflags ef(std::cerr.flags());
+    std::cerr << "Error: no Smc found" << std::endl;
+    std::cerr.flags(ef);
+    return result;
+  }
+
+  result = IOServiceOpen(device, mach_task_self(), 0, &conn_);
+  IOObjectRelease(device);
+  if (result != kIOReturnSuccess) {
+    std::ios_base::fmtflags ef(std::cerr.flags());
+    std::cerr << "Error: IOServiceGetMatchingServices() = "
+      << std::hex << result << std::endl;
+    std::cerr.flags(ef);
+    return result;
+  }
+  return kIOReturnSuccess;
+}
+
+kern_return_t IOKitSmcTransport::Close() {
+  return IOServiceClose(conn_);
+}
+
+kern_return_t IOKitSmcTransport::Call(int index, SmcKeyData_t *inputStructure, SmcKeyData_t *outputStructure) {
+  size_t   structureInputSize;
+  size_t   structureOutputSize;
+  structureInputSize = sizeof(SmcKeyData_t);
+  structureOutputSize = sizeof(SmcKeyData_t);
+
+  return IOConnectCallStructMethod(conn_, index, inputStructure, structureInputSize, outputStructure, &structureOutputSize);
+}
+#endif
+
+SimulatedSmcTransport::SimulatedSmcTransport() : rng_(0x5eed) {
+  UpdateKeyCount();
+}
+
+kern_return_t SimulatedSmcTransport::Open() {
+  is_open_ = true;
+  return kIOReturnSuccess;
+}
+
+kern_return_t SimulatedSmcTransport::Close() {
+  is_open_ = false;
+  return kIOReturnSuccess;
+}
+
+void SimulatedSmcTransport::Delay() {
+  if (latency_.count() <= 0) {
+    return;
+  }
+  // Kernel round-trips are a few microseconds, which is below the sleep
+  // granularity of most schedulers, so short latencies are spun.
+  if (latency_ >= std::chrono::milliseconds(1)) {
+    std::this_thread::sleep_for(latency_);
+    return;
+  }
+  const auto deadline = std::chrono::steady_clock::now() + latency_;
+  while (std::chrono::steady_clock::now() < deadline) {
+  }
+}
+
+bool SimulatedSmcTransport::ShouldFail() {
+  if (failure_rate_ <= 0.0) {
+    return false;
+  }
+  return uniform_(rng_) < failure_rate_;
+}
+
+kern_return_t SimulatedSmcTransport::Call(int index, SmcKeyData_t *inputStructure, SmcKeyData_t *outputStructure) {
+  if (!is_open_) {
+    return kIOReturnNotOpen;
+  }
+  if (index != static_cast<int>(kKernelIndexSmc)) {
+    return kIOReturnBadArgument;
+  }
+
+  switch (inputStructure->data8) {
+    case kSmcCmdReadKeyInfo:
+      key_info_calls_.fetch_add(1, std::memory_order_relaxed);
+      break;
+    case kSmcCmdReadBytes:
+      read_bytes_calls_.fetch_add(1, std::memory_order_relaxed);
+      break;
+    case kSmcCmdReadIndex:
+      read_index_calls_.fetch_add(1, std::memory_order_relaxed);
+      break;
+    default:
+      return kIOReturnBadArgument;
+  }
+
+  Delay();
+  if (ShouldFail()) {
+    failed_calls_.fetch_add(1, std::memory_order_relaxed);
+    return kIOReturnError;
+  }
+
+  memset(outputStructure, 0, sizeof(SmcKeyData_t));
+  if (inputStructure->data8 == kSmcCmdReadIndex) {
+    if (inputStructure->data32 >= entries_.size()) {
+      outputStructure->result = static_cast<char>(kSmcKeyNotFound);
+      return kIOReturnSuccess;
+    }
+    outputStructure->key = entries_[inputStructure->data32].key;
+    return kIOReturnSuccess;
+  }
+
+  auto it = entry_index_.find(inputStructure->key);
+  if (it == entry_index_.end()) {
+    outputStructure->result = static_cast<char>(kSmcKeyNotFound);
+    return kIOReturnSuccess;
+  }
+  const Entry& entry = entries_[it->second];
+  outputStructure->key = entry.key;
+  if (inputStructure->data8 == kSmcCmdReadKeyInfo) {
+    outputStructure->keyInfo = entry.keyInfo;
+  } else if (zero_read_rate_ == 0.0 || entry.key == kKeyCountKey || uniform_(rng_) >= zero_read_rate_) {
+    memcpy(outputStructure->bytes, entry.bytes, sizeof(entry.bytes));
+  }
+  return kIOReturnSuccess;
+}
+
+void SimulatedSmcTransport::SetKey(const UInt32Char_t key, const UInt32Char_t data_type,
+                                   uint32_t data_size, const void* bytes) {
+  Entry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.key = string_util::strtoul(key, 4, 16);
+  entry.keyInfo.dataSize = data_size;
+  entry.keyInfo.dataType = string_util::strtoul(data_type, 4, 16);
+  if (data_size > sizeof(entry.bytes)) {
+    data_size = sizeof(entry.bytes);
+  }
+  memcpy(entry.bytes, bytes, data_size);
+
+  auto it = entry_index_.find(entry.key);
+  if (it != entry_index_.end()) {
+    entries_[it->second] = entry;
+    return;
+  }
+  entry_index_[entry.key] = entries_.size();
+  entries_.push_back(entry);
+  UpdateKeyCount();
+}
+
+void SimulatedSmcTransport::SetTemperature(const UInt32Char_t key, double celsius) {
+#if defined(ARCH_TYPE_X86_64)
+  uint16_t raw = htons(static_cast<uint16_t>(static_cast<int16_t>(celsius * 256.0)));
+  SetKey(key, kDataTypeSp78, sizeof(raw), &raw);
+#else
+  float raw = static_cast<float>(celsius);
+  SetKey(key, kDataTypeFlt, sizeof(raw), &raw);
+#endif
+}
+
+void SimulatedSmcTransport::RemoveKey(const UInt32Char_t key) {
+  auto it = entry_index_.find(string_util::strtoul(key, 4, 16));
+  if (it == entry_index_.end()) {
+    return;
+  }
+  entries_.erase(entries_.begin() + it->second);
+  entry_index_.clear();
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    entry_index_[entries_[i].key] = i;
+  }
+  UpdateKeyCount();
+}
+
+void SimulatedSmcTransport::UpdateKeyCount() {
+  // "#KEY" holds the number of keys as a big-endian ui32, itself included.
+  const uint32_t key = kKeyCountKey;
+  if (entry_index_.find(key) == entry_index_.end()) {
+    Entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.key = key;
+    entry.keyInfo.dataSize = 4;
+    entry.keyInfo.dataType = string_util::strtoul(kDataTypeUi32, 4, 16);
+    entry_index_[key] = entries_.size();
+    entries_.push_back(entry);
+  }
+  const uint32_t count = htonl(static_cast<uint32_t>(entries_.size()));
+  memcpy(entries_[entry_index_[key]].bytes, &count, sizeof(count));
+}
+
+void SimulatedSmcTransport::ResetCallCounts() {
+  key_info_calls_.store(0, std::memory_order_relaxed);
+  read_bytes_calls_.store(0, std::memory_order_relaxed);
+  read_index_calls_.store(0, std::memory_order_relaxed);
+  failed_calls_.store(0, std::memory_order_relaxed);
+}
+
+void PopulateDefaultSensorKeys(SimulatedSmcTransport& smc) {
+#if defined(ARCH_TYPE_X86_64)
+  smc.SetTemperature(kSensorTC0D, 52.5);
+  smc.SetTemperature(kSensorTC0E, 52.0);
+  smc.SetTemperature(kSensorTC0F, 51.75);
+  smc.SetTemperature(kSensorTC0P, 48.25);
+  smc.SetTemperature(kSensorTG0D, 44.5);
+  smc.SetTemperature(kSensorTPCD, 45.0);
+#elif defined(ARCH_TYPE_ARM64)
+  const char* cpu_sensors[] = {
+    kSensorTc0a, kSensorTc0b, kSensorTc0x, kSensorTc0z,
+    kSensorTp00, kSensorTp01, kSensorTp04, kSensorTp05, kSensorTp08, kSensorTp09,
+    kSensorTp0C, kSensorTp0D, kSensorTp0G, kSensorTp0H, kSensorTp0K, kSensorTp0L,
+    kSensorTp0O, kSensorTp0P, kSensorTp0R, kSensorTp0T, kSensorTp0U, kSensorTp0X,
+    kSensorTp0a, kSensorTp0b, kSensorTp0d, kSensorTp0f, kSensorTp0g, kSensorTp0j,
+    kSensorTp0m, kSensorTp0n, kSensorTp0p, kSensorTp0r, kSensorTp0u, kSensorTp0y,
+    kSensorTp1h, kSensorTp1t, kSensorTp1p, kSensorTp1l,
+  };
+  const char* gpu_sensors[] = {
+    kSensorTg05, kSensorTg0D, kSensorTg0L, kSensorTg0P, kSensorTg0T, kSensorTg0U,
+    kSensorTg0X, kSensorTg0b, kSensorTg0d, kSensorTg0f, kSensorTg0g, kSensorTg0j,
+    kSensorTg0v, kSensorTg1Y, kSensorTg1b, kSensorTg1c, kSensorTg1g, kSensorTg4b,
+  };
+  for (size_t i = 0; i < COUNT_OF(cpu_sensors); ++i) {
+    smc.SetTemperature(cpu_sensors[i], 48.0 + (i % 8) * 0.75);
+  }
+  for (size_t i = 0; i < COUNT_OF(gpu_sensors); ++i) {
+    smc.SetTemperature(gpu_sensors[i], 38.0 + (i % 4) * 0.5);
+  }
+#endif
+  const uint8_t fan_count = 1;
+  smc.SetKey("FNum", kDataTypeUi8, sizeof(fan_count), &fan_count);
+  const uint16_t fan_speed = htons(1200 << 2);
+  smc.SetKey("F0Ac", kDataTypeFpe2, sizeof(fan_speed), &fan_speed);
+}
+
+std::unique_ptr<SmcTransport> MakeDefaultSmcTransport() {
+#if defined(__APPLE__)
+  return std::make_unique<IOKitSmcTransport>();
+#else
+  auto smc = std::make_unique<SimulatedSmcTransport>();
+  PopulateDefaultSensorKeys(*smc);
+  return smc;
+#endif
+}
+}
@@ -0,0 +1,116 @@
+#ifndef SMCTEMP_SMCTEMP_TRANSPORT_H_
+#define SMCTEMP_SMCTEMP_TRANSPORT_H_
+
+#if defined(__APPLE__)
+#include <IOKit/IOKitLib.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "smctemp_types.h"
+
+#if !defined(__APPLE__)
+// Minimal stand-ins for the IOKit types and return codes so that the read path
+// can be built against the simulated SMC on non-Apple hosts.
+typedef int kern_return_t;
+typedef unsigned int io_connect_t;
+constexpr kern_return_t kIOReturnSuccess = 0;
+constexpr kern_return_t kIOReturnError = static_cast<kern_return_t>(0xe00002bc);
+constexpr kern_return_t kIOReturnBadArgument = static_cast<kern_return_t>(0xe00002c2);
+constexpr kern_return_t kIOReturnNotOpen = static_cast<kern_return_t>(0xe00002cd);
+constexpr kern_return_t kIOReturnNotFound = static_cast<kern_return_t>(0xe00002f0);
+#endif
+
+namespace smctemp {
+// Value of SmcKeyData_t::result when the requested key does not exist.
+constexpr int kSmcKeyNotFound = 132;
+
+// Carries SmcKeyData_t exchanges to an SMC. SmcAccessor only talks to the SMC
+// through this interface so that the read path does not depend on IOKit.
+class SmcTransport {
+ public:
+  virtual ~SmcTransport() = default;
+  virtual kern_return_t Open() = 0;
+  virtual kern_return_t Close() = 0;
+  virtual kern_return_t Call(int index, SmcKeyData_t *inputStructure, SmcKeyData_t *outputStructure) = 0;
+};
+
+#if defined(__APPLE__)
+class IOKitSmcTransport : public SmcTransport {
+ private:
+  io_connect_t conn_ = 0;
+
+ public:
+  kern_return_t Open() override;
+  kern_return_t Close() override;
+  kern_return_t Call(int index, SmcKeyData_t *inputStructure, SmcKeyData_t *outputStructure) override;
+};
+#endif
+
+// In-process SMC answering kSmcCmdReadKeyInfo, kSmcCmdReadBytes and
+// kSmcCmdReadIndex from an in-memory key table.
+class SimulatedSmcTransport : public SmcTransport {
+ private:
+  struct Entry {
+    uint32_t key;
+    SmcKeyData_keyInfo_t keyInfo;
+    SmcBytes_t bytes;
+  };
+  void Delay();
+  bool ShouldFail();
+  void UpdateKeyCount();
+
+  std::vector<Entry> entries_;
+  std::unordered_map<uint32_t, size_t> entry_index_;
+  std::chrono::nanoseconds latency_{0};
+  double failure_rate_ = 0.0;
+  double zero_read_rate_ = 0.0;
+  std::mt19937 rng_;
+  std::uniform_real_distribution<double> uniform_{0.0, 1.0};
+  bool is_open_ = false;
+  std::atomic<uint64_t> key_info_calls_{0};
+  std::atomic<uint64_t> read_bytes_calls_{0};
+  std::atomic<uint64_t> read_index_calls_{0};
+  std::atomic<uint64_t> failed_calls_{0};
+
+ public:
+  SimulatedSmcTransport();
+  kern_return_t Open() override;
+  kern_return_t Close() override;
+  kern_return_t Call(int index, SmcKeyData_t *inputStructure, SmcKeyData_t *outputStructure) override;
+
+  void SetKey(const UInt32Char_t key, const UInt32Char_t data_type, uint32_t data_size, const void* bytes);
+  // Stores a temperature using the encoding of the build architecture
+  // ("sp78" on x86_64, "flt " on arm64).
+  void SetTemperature(const UInt32Char_t key, double celsius);
+  void RemoveKey(const UInt32Char_t key);
+  void SetLatency(std::chrono::nanoseconds latency) { latency_ = latency; }
+  void SetFailureRate(double failure_rate) { failure_rate_ = failure_rate; }
+  // Fraction of byte reads of sensor keys (all but #KEY) that succeed but
+  // return zeroed bytes, as flaky sensors on M2 machines do.
+  void SetZeroReadRate(double zero_read_rate) { zero_read_rate_ = zero_read_rate; }
+  void SetSeed(uint32_t seed) { rng_.seed(seed); }
+  size_t KeyCount() const { return entries_.size(); }
+
+  uint64_t KeyInfoCalls() const { return key_info_calls_.load(std::memory_order_relaxed); }
+  uint64_t ReadBytesCalls() const { return read_bytes_calls_.load(std::memory_order_relaxed); }
+  uint64_t ReadIndexCalls() const { return read_index_calls_.load(std::memory_order_relaxed); }
+  uint64_t FailedCalls() const { return failed_calls_.load(std::memory_order_relaxed); }
+  uint64_t TotalCalls() const { return KeyInfoCalls() + ReadBytesCalls() + ReadIndexCalls(); }
+  void ResetCallCounts();
+};
+
+// IOKit on macOS, otherwise a simulated SMC populated with the sensor keys
+// known to smctemp.
+std::unique_ptr<SmcTransport> MakeDefaultSmcTransport();
+void PopulateDefaultSensorKeys(SimulatedSmcTransport& smc);
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_TRANSPORT_H_
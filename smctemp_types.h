@@ -74,6 +74,7 @@ typedef struct {
   uint32_t     dataSize;
   UInt32Char_t dataType;
   SmcBytes_t   bytes;
+  uint32_t     dataTypeCode;
 } SmcVal_t;
 }
 #endif // #ifndef SMCTEMP_SMCTEMP_TYPE_H_
@@ -0,0 +1,116 @@
+#include "smctemp_writer.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+
+// libc++ has floating-point std::to_chars from macOS 13.3 on.
+#if defined(__ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__) && __ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__ < 130300
+#define SMCTEMP_HAVE_FLOAT_TO_CHARS 0
+#else
+#define SMCTEMP_HAVE_FLOAT_TO_CHARS 1
+#endif
+
+namespace smctemp {
+BufferedWriter::BufferedWriter(int fd) : fd_(fd) {
+}
+
+BufferedWriter::~BufferedWriter() {
+  Flush();
+}
+
+void BufferedWriter::Append(const char* data, size_t size) {
+  while (size > 0) {
+    if (length_ == kCapacity) {
+      Flush();
+    }
+    size_t chunk = kCapacity - length_ < size ? kCapacity - length_ : size;
+    memcpy(buffer_ + length_, data, chunk);
+    length_ += chunk;
+    data += chunk;
+    size -= chunk;
+  }
+}
+
+void BufferedWriter::Append(char c) {
+  if (length_ == kCapacity) {
+    Flush();
+  }
+  buffer_[length_++] = c;
+}
+
+void BufferedWriter::AppendPadded(const char* data, size_t size, size_t width) {
+  for (size_t i = size; i < width; i++) {
+    Append(' ');
+  }
+  Append(data, size);
+}
+
+void BufferedWriter::AppendFixed(double value, int precision) {
+  char digits[384];
+#if SMCTEMP_HAVE_FLOAT_TO_CHARS
+  const std::to_chars_result result =
+    std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::fixed, precision);
+  if (result.ec == std::errc()) {
+    Append(digits, result.ptr - digits);
+    return;
+  }
+#endif
+  int size = snprintf(digits, sizeof(digits), "%.*f", precision, value);
+  if (size > 0) {
+    Append(digits, static_cast<size_t>(size) < sizeof(digits) ? size : sizeof(digits) - 1);
+  }
+}
+
+void BufferedWriter::AppendNumber(double value) {
+  char digits[32];
+#if SMCTEMP_HAVE_FLOAT_TO_CHARS
+  const std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+  if (result.ec == std::errc()) {
+    Append(digits, result.ptr - digits);
+    return;
+  }
+#endif
+  int size = snprintf(digits, sizeof(digits), "%.17g", value);
+  if (size > 0) {
+    Append(digits, static_cast<size_t>(size) < sizeof(digits) ? size : sizeof(digits) - 1);
+  }
+}
+
+void BufferedWriter::AppendUnsigned(uint64_t value) {
+  char digits[20];
+  const std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+  Append(digits, result.ptr - digits);
+}
+
+void BufferedWriter::AppendSigned(int64_t value) {
+  char digits[20];
+  const std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+  Append(digits, result.ptr - digits);
+}
+
+void BufferedWriter::AppendHexByte(uint8_t byte) {
+  static constexpr char kHexDigits[] = "0123456789ABCDEF";
+  Append(kHexDigits[byte >> 4]);
+  Append(kHexDigits[byte & 0xf]);
+}
+
+bool BufferedWriter::Flush() {
+  size_t offset = 0;
+  while (offset < length_ && !failed_) {
+    ssize_t written = write(fd_, buffer_ + offset, length_ - offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      failed_ = true;
+      break;
+    }
+    offset += static_cast<size_t>(written);
+  }
+  length_ = 0;
+  return !failed_;
+}
+}
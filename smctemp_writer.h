@@ -0,0 +1,42 @@
+#ifndef SMCTEMP_SMCTEMP_WRITER_H_
+#define SMCTEMP_SMCTEMP_WRITER_H_
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace smctemp {
+// Collects output in a fixed buffer and hands it to write(2) in large chunks,
+// so that printing thousands of short lines costs a handful of system calls
+// and no allocation.
+class BufferedWriter {
+ private:
+  static constexpr size_t kCapacity = 16384;
+  int fd_;
+  size_t length_ = 0;
+  bool failed_ = false;
+  char buffer_[kCapacity];
+
+ public:
+  explicit BufferedWriter(int fd);
+  ~BufferedWriter();
+  BufferedWriter(const BufferedWriter&) = delete;
+  BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+  void Append(const char* data, size_t size);
+  void Append(const char* str) { Append(str, strlen(str)); }
+  void Append(char c);
+  // Right-aligns data in a field of width characters, like std::setw.
+  void AppendPadded(const char* data, size_t size, size_t width);
+  // printf("%.*f") without the intermediate string.
+  void AppendFixed(double value, int precision);
+  // The shortest digits that read back as value, e.g. 51.75 or 1e+20.
+  void AppendNumber(double value);
+  void AppendUnsigned(uint64_t value);
+  void AppendSigned(int64_t value);
+  // Two upper case hex digits.
+  void AppendHexByte(uint8_t byte);
+  // False if any write failed since the writer was created.
+  bool Flush();
+};
+}
+#endif // #ifndef SMCTEMP_SMCTEMP_WRITER_H_